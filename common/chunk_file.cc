@@ -1,11 +1,104 @@
 #include "tlbcore/common/std_headers.h"
 #include "./chunk_file.h"
+#include "./zstd_io.h"
+#include "./crc32c.h"
+#include <zstd.h>
+#include <thread>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 static size_t roundUp(size_t baseSize) {
   return (baseSize+7) & ~7;
 }
 
+/*
+  Chunk layout in files:
+    u64 size
+    data, padded to a multiple of 8
+  or, when ChunkFile::checksums is set:
+    u64 size | CHUNK_HAS_CRC
+    u32 crc32c of data
+    u32 CHUNK_CRC_MAGIC
+    data, padded to a multiple of 8
+  writeChunk returns the offset of the data either way, so readers find a checksum by looking
+  for the magic just before the data. (For an unchecksummed chunk that word is the top half
+  of the size, which is never the magic.)
+
+  A file written with checksums from the start begins with a marker: a checksummed header for
+  an empty chunk. Readers then insist on a good checksum for every chunk, so a header damaged
+  by a partial write is an error rather than looking like a chunk without one.
+*/
+static const uint64_t CHUNK_HAS_CRC = uint64_t(1) << 63;
+static const U32 CHUNK_CRC_MAGIC = 0x43524331;
+
+static size_t fillFileMarker(char *hdr)
+{
+  uint64_t sizeWord = CHUNK_HAS_CRC;
+  U32 crc = 0;
+  memcpy(hdr, &sizeWord, 8);
+  memcpy(hdr + 8, &crc, 4);
+  memcpy(hdr + 12, &CHUNK_CRC_MAGIC, 4);
+  return 16;
+}
+
+static bool hasFileMarker(char const *base, size_t total)
+{
+  char marker[16];
+  return total >= 16 && memcmp(base, marker, fillFileMarker(marker)) == 0;
+}
+
+static size_t fillChunkHeader(char *hdr, char const *data, size_t size, bool checksums)
+{
+  uint64_t sizeWord = (uint64_t)size;
+  if (!checksums) {
+    memcpy(hdr, &sizeWord, 8);
+    return 8;
+  }
+  sizeWord |= CHUNK_HAS_CRC;
+  U32 crc = crc32c(0, data, size);
+  memcpy(hdr, &sizeWord, 8);
+  memcpy(hdr + 8, &crc, 4);
+  memcpy(hdr + 12, &CHUNK_CRC_MAGIC, 4);
+  return 16;
+}
+
+/*
+  Verify the checksum of the chunk whose data starts at off, in a file loaded into memory at
+  base, before reading size bytes of it. size can be less than the whole chunk, but the whole
+  chunk gets checked. Returns true if it's good, or if it has no checksum and required is false.
+*/
+static bool checkChunk(char const *base, size_t total, off_t off, size_t size, bool required)
+{
+  if (off < 16 || (size_t)off > total) return !required;
+  U32 magic;
+  memcpy(&magic, base + off - 4, 4);
+  if (magic != CHUNK_CRC_MAGIC) return !required;
+  uint64_t sizeWord;
+  memcpy(&sizeWord, base + off - 16, 8);
+  if (!(sizeWord & CHUNK_HAS_CRC)) return false;
+  size_t chunkSize = (size_t)(sizeWord & ~CHUNK_HAS_CRC);
+  if (size > chunkSize || chunkSize > total - (size_t)off) return false;
+  U32 crc;
+  memcpy(&crc, base + off - 8, 4);
+  return crc32c(0, base + off, chunkSize) == crc;
+}
+
+/*
+  Whether a file's chunks should all have checksums: it starts with the marker, or (for files
+  where checksums was turned on after the writer was made) the first chunk has one.
+*/
+static bool fileHasChecksums(char const *base, size_t total)
+{
+  if (hasFileMarker(base, total)) return true;
+  if (total < 16) return false;
+  uint64_t sizeWord;
+  U32 magic;
+  memcpy(&sizeWord, base, 8);
+  memcpy(&magic, base + 12, 4);
+  return (sizeWord & CHUNK_HAS_CRC) && magic == CHUNK_CRC_MAGIC;
+}
+
 
 ChunkFile::ChunkFile(string const &_fn)
 :fn(_fn)
@@ -17,13 +110,24 @@ ChunkFile::~ChunkFile()
 }
 
 
-ChunkFileUncompressed::ChunkFileUncompressed(string const &_fn)
+ChunkFileUncompressed::ChunkFileUncompressed(string const &_fn, bool _checksums)
  :ChunkFile(_fn)
 {
   fd = open(fn.c_str(), O_CREAT|O_WRONLY, 0666);
   if (fd < 0) {
     throw runtime_error(string("Open ") + fn + string(": ") + string(strerror(errno)));
   }
+  checksums = _checksums;
+  if (checksums) {
+    char marker[16];
+    size_t markerLen = fillFileMarker(marker);
+    if (pwrite(fd, marker, markerLen, 0) != (ssize_t)markerLen) {
+      close(fd);
+      fd = -1;
+      throw runtime_error(string("Write ") + fn + string(": ") + string(strerror(errno)));
+    }
+    off = markerLen;
+  }
 }
 ChunkFileUncompressed::~ChunkFileUncompressed()
 {
@@ -46,23 +150,24 @@ off_t ChunkFileUncompressed::writeChunk(char const *data, size_t size)
       lock
       xaddq  %rbx, 0x90(this)
   */
-  off_t baseOff = off.fetch_add(roundUp(size) + 8);
+  char hdr[16];
+  size_t hdrLen = fillChunkHeader(hdr, data, size, checksums);
+  off_t baseOff = off.fetch_add(roundUp(size) + hdrLen);
   ssize_t rc;
 
-  uint64_t partTotalBytes = (uint64_t)size;
-  rc = pwrite(fd, &partTotalBytes, sizeof(uint64_t), baseOff + 0);
+  rc = pwrite(fd, hdr, hdrLen, baseOff + 0);
   if (rc < 0) {
     eprintf("write chunk: %s\n", strerror(errno));
     errFlag = true;
     return -1;
   }
-  rc = pwrite(fd, data, size, baseOff+8);
+  rc = pwrite(fd, data, size, baseOff + hdrLen);
   if (rc < 0) {
     eprintf("write chunk: %s\n", strerror(errno));
     errFlag = true;
     return -1;
   }
-  return baseOff + 8;
+  return baseOff + hdrLen;
 }
 
 bool ChunkFileUncompressed::readChunk(char *data, off_t off, size_t size)
@@ -76,13 +181,24 @@ size_t ChunkFileUncompressed::size()
 }
 
 
-ChunkFileCompressed::ChunkFileCompressed(string const &_fn)
+ChunkFileCompressed::ChunkFileCompressed(string const &_fn, bool _checksums)
  :ChunkFile(_fn)
 {
   gzfp = gzopen((fn + ".gz").c_str(), "wb");
   if (!gzfp) {
     throw runtime_error(string("Open ") + fn + string(": ") + string(strerror(errno)));
   }
+  checksums = _checksums;
+  if (checksums) {
+    char marker[16];
+    size_t markerLen = fillFileMarker(marker);
+    if (gzwrite(gzfp, marker, markerLen) <= 0) {
+      gzclose(gzfp);
+      gzfp = nullptr;
+      throw runtime_error(string("Write ") + fn + string(": ") + string(strerror(errno)));
+    }
+    off = markerLen;
+  }
 }
 ChunkFileCompressed::~ChunkFileCompressed() {
   if (gzfp) {
@@ -97,11 +213,12 @@ off_t ChunkFileCompressed::writeChunk(char const *data, size_t size)
   if (size == 0) return 0;
   std::unique_lock< std::mutex > lock(mutex);
 
+  char hdr[16];
+  size_t hdrLen = fillChunkHeader(hdr, data, size, checksums);
   off_t baseOff = off;
-  off += (roundUp(size)+8);
+  off += (roundUp(size) + hdrLen);
 
-  uint64_t partTotalBytes = (uint64_t)size;
-  if (gzwrite(gzfp, &partTotalBytes, sizeof(partTotalBytes)) <= 0) {
+  if (gzwrite(gzfp, hdr, hdrLen) <= 0) {
     eprintf("gzwrite chunk: %s\n", strerror(errno));
     errFlag = true;
     return -1;
@@ -120,7 +237,7 @@ off_t ChunkFileCompressed::writeChunk(char const *data, size_t size)
       return -1;
     }
   }
-  return baseOff + 8;
+  return baseOff + hdrLen;
 }
 
 bool ChunkFileCompressed::readChunk(char *data, off_t off, size_t size)
@@ -134,6 +251,117 @@ size_t ChunkFileCompressed::size()
 }
 
 
+ChunkFileZstd::ChunkFileZstd(string const &_fn, int _level, bool _checksums)
+ :ChunkFile(_fn)
+{
+  fp = fopen((fn + ".zst").c_str(), "wb");
+  if (!fp) {
+    throw runtime_error(string("Open ") + fn + string(": ") + string(strerror(errno)));
+  }
+  cctx = ZSTD_createCCtx();
+  if (!cctx) {
+    fclose(fp);
+    fp = nullptr;
+    throw runtime_error(string("ZSTD_createCCtx ") + fn + string(": failed"));
+  }
+  size_t rc = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, _level);
+  if (ZSTD_isError(rc)) {
+    fclose(fp);
+    fp = nullptr;
+    ZSTD_freeCCtx(cctx);
+    cctx = nullptr;
+    throw runtime_error(string("zstd level ") + to_string(_level) + string(" for ") + fn + string(": ") + string(ZSTD_getErrorName(rc)));
+  }
+  outBuf.resize(ZSTD_CStreamOutSize());
+  checksums = _checksums;
+  if (checksums) {
+    char marker[16];
+    size_t markerLen = fillFileMarker(marker);
+    if (!writeCompressed(marker, markerLen)) {
+      fclose(fp);
+      fp = nullptr;
+      ZSTD_freeCCtx(cctx);
+      cctx = nullptr;
+      throw runtime_error(string("Write ") + fn + string(": zstd"));
+    }
+    off = markerLen;
+  }
+}
+
+ChunkFileZstd::~ChunkFileZstd()
+{
+  if (fp) {
+    while (true) {
+      ZSTD_inBuffer inb {nullptr, 0, 0};
+      ZSTD_outBuffer outb {&outBuf[0], outBuf.size(), 0};
+      size_t remaining = ZSTD_compressStream2(cctx, &outb, &inb, ZSTD_e_end);
+      if (ZSTD_isError(remaining)) {
+        eprintf("zstd end %s: %s\n", fn.c_str(), ZSTD_getErrorName(remaining));
+        break;
+      }
+      if (fwrite(&outBuf[0], 1, outb.pos, fp) != outb.pos) {
+        eprintf("write %s: %s\n", fn.c_str(), strerror(errno));
+        break;
+      }
+      if (remaining == 0) break;
+    }
+    if (0) eprintf("Wrote %zd bytes to %s\n", off, fn.c_str());
+    fclose(fp);
+    fp = nullptr;
+  }
+  ZSTD_freeCCtx(cctx);
+  cctx = nullptr;
+}
+
+bool ChunkFileZstd::writeCompressed(char const *data, size_t size)
+{
+  ZSTD_inBuffer inb {data, size, 0};
+  while (inb.pos < inb.size) {
+    ZSTD_outBuffer outb {&outBuf[0], outBuf.size(), 0};
+    size_t rc = ZSTD_compressStream2(cctx, &outb, &inb, ZSTD_e_continue);
+    if (ZSTD_isError(rc)) {
+      eprintf("zstd chunk: %s\n", ZSTD_getErrorName(rc));
+      return false;
+    }
+    if (outb.pos > 0 && fwrite(&outBuf[0], 1, outb.pos, fp) != outb.pos) {
+      eprintf("write chunk: %s\n", strerror(errno));
+      return false;
+    }
+  }
+  return true;
+}
+
+off_t ChunkFileZstd::writeChunk(char const *data, size_t size)
+{
+  if (size == 0) return 0;
+  std::unique_lock< std::mutex > lock(mutex);
+
+  char hdr[16];
+  size_t hdrLen = fillChunkHeader(hdr, data, size, checksums);
+  off_t baseOff = off;
+  off += (roundUp(size) + hdrLen);
+
+  char zeros[8] {0};
+  if (!writeCompressed(hdr, hdrLen) ||
+      !writeCompressed(data, size) ||
+      !writeCompressed(zeros, roundUp(size) - size)) {
+    errFlag = true;
+    return -1;
+  }
+  return baseOff + hdrLen;
+}
+
+bool ChunkFileZstd::readChunk(char *data, off_t off, size_t size)
+{
+  return false;
+}
+
+size_t ChunkFileZstd::size()
+{
+  return (size_t)off;
+}
+
+
 ChunkFileReader::ChunkFileReader(string const &_fn)
 :ChunkFile(_fn)
 {
@@ -147,6 +375,11 @@ bool ChunkFileReader::readChunk(char *data, off_t off, size_t size)
   if (off < 0 || off+size > fileContents.size()) {
     return false;
   }
+  if (!checkChunk(fileContents.data(), fileContents.size(), off, size, checksummedFile)) {
+    eprintf("%s: checksum mismatch in chunk at %lld (%zu bytes)\n", fn.c_str(), (long long)off, size);
+    errFlag = true;
+    return false;
+  }
   memcpy(data, &fileContents[off], size);
   return true;
 }
@@ -157,67 +390,13 @@ off_t ChunkFileReader::writeChunk(char const *data, size_t size)
 }
 
 
-void ChunkFileReader::readFile(gzFile gzfp)
-{
-  while (true) {
-    size_t origSize = fileContents.size();
-    size_t chunkSize = 8192 + origSize/2;
-    fileContents.insert(fileContents.end(), chunkSize, 0);
-    int nr = gzread(gzfp, &fileContents[origSize], chunkSize);
-    if (nr < 0) {
-      eprintf("gzread %s: err %d\n", fn.c_str(), nr);
-      errFlag = true;
-      return;
-    }
-    fileContents.resize(origSize + nr);
-    if (nr == 0) break;
-  }
-}
-
-void ChunkFileReader::readFile(FILE *fp)
-{
-  while (true) {
-    size_t origSize = fileContents.size();
-    size_t chunkSize = 8192 + origSize/2;
-    fileContents.insert(fileContents.end(), chunkSize, 0);
-    int nr = fread(&fileContents[origSize], 1, chunkSize, fp);
-    if (nr < 0) {
-      eprintf("gzread %s: err %d\n", fn.c_str(), nr);
-      errFlag = true;
-      return;
-    }
-    fileContents.resize(origSize + nr);
-    if (nr == 0) break;
-  }
-}
-
-
 void ChunkFileReader::loadData()
 {
-  gzFile gzfp = gzopen((fn + ".gz").c_str(), "rb");
-  if (gzfp) {
-    try {
-      readFile(gzfp);
-    }
-    catch (...) {
-      gzclose(gzfp);
-      gzfp = nullptr;
-      throw;
-    }
-    if (gzfp) gzclose(gzfp);
-    return;
-  }
-  FILE *fp = fopen(fn.c_str(), "rb");
-  if (fp) {
-    try {
-      readFile(fp);
-    }
-    catch (...) {
-      fclose(fp);
-      fp = nullptr;
-      throw;
+  for (auto &suffix : {".gz", ".zst", ""}) {
+    if (readFileDecompress(fn + suffix, fileContents)) {
+      checksummedFile = fileHasChecksums(fileContents.data(), fileContents.size());
+      return;
     }
-    if (fp) fclose(fp);
   }
 }
 
@@ -257,3 +436,240 @@ size_t ChunkMemory::size()
 {
   return buf.size();
 }
+
+
+ChunkMemorySegmented::ChunkMemorySegmented(size_t _segSize, size_t _maxSegments)
+:ChunkFile(""),
+ segSize(roundUp(max(_segSize, size_t(4096)))),
+ maxSegments(_maxSegments),
+ segBase(new std::atomic< char * >[_maxSegments]),
+ segMem(_maxSegments)
+{
+  for (size_t i = 0; i < maxSegments; i++) {
+    segBase[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+ChunkMemorySegmented::~ChunkMemorySegmented()
+{
+}
+
+/*
+  Return the base of segment segi, allocating it if nobody has yet. bytes is only used by the
+  allocating thread: normally segSize, but for a big chunk it's the whole chunk and the
+  following segments point into the same block. The block covers all of those segments, since
+  off moves past the whole last one and chunkPtr will hand out anything below off.
+*/
+char *ChunkMemorySegmented::segmentFor(size_t segi, size_t bytes)
+{
+  char *base = segBase[segi].load(std::memory_order_acquire);
+  if (base) return base;
+
+  std::unique_lock< std::mutex > lock(allocMutex);
+  base = segBase[segi].load(std::memory_order_relaxed);
+  if (base) return base;
+
+  size_t nsegs = (bytes + segSize - 1) / segSize;
+  size_t blockBytes = nsegs * segSize;
+  auto mem = shared_ptr< char >(reinterpret_cast< char * >(aligned_alloc(64, (blockBytes + 63) & ~size_t(63))), free);
+  if (!mem) throw runtime_error("ChunkMemorySegmented: out of memory");
+  allocBytes += blockBytes;
+  for (size_t i = nsegs; i-- > 0; ) {
+    segMem[segi + i] = mem;
+    segBase[segi + i].store(mem.get() + i * segSize, std::memory_order_release);
+  }
+  return mem.get();
+}
+
+char *ChunkMemorySegmented::allocChunk(size_t size, off_t &chunkOff)
+{
+  size_t start, end;
+  size_t cur = off.load(std::memory_order_relaxed);
+  do {
+    start = roundUp(cur);
+    if (size > segSize) {
+      // Starts on a segment boundary and owns all the segments it touches
+      start = (start + segSize - 1) / segSize * segSize;
+      end = start + (size + segSize - 1) / segSize * segSize;
+    }
+    else {
+      if (size > 0 && start / segSize != (start + size - 1) / segSize) {
+        start = (start + segSize - 1) / segSize * segSize;
+      }
+      end = start + size;
+    }
+    if ((end + segSize - 1) / segSize > maxSegments) {
+      throw runtime_error("ChunkMemorySegmented: out of segments");
+    }
+  } while (!off.compare_exchange_weak(cur, end, std::memory_order_relaxed));
+
+  chunkOff = (off_t)start;
+  size_t segi = start / segSize;
+  char *base = segmentFor(segi, size > segSize ? size : segSize);
+  return base + (start - segi * segSize);
+}
+
+off_t ChunkMemorySegmented::writeChunk(char const *data, size_t size)
+{
+  off_t ret;
+  char *p = allocChunk(size, ret);
+  memcpy(p, data, size);
+  return ret;
+}
+
+char *ChunkMemorySegmented::chunkPtr(off_t chunkOff, size_t size)
+{
+  if (chunkOff < 0 || (size_t)chunkOff + size > off.load(std::memory_order_acquire)) return nullptr;
+  size_t start = (size_t)chunkOff;
+  size_t segi = start / segSize;
+  char *base = segBase[segi].load(std::memory_order_acquire);
+  if (!base) return nullptr;
+  if (size > 0) {
+    size_t lasti = (start + size - 1) / segSize;
+    if (lasti != segi) {
+      // Only valid if it's all one big chunk's block
+      char *lastBase = segBase[lasti].load(std::memory_order_acquire);
+      if (lastBase != base + (lasti - segi) * segSize) return nullptr;
+    }
+  }
+  return base + (start - segi * segSize);
+}
+
+bool ChunkMemorySegmented::readChunk(char *data, off_t chunkOff, size_t size)
+{
+  char *p = chunkPtr(chunkOff, size);
+  if (!p) return false;
+  memcpy(data, p, size);
+  return true;
+}
+
+static void releaseSegmentRef(packet_contents *it)
+{
+  delete reinterpret_cast< shared_ptr< char > * >(it->release_arg);
+}
+
+packet ChunkMemorySegmented::chunkPacket(off_t chunkOff, size_t size)
+{
+  char *p = chunkPtr(chunkOff, size);
+  if (!p) throw runtime_error("ChunkMemorySegmented::chunkPacket: bad range");
+  shared_ptr< char > *ref;
+  {
+    std::unique_lock< std::mutex > lock(allocMutex);
+    ref = new shared_ptr< char >(segMem[(size_t)chunkOff / segSize]);
+  }
+  return packet::from_external(reinterpret_cast< uint8_t * >(p), size, releaseSegmentRef, ref);
+}
+
+size_t ChunkMemorySegmented::size()
+{
+  return off.load();
+}
+
+
+/*
+  Check every chunk in a blob file: first walk the headers to find the chunks, then verify
+  checksums on several threads. Uncompressed files are mmapped so the threads read from disk
+  in parallel.
+*/
+ChunkFsckReport chunkFileFsck(string const &fn, size_t threadsAvail)
+{
+  ChunkFsckReport ret;
+  string contents;
+  char const *base = nullptr;
+  size_t total = 0;
+  void *mapped = MAP_FAILED;
+
+  if (readFileDecompress(fn + ".gz", contents) || readFileDecompress(fn + ".zst", contents)) {
+    base = contents.data();
+    total = contents.size();
+  }
+  else {
+    int fd = open(fn.c_str(), O_RDONLY);
+    if (fd < 0) {
+      ret.errors.push_back(fn + string(": ") + string(strerror(errno)));
+      return ret;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+      ret.errors.push_back(fn + string(": ") + string(strerror(errno)));
+      close(fd);
+      return ret;
+    }
+    total = (size_t)st.st_size;
+    if (total > 0) {
+      mapped = mmap(nullptr, total, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped == MAP_FAILED) {
+        ret.errors.push_back(fn + string(": mmap: ") + string(strerror(errno)));
+        close(fd);
+        return ret;
+      }
+      madvise(mapped, total, MADV_SEQUENTIAL);
+      base = reinterpret_cast< char const * >(mapped);
+    }
+    close(fd);
+  }
+  ret.bytes = total;
+
+  struct ChunkLoc {
+    size_t off;
+    size_t size;
+  };
+  vector< ChunkLoc > checked;
+  size_t pos = 0;
+  bool required = base && fileHasChecksums(base, total);
+  if (base && hasFileMarker(base, total)) pos = 16;
+  while (pos < total) {
+    uint64_t sizeWord;
+    if (pos + 8 > total) {
+      ret.errors.push_back(fn + ": truncated header at " + to_string(pos));
+      break;
+    }
+    memcpy(&sizeWord, base + pos, 8);
+    size_t hdrLen = (sizeWord & CHUNK_HAS_CRC) ? 16 : 8;
+    size_t size = (size_t)(sizeWord & ~CHUNK_HAS_CRC);
+    if (size == 0 || pos + hdrLen + size > total) {
+      ret.errors.push_back(fn + ": bad or truncated chunk at " + to_string(pos) + " (size " + to_string(size) + ")");
+      break;
+    }
+    if (hdrLen == 16) {
+      U32 magic;
+      memcpy(&magic, base + pos + 12, 4);
+      if (magic != CHUNK_CRC_MAGIC) {
+        ret.errors.push_back(fn + ": bad chunk header at " + to_string(pos));
+        break;
+      }
+      checked.push_back(ChunkLoc{pos + hdrLen, size});
+    }
+    else if (required) {
+      ret.errors.push_back(fn + ": chunk without checksum at " + to_string(pos));
+      break;
+    }
+    ret.chunks++;
+    pos += hdrLen + roundUp(size);
+  }
+  ret.checksummed = checked.size();
+
+  if (!threadsAvail) threadsAvail = thread::hardware_concurrency();
+  size_t nThreads = max(size_t(1), min(threadsAvail, checked.size()));
+  std::atomic< size_t > next {0};
+  std::mutex errMutex;
+  auto worker = [&]() {
+    while (true) {
+      size_t ci = next++;
+      if (ci >= checked.size()) break;
+      auto &c = checked[ci];
+      if (!checkChunk(base, total, (off_t)c.off, c.size, true)) {
+        std::unique_lock< std::mutex > lock(errMutex);
+        ret.bad++;
+        ret.errors.push_back(fn + ": checksum mismatch in chunk at " + to_string(c.off) + " (" + to_string(c.size) + " bytes)");
+      }
+    }
+  };
+  vector< thread > threads;
+  for (size_t ti = 1; ti < nThreads; ti++) threads.emplace_back(worker);
+  worker();
+  for (auto &it : threads) it.join();
+
+  if (mapped != MAP_FAILED) munmap(mapped, total);
+  return ret;
+}
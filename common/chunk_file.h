@@ -3,6 +3,8 @@
 #include <mutex>
 #include <zlib.h>
 
+struct ZSTD_CCtx_s;
+
 struct ChunkFile {
   ChunkFile(string const &_fn);
   virtual ~ChunkFile();
@@ -17,6 +19,7 @@ struct ChunkFile {
 
   string fn;
   bool errFlag {false};
+  bool checksums {false}; // Write a CRC32C with each chunk, verified by ChunkFileReader. Best set by the constructor
 };
 
 
@@ -33,8 +36,62 @@ struct ChunkMemory : ChunkFile {
 };
 
 
+/*
+  Like ChunkMemory, but stores chunks in fixed-size segments that never move, so pointers into it
+  stay valid and several threads can write at once. Offsets are reserved with an atomic add like
+  ChunkFileUncompressed. A chunk never straddles two segments: chunks bigger than segSize get a
+  contiguous run of segments to themselves.
+
+  Chunks can be handed off without copying, either as a packet or as an arma view. Packets hold a
+  reference to the segment, so they stay valid after the ChunkMemorySegmented is destroyed. Arma
+  views don't, so keep the ChunkMemorySegmented alive (eg, through jsonstr::blobs) while using them.
+  Don't read a chunk until the writeChunk that returned its offset has returned.
+*/
+struct ChunkMemorySegmented : ChunkFile {
+  ChunkMemorySegmented(size_t _segSize = 4*1024*1024, size_t _maxSegments = 65536);
+  ~ChunkMemorySegmented();
+
+  off_t writeChunk(char const *data, size_t size) override;
+  bool readChunk(char *data, off_t off, size_t size) override;
+  size_t size() override;
+
+  // Reserve space for a chunk and return a pointer for the caller to fill in, instead of copying.
+  char *allocChunk(size_t size, off_t &chunkOff);
+  // Pointer to a previously written chunk, or nullptr if [chunkOff .. chunkOff+size) isn't one.
+  char *chunkPtr(off_t chunkOff, size_t size);
+  packet chunkPacket(off_t chunkOff, size_t size);
+
+  template<typename T>
+  arma::Col< T > chunkCol(off_t chunkOff, size_t n_elem)
+  {
+    auto p = chunkPtr(chunkOff, n_elem * sizeof(T));
+    if (!p) throw runtime_error("ChunkMemorySegmented::chunkCol: bad range");
+    return arma::Col< T >(reinterpret_cast< T * >(p), n_elem, false, true);
+  }
+
+  template<typename T>
+  arma::Mat< T > chunkMat(off_t chunkOff, size_t n_rows, size_t n_cols)
+  {
+    auto p = chunkPtr(chunkOff, n_rows * n_cols * sizeof(T));
+    if (!p) throw runtime_error("ChunkMemorySegmented::chunkMat: bad range");
+    return arma::Mat< T >(reinterpret_cast< T * >(p), n_rows, n_cols, false, true);
+  }
+
+  size_t segSize;
+  size_t maxSegments;
+  std::atomic< size_t > off {0};
+  std::mutex allocMutex;
+  unique_ptr< std::atomic< char * >[] > segBase;
+  vector< shared_ptr< char > > segMem; // written under allocMutex before segBase is published
+  std::atomic< size_t > allocBytes {0};
+
+private:
+  char *segmentFor(size_t segi, size_t bytes);
+};
+
+
 struct ChunkFileUncompressed : ChunkFile {
-  ChunkFileUncompressed(string const &_fn);
+  ChunkFileUncompressed(string const &_fn, bool _checksums = false);
   ~ChunkFileUncompressed();
 
   off_t writeChunk(char const *data, size_t size) override;
@@ -47,7 +104,7 @@ struct ChunkFileUncompressed : ChunkFile {
 
 
 struct ChunkFileCompressed : ChunkFile {
-  ChunkFileCompressed(string const &_fn);
+  ChunkFileCompressed(string const &_fn, bool _checksums = false);
   ~ChunkFileCompressed();
 
   off_t writeChunk(char const *data, size_t size) override;
@@ -60,17 +117,58 @@ struct ChunkFileCompressed : ChunkFile {
 };
 
 
+/*
+  Same format as ChunkFileCompressed, but zstd-compressed into fn+".zst".
+*/
+struct ChunkFileZstd : ChunkFile {
+  ChunkFileZstd(string const &_fn, int _level = 3, bool _checksums = false);
+  ~ChunkFileZstd();
+
+  off_t writeChunk(char const *data, size_t size) override;
+  bool readChunk(char *data, off_t off, size_t size) override;
+  size_t size() override;
+
+  bool writeCompressed(char const *data, size_t size);
+
+  FILE *fp {nullptr};
+  ZSTD_CCtx_s *cctx {nullptr};
+  vector< char > outBuf;
+  std::mutex mutex;
+  off_t off {0};
+};
+
+
+/*
+  Reads a whole chunk file written by any of the above. Looks for fn+".gz", fn+".zst", then fn,
+  and decompresses according to the file contents.
+*/
 struct ChunkFileReader : ChunkFile {
   ChunkFileReader(string const &_fn);
   ~ChunkFileReader();
 
-  void readFile(gzFile gzfp);
-  void readFile(FILE *fp);
   void loadData();
 
   bool readChunk(char *data, off_t off, size_t size) override;
   off_t writeChunk(char const *data, size_t size) override;
   size_t size() override;
 
-  vector< char > fileContents;
+  string fileContents;
+  bool checksummedFile {false}; // every chunk must have a good checksum
 };
+
+
+/*
+  Validate a whole blob file (or its .gz or .zst version). Chunks written with checksums are
+  verified; others are only checked for sane headers.
+*/
+struct ChunkFsckReport {
+  size_t bytes {0};
+  size_t chunks {0};
+  size_t checksummed {0};
+  size_t bad {0};
+  vector< string > errors;
+
+  bool ok() const { return errors.empty(); }
+};
+
+ChunkFsckReport chunkFileFsck(string const &fn, size_t threadsAvail = 0);
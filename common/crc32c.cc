@@ -0,0 +1,188 @@
+#include "tlbcore/common/std_headers.h"
+#include "./crc32c.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  include <immintrin.h>
+#  define CRC32C_X86_DISPATCH 1
+#endif
+
+static const U32 CRC32C_POLY = 0x82f63b78; // reflected
+
+/*
+  GF(2) matrix machinery to build an operator that advances a crc over n zero bytes.
+  This is how we combine the crcs of the 3 parallel streams.
+  After Mark Adler, https://stackoverflow.com/a/17646775
+*/
+static U32 gf2_matrix_times(U32 const *mat, U32 vec)
+{
+  U32 sum = 0;
+  while (vec) {
+    if (vec & 1) sum ^= *mat;
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void gf2_matrix_square(U32 *square, U32 const *mat)
+{
+  for (int n = 0; n < 32; n++) {
+    square[n] = gf2_matrix_times(mat, mat[n]);
+  }
+}
+
+// len must be a power of 2
+static void crc32c_zeros_op(U32 *even, size_t len)
+{
+  U32 odd[32];
+  odd[0] = CRC32C_POLY;
+  U32 row = 1;
+  for (int n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  gf2_matrix_square(even, odd); // 2 zero bits
+  gf2_matrix_square(odd, even); // 4 zero bits
+  do {
+    gf2_matrix_square(even, odd);
+    len >>= 1;
+    if (len == 0) return;
+    gf2_matrix_square(odd, even);
+    len >>= 1;
+  } while (len);
+  for (int n = 0; n < 32; n++) even[n] = odd[n];
+}
+
+struct crc32c_shift_table {
+  explicit crc32c_shift_table(size_t len)
+  {
+    U32 op[32];
+    crc32c_zeros_op(op, len);
+    for (U32 n = 0; n < 256; n++) {
+      tab[0][n] = gf2_matrix_times(op, n);
+      tab[1][n] = gf2_matrix_times(op, n << 8);
+      tab[2][n] = gf2_matrix_times(op, n << 16);
+      tab[3][n] = gf2_matrix_times(op, n << 24);
+    }
+  }
+
+  U32 shift(U32 crc) const
+  {
+    return tab[0][crc & 0xff] ^ tab[1][(crc >> 8) & 0xff] ^ tab[2][(crc >> 16) & 0xff] ^ tab[3][crc >> 24];
+  }
+
+  U32 tab[4][256];
+};
+
+struct crc32c_byte_table {
+  crc32c_byte_table()
+  {
+    for (U32 n = 0; n < 256; n++) {
+      U32 crc = n;
+      for (int k = 0; k < 8; k++) {
+        crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+      }
+      tab[n] = crc;
+    }
+  }
+  U32 tab[256];
+};
+
+static U32 crc32c_sw(U32 crc, u_char const *p, size_t size)
+{
+  static const crc32c_byte_table table;
+  crc = ~crc;
+  while (size--) {
+    crc = table.tab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+#if defined(CRC32C_X86_DISPATCH)
+
+static const size_t CRC32C_LONG = 8192;
+static const size_t CRC32C_SHORT = 256;
+
+static bool have_sse42()
+{
+  static bool ret = __builtin_cpu_supports("sse4.2");
+  return ret;
+}
+
+__attribute__((target("sse4.2")))
+static U32 crc32c_hw(U32 crc, u_char const *p, size_t size)
+{
+  static const crc32c_shift_table longShift(CRC32C_LONG);
+  static const crc32c_shift_table shortShift(CRC32C_SHORT);
+
+  U64 crc0 = (U32)~crc;
+  while (size && ((uintptr_t)p & 7)) {
+    crc0 = _mm_crc32_u8((U32)crc0, *p++);
+    size--;
+  }
+
+  /*
+    The crc32 instruction has a latency of 3 and a throughput of 1, so run 3 independent
+    streams over adjacent blocks and combine at the end of each block.
+  */
+  while (size >= CRC32C_LONG * 3) {
+    U64 crc1 = 0, crc2 = 0;
+    u_char const *end = p + CRC32C_LONG;
+    do {
+      U64 w0, w1, w2;
+      memcpy(&w0, p, 8);
+      memcpy(&w1, p + CRC32C_LONG, 8);
+      memcpy(&w2, p + CRC32C_LONG * 2, 8);
+      crc0 = _mm_crc32_u64(crc0, w0);
+      crc1 = _mm_crc32_u64(crc1, w1);
+      crc2 = _mm_crc32_u64(crc2, w2);
+      p += 8;
+    } while (p < end);
+    crc0 = longShift.shift((U32)crc0) ^ crc1;
+    crc0 = longShift.shift((U32)crc0) ^ crc2;
+    p += CRC32C_LONG * 2;
+    size -= CRC32C_LONG * 3;
+  }
+  while (size >= CRC32C_SHORT * 3) {
+    U64 crc1 = 0, crc2 = 0;
+    u_char const *end = p + CRC32C_SHORT;
+    do {
+      U64 w0, w1, w2;
+      memcpy(&w0, p, 8);
+      memcpy(&w1, p + CRC32C_SHORT, 8);
+      memcpy(&w2, p + CRC32C_SHORT * 2, 8);
+      crc0 = _mm_crc32_u64(crc0, w0);
+      crc1 = _mm_crc32_u64(crc1, w1);
+      crc2 = _mm_crc32_u64(crc2, w2);
+      p += 8;
+    } while (p < end);
+    crc0 = shortShift.shift((U32)crc0) ^ crc1;
+    crc0 = shortShift.shift((U32)crc0) ^ crc2;
+    p += CRC32C_SHORT * 2;
+    size -= CRC32C_SHORT * 3;
+  }
+
+  while (size >= 8) {
+    U64 w;
+    memcpy(&w, p, 8);
+    crc0 = _mm_crc32_u64(crc0, w);
+    p += 8;
+    size -= 8;
+  }
+  while (size) {
+    crc0 = _mm_crc32_u8((U32)crc0, *p++);
+    size--;
+  }
+  return ~(U32)crc0;
+}
+
+#endif
+
+U32 crc32c(U32 crc, void const *data, size_t size)
+{
+  auto p = reinterpret_cast< u_char const * >(data);
+#if defined(CRC32C_X86_DISPATCH)
+  if (have_sse42()) return crc32c_hw(crc, p, size);
+#endif
+  return crc32c_sw(crc, p, size);
+}
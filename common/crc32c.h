@@ -0,0 +1,9 @@
+#pragma once
+
+/*
+  CRC-32C (Castagnoli), as used by iSCSI, ext4 and friends.
+  Uses the SSE4.2 crc32 instruction when the CPU has it (checked at runtime), running 3 streams
+  in parallel to hide its latency, and a table otherwise.
+  Pass the previous return value as crc to continue a checksum over several buffers; start with 0.
+*/
+U32 crc32c(U32 crc, void const *data, size_t size);
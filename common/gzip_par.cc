@@ -0,0 +1,301 @@
+#include "tlbcore/common/std_headers.h"
+#include "./gzip_par.h"
+#include <thread>
+#include <atomic>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/*
+  Run f(0) .. f(n-1) on up to threadsAvail threads. The first exception thrown is rethrown here
+  after all the threads finish.
+*/
+static void gzipParRun(size_t n, size_t threadsAvail, function< void(size_t) > const &f)
+{
+  if (!threadsAvail) threadsAvail = thread::hardware_concurrency();
+  size_t nThreads = min(max(threadsAvail, size_t(1)), n);
+  if (nThreads <= 1) {
+    for (size_t i = 0; i < n; i++) f(i);
+    return;
+  }
+
+  std::atomic< size_t > next {0};
+  mutex errMutex;
+  exception_ptr err;
+  auto worker = [&]() {
+    while (true) {
+      size_t i = next++;
+      if (i >= n) break;
+      try {
+        f(i);
+      }
+      catch (...) {
+        unique_lock< mutex > lock(errMutex);
+        if (!err) err = current_exception();
+        next = n;
+      }
+    }
+  };
+  vector< thread > threads;
+  for (size_t ti = 1; ti < nThreads; ti++) threads.emplace_back(worker);
+  worker();
+  for (auto &it : threads) it.join();
+  if (err) rethrow_exception(err);
+}
+
+static inline void putLe16(u_char *p, U32 v)
+{
+  p[0] = (u_char)(v >> 0);
+  p[1] = (u_char)(v >> 8);
+}
+
+static inline void putLe32(u_char *p, U32 v)
+{
+  p[0] = (u_char)(v >> 0);
+  p[1] = (u_char)(v >> 8);
+  p[2] = (u_char)(v >> 16);
+  p[3] = (u_char)(v >> 24);
+}
+
+static inline U32 getLe16(u_char const *p)
+{
+  return (U32)p[0] | ((U32)p[1] << 8);
+}
+
+static inline U32 getLe32(u_char const *p)
+{
+  return (U32)p[0] | ((U32)p[1] << 8) | ((U32)p[2] << 16) | ((U32)p[3] << 24);
+}
+
+/*
+  Member layout written by gzipCompressBlock:
+    10 byte header with FEXTRA set
+    XLEN=8, then one subfield: 'T' 'Z' LEN=4 <u32 total member size>
+    raw deflate data
+    CRC32, ISIZE
+*/
+static const size_t GZIP_PAR_HEADER = 20;
+static const size_t GZIP_PAR_TRAILER = 8;
+
+static void gzipCompressBlock(char const *data, size_t size, int level, string &out)
+{
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    throw runtime_error("gzip: deflateInit2 failed");
+  }
+  size_t bound = deflateBound(&zs, (uLong)size);
+  out.resize(GZIP_PAR_HEADER + bound + GZIP_PAR_TRAILER);
+  auto p = reinterpret_cast< u_char * >(&out[0]);
+
+  zs.next_in = reinterpret_cast< Bytef * >(const_cast< char * >(data));
+  zs.avail_in = (uInt)size;
+  zs.next_out = p + GZIP_PAR_HEADER;
+  zs.avail_out = (uInt)bound;
+  int rc = deflate(&zs, Z_FINISH);
+  size_t compSize = zs.total_out;
+  deflateEnd(&zs);
+  if (rc != Z_STREAM_END) {
+    throw runtime_error("gzip: deflate failed: " + to_string(rc));
+  }
+
+  size_t memberSize = GZIP_PAR_HEADER + compSize + GZIP_PAR_TRAILER;
+  p[0] = 0x1f;
+  p[1] = 0x8b;
+  p[2] = Z_DEFLATED;
+  p[3] = 0x04; // FEXTRA
+  putLe32(p + 4, 0); // MTIME
+  p[8] = 0; // XFL
+  p[9] = 3; // OS = Unix
+  putLe16(p + 10, 8); // XLEN
+  p[12] = 'T';
+  p[13] = 'Z';
+  putLe16(p + 14, 4);
+  putLe32(p + 16, (U32)memberSize);
+
+  U32 crc = (U32)crc32(crc32(0, nullptr, 0), reinterpret_cast< Bytef const * >(data), (uInt)size);
+  putLe32(p + GZIP_PAR_HEADER + compSize, crc);
+  putLe32(p + GZIP_PAR_HEADER + compSize + 4, (U32)size);
+  out.resize(memberSize);
+}
+
+static void gzipCompressBlocks(char const *data, size_t size, int level, size_t blockSize,
+  size_t threadsAvail, vector< string > &members)
+{
+  // Members must fit the 32-bit size fields
+  blockSize = min(max(blockSize, size_t(65536)), size_t(1) << 30);
+  size_t nBlocks = max(size_t(1), (size + blockSize - 1) / blockSize);
+  members.resize(nBlocks);
+  gzipParRun(nBlocks, threadsAvail, [&](size_t bi) {
+    size_t off = bi * blockSize;
+    gzipCompressBlock(data + off, min(blockSize, size - min(size, off)), level, members[bi]);
+  });
+}
+
+void gzipCompress(char const *data, size_t size, string &out, int level, size_t blockSize, size_t threadsAvail)
+{
+  vector< string > members;
+  gzipCompressBlocks(data, size, level, blockSize, threadsAvail, members);
+  size_t total = 0;
+  for (auto &it : members) total += it.size();
+  out.clear();
+  out.reserve(total);
+  for (auto &it : members) out += it;
+}
+
+void gzipWriteFile(string const &fn, char const *data, size_t size, int level, size_t blockSize)
+{
+  vector< string > members;
+  gzipCompressBlocks(data, size, level, blockSize, 0, members);
+
+  FILE *fp = fopen(fn.c_str(), "wb");
+  if (!fp) {
+    throw runtime_error(fn + string(": ") + string(strerror(errno)));
+  }
+  for (auto &it : members) {
+    if (fwrite(it.data(), 1, it.size(), fp) != it.size()) {
+      int err = errno;
+      fclose(fp);
+      throw runtime_error(fn + string(": write failed: ") + string(strerror(err)));
+    }
+  }
+  if (fclose(fp) < 0) {
+    throw runtime_error(fn + string(": ") + string(strerror(errno)));
+  }
+}
+
+
+struct GzipMember {
+  size_t srcOff, srcSize;
+  size_t dstOff, dstSize;
+};
+
+/*
+  Walk the members using the size subfields. Returns false if any member doesn't have one,
+  in which case we have to decompress serially to find the boundaries.
+*/
+static bool gzipFindMembers(u_char const *src, size_t srcSize, vector< GzipMember > &members)
+{
+  size_t pos = 0, dstOff = 0;
+  while (pos < srcSize) {
+    u_char const *p = src + pos;
+    size_t avail = srcSize - pos;
+    if (avail < 12 || p[0] != 0x1f || p[1] != 0x8b || p[2] != Z_DEFLATED || !(p[3] & 0x04)) return false;
+    size_t xlen = getLe16(p + 10);
+    if (12 + xlen > avail) return false;
+
+    size_t memberSize = 0;
+    for (size_t xi = 12; xi + 4 <= 12 + xlen; ) {
+      size_t sublen = getLe16(p + xi + 2);
+      if (xi + 4 + sublen > 12 + xlen) break;
+      if (p[xi] == 'T' && p[xi+1] == 'Z' && sublen == 4) {
+        memberSize = getLe32(p + xi + 4);
+      }
+      else if (p[xi] == 'B' && p[xi+1] == 'C' && sublen == 2) {
+        memberSize = getLe16(p + xi + 4) + 1;
+      }
+      xi += 4 + sublen;
+    }
+    if (memberSize < 12 + xlen + GZIP_PAR_TRAILER || memberSize > avail) return false;
+
+    GzipMember m;
+    m.srcOff = pos;
+    m.srcSize = memberSize;
+    m.dstOff = dstOff;
+    m.dstSize = getLe32(p + memberSize - 4);
+    members.push_back(m);
+
+    dstOff += m.dstSize;
+    pos += memberSize;
+  }
+  return !members.empty();
+}
+
+static void gzipInflateMember(u_char const *src, GzipMember const &m, u_char *dst)
+{
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+    throw runtime_error("gzip: inflateInit2 failed");
+  }
+  zs.next_in = const_cast< Bytef * >(src + m.srcOff);
+  zs.avail_in = (uInt)m.srcSize;
+  zs.next_out = dst + m.dstOff;
+  zs.avail_out = (uInt)m.dstSize;
+  int rc = inflate(&zs, Z_FINISH);
+  string msg = zs.msg ? string(zs.msg) : to_string(rc);
+  size_t got = zs.total_out;
+  inflateEnd(&zs);
+  if (rc != Z_STREAM_END || got != m.dstSize) {
+    throw runtime_error("gzip: corrupt member at " + to_string(m.srcOff) + ": " + msg);
+  }
+}
+
+/*
+  For files without size subfields: one inflate stream, restarted at each member boundary.
+  Output starts at the size in the ISIZE trailer (exact for single-member files under 4 GB;
+  for multi-member files it's only the last member) and doubles if that was too small. ISIZE
+  comes from the file, so it's capped at deflate's best ratio (about 1032:1), and at least
+  64 KB so a small or zero ISIZE doesn't mean lots of doubling.
+*/
+static void gzipInflateSerial(u_char const *src, size_t srcSize, string &out)
+{
+  size_t isize = srcSize >= 4 ? getLe32(src + srcSize - 4) : 0;
+  out.resize(max(min(isize, srcSize * 1032), size_t(65536)));
+
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+    throw runtime_error("gzip: inflateInit2 failed");
+  }
+  const size_t maxStep = size_t(1) << 30; // avail_in and avail_out are 32 bits
+  size_t inPos = 0, outPos = 0;
+  while (true) {
+    if (outPos == out.size()) {
+      out.resize(out.size() * 2);
+    }
+    size_t inStep = min(srcSize - inPos, maxStep);
+    size_t outStep = min(out.size() - outPos, maxStep);
+    zs.next_in = const_cast< Bytef * >(src + inPos);
+    zs.avail_in = (uInt)inStep;
+    zs.next_out = reinterpret_cast< Bytef * >(&out[outPos]);
+    zs.avail_out = (uInt)outStep;
+    int rc = inflate(&zs, Z_NO_FLUSH);
+    inPos += inStep - zs.avail_in;
+    outPos += outStep - zs.avail_out;
+
+    if (rc == Z_STREAM_END) {
+      // Another member follows, unless it's just trailing junk as gzip allows
+      if (srcSize - inPos >= 2 && src[inPos] == 0x1f && src[inPos+1] == 0x8b) {
+        inflateReset(&zs);
+        continue;
+      }
+      break;
+    }
+    if (rc == Z_BUF_ERROR && zs.avail_out != 0) {
+      inflateEnd(&zs);
+      throw runtime_error("gzip: truncated");
+    }
+    if (rc != Z_OK && rc != Z_BUF_ERROR) {
+      string msg = zs.msg ? string(zs.msg) : to_string(rc);
+      inflateEnd(&zs);
+      throw runtime_error("gzip: corrupt data: " + msg);
+    }
+  }
+  inflateEnd(&zs);
+  out.resize(outPos);
+}
+
+void gzipDecompress(u_char const *src, size_t srcSize, string &out, size_t threadsAvail)
+{
+  vector< GzipMember > members;
+  if (!gzipFindMembers(src, srcSize, members)) {
+    gzipInflateSerial(src, srcSize, out);
+    return;
+  }
+  auto &last = members.back();
+  out.resize(last.dstOff + last.dstSize);
+  auto dst = reinterpret_cast< u_char * >(&out[0]);
+  gzipParRun(members.size(), threadsAvail, [&](size_t mi) {
+    gzipInflateMember(src, members[mi], dst);
+  });
+}
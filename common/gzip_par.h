@@ -0,0 +1,28 @@
+#pragma once
+#include <zlib.h>
+
+/*
+  Fast whole-file gzip, for big JSON files.
+
+  gzipWriteFile splits the data into blocks of blockSize bytes, compresses them in parallel,
+  and writes each as a separate gzip member. Each member header carries an extra subfield
+  ('T','Z', 4 bytes: the member's compressed size) so a reader can find all the members without
+  decompressing. The result is an ordinary multi-member gzip file, which gunzip and gzread handle.
+
+  gzipDecompress takes a whole compressed file. If every member has the subfield, it
+  decompresses them in parallel directly into place in the output. BGZF-style files (subfield
+  'B','C') work the same way. Otherwise it decompresses serially in large blocks, sizing the
+  output from the ISIZE trailer. It throws runtime_error if the data is corrupt. To read a file
+  in whatever compression it has, use readFileDecompress (in zstd_io.h).
+*/
+
+void gzipWriteFile(string const &fn, char const *data, size_t size,
+  int level = Z_DEFAULT_COMPRESSION, size_t blockSize = 4*1024*1024);
+
+/*
+  gzipCompress is gzipWriteFile into a string. gzipDecompress accepts anything gzipCompress or
+  gzip writes.
+*/
+void gzipCompress(char const *data, size_t size, string &out,
+  int level = Z_DEFAULT_COMPRESSION, size_t blockSize = 4*1024*1024, size_t threadsAvail = 0);
+void gzipDecompress(u_char const *src, size_t srcSize, string &out, size_t threadsAvail = 0);
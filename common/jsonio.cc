@@ -1,5 +1,7 @@
 #include "tlbcore/common/std_headers.h"
 #include "./jsonio.h"
+#include "./gzip_par.h"
+#include "./zstd_io.h"
 #include <zlib.h>
 
 jsonstr::jsonstr()
@@ -58,10 +60,21 @@ jsonstr::endWrite(char const *p)
 }
 
 void
-jsonstr::useBlobs(string const &_fn)
+jsonstr::useBlobs(string const &_fn, string const &compression, bool checksums)
 {
   if (!blobs) {
-    blobs = make_shared< ChunkFileCompressed >(_fn);
+    if (compression == "gz") {
+      blobs = make_shared< ChunkFileCompressed >(_fn, checksums);
+    }
+    else if (compression == "zst") {
+      blobs = make_shared< ChunkFileZstd >(_fn, 3, checksums);
+    }
+    else if (compression == "") {
+      blobs = make_shared< ChunkFileUncompressed >(_fn, checksums);
+    }
+    else {
+      throw runtime_error("useBlobs: unknown compression " + compression);
+    }
   }
 }
 
@@ -97,28 +110,50 @@ bool jsonstr::isNumber() const
   return it.size() >=  1 && isdigit(it[0]);
 }
 
+static bool endsWith(string const &s, string const &suffix)
+{
+  return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
 /*
-  writeToFile uses gzip by default.
+  writeToFile uses gzip by default. The gzip file is written in independent blocks so
+  readFromFile can decompress it in parallel. See gzip_par.h
+  If fn already ends in .json, .json.gz or .json.zst, that picks the compression.
 */
 void jsonstr::writeToFile(string const &fn, bool enableGzip) const
 {
-  int rc;
-  if (enableGzip) {
-    string gzfn = fn + ".json.gz";
-    gzFile gzfp = gzopen(gzfn.c_str(), "wb");
-    if (!gzfp) {
-      throw runtime_error(gzfn + string(": ") + string(strerror(errno)));
-    }
-    rc = gzwrite(gzfp, (void *)&it[0], (u_int)it.size());
-    if (rc <= 0) {
-      int errnum = 0;
-      throw runtime_error(gzfn + string(": write failed: ") + string(gzerror(gzfp, &errnum)));
-    }
-    rc = gzclose(gzfp);
-    if (rc != Z_OK) {
-      throw runtime_error(gzfn + string(": close failed: ") + to_string(rc));
-    }
-  } else {
+  if (endsWith(fn, ".json.zst")) {
+    writeToFile(fn.substr(0, fn.size() - 9), string("zst"));
+  }
+  else if (endsWith(fn, ".json.gz")) {
+    writeToFile(fn.substr(0, fn.size() - 8), string("gz"));
+  }
+  else if (endsWith(fn, ".json")) {
+    writeToFile(fn.substr(0, fn.size() - 5), string(""));
+  }
+  else {
+    writeToFile(fn, string(enableGzip ? "gz" : ""));
+  }
+}
+
+void jsonstr::writeToFile(string const &fn, char const *compression, U32 zstdDictId) const
+{
+  writeToFile(fn, string(compression), zstdDictId);
+}
+
+/*
+  compression is "gz", "zst" or "" for none. zstdDictId picks a dictionary registered
+  with zstdAddDict, which is only worthwhile for small files.
+*/
+void jsonstr::writeToFile(string const &fn, string const &compression, U32 zstdDictId) const
+{
+  if (compression == "gz") {
+    gzipWriteFile(fn + ".json.gz", it.data(), it.size());
+  }
+  else if (compression == "zst") {
+    zstdWriteFile(fn + ".json.zst", it.data(), it.size(), ZSTD_IO_DEFAULT_LEVEL, zstdDictId);
+  }
+  else if (compression == "") {
     string jsonfn = fn + ".json";
     FILE *fp = fopen(jsonfn.c_str(), "w");
     if (!fp) {
@@ -133,67 +168,32 @@ void jsonstr::writeToFile(string const &fn, bool enableGzip) const
       throw runtime_error(jsonfn + string(": ") + string(strerror(errno)));
     }
   }
+  else {
+    throw runtime_error("writeToFile: unknown compression " + compression);
+  }
 }
 
 /*
-  readFromFile first checks for a plain file, then looks for a .gz version
+  readFromFile looks for fn.json, fn.json.gz, then fn.json.zst, and decompresses according to
+  what's actually in the file. fn can also include one of those suffixes.
  */
 int jsonstr::readFromFile(string const &fn)
 {
-  int rc;
-
-  string jsonfn = fn + ".json";
-  FILE *fp = fopen(jsonfn.c_str(), "r");
-  if (fp) {
-    if (fseek(fp, 0, SEEK_END) < 0) {
-      throw runtime_error(jsonfn + string(": ") + string(strerror(errno)));
+  string base = fn;
+  for (auto &suffix : {".json.zst", ".json.gz", ".json"}) {
+    if (endsWith(base, suffix)) {
+      base = base.substr(0, base.size() - strlen(suffix));
+      break;
     }
-    auto fileSize = (size_t)ftello(fp);
-    if (fileSize > 1000000000) {
-      throw runtime_error(jsonfn + string(": Unreasonable file size ") + to_string(fileSize));
-    }
-
-    fseek(fp, 0, SEEK_SET);
-    char *p = startWrite(fileSize);
-    int nr = fread(p, fileSize, 1, fp);
-    if (nr != 1) {
-      throw runtime_error(jsonfn + string(": partial read ") + to_string(nr) + "/" + to_string(fileSize));
-    }
-    endWrite(p + fileSize);
-
-    if (fclose(fp) < 0) {
-      throw runtime_error(jsonfn + string(": ") + string(strerror(errno)));
-    }
-    blobs = make_shared< ChunkFileReader >(fn+".blobs");
-    return 0;
   }
-  string gzfn = jsonfn + ".gz";
-  gzFile gzfp = gzopen(gzfn.c_str(), "rb");
-  if (gzfp) {
-    it.clear();
-    while (true) {
-      char buf[8192];
-      int nr = gzread(gzfp, buf, sizeof(buf));
-      if (nr < 0) {
-        int errnum;
-        throw runtime_error(gzfn + string(": read failed: ") + string(gzerror(gzfp, &errnum)));
-      }
-      else if (nr == 0) {
-        break;
-      }
-      else {
-        it += string(&buf[0], &buf[nr]);
-      }
-    }
 
-    rc = gzclose(gzfp);
-    if (rc != Z_OK) {
-      throw runtime_error(gzfn + string(": close failed: ") + to_string(rc));
+  for (auto &suffix : {".json", ".json.gz", ".json.zst"}) {
+    if (readFileDecompress(base + suffix, it)) {
+      blobs = make_shared< ChunkFileReader >(base + ".blobs");
+      return 0;
     }
-    blobs = make_shared< ChunkFileReader >(fn+".blobs");
-    return 0;
   }
-
+  errno = ENOENT;
   return -1;
 }
 
@@ -39,7 +39,7 @@ struct jsonstr {
   char *startWrite(size_t n);
   void endWrite(char const *p);
 
-  void useBlobs(string const &_fn);
+  void useBlobs(string const &_fn, string const &compression = "gz", bool checksums = false);
   void setNull();
 
   bool isNull() const;
@@ -52,11 +52,15 @@ struct jsonstr {
   // Read and write to files.
   // Read returns -1 with errno=ENOENT if not found.
   // Otherwise, these throw runtime errors if anything else goes wrong.
+  // compression is "gz", "zst" or "". See zstd_io.h for dictionaries.
   void writeToFile(string const &fn, bool enableGzip=true) const;
+  void writeToFile(string const &fn, string const &compression, U32 zstdDictId=0) const;
+  void writeToFile(string const &fn, char const *compression, U32 zstdDictId=0) const;
   int readFromFile(string const &fn);
 
   string it;
   shared_ptr< ChunkFile > blobs;
+  string blobDtype; // If set, toJson narrows float arrays written to blobs. See ndarray_precision.h
 };
 
 ostream & operator<<(ostream &s, jsonstr const &obj);
@@ -77,6 +81,7 @@ template <typename T>
 void toJson(jsonstr &ret, const T &value) {
   WrJsonContext ctx;
   ctx.blobs = ret.blobs;
+  ctx.blobDtype = ret.blobDtype;
   wrJsonSize(ctx, value);
   ctx.s = ret.startWrite(ctx.size);
   wrJson(ctx, value);
@@ -40,6 +40,7 @@ struct WrJsonContext {
   char *s {nullptr};
   size_t size {0};
   shared_ptr<ChunkFile> blobs;
+  string blobDtype; // Reduced precision for float arrays in blobs. See ndarray_precision.h
 
   void emit(char const *str);
 };
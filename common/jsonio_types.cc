@@ -1,5 +1,6 @@
 #include "tlbcore/common/std_headers.h"
 #include "./jsonio.h"
+#include "./ndarray_precision.h"
 #include "build.src/arma_types_decl.h"
 /*
   As used by Python's numpy, which we interoperate with.
@@ -659,6 +660,137 @@ void accum_range(MinMax &it, bool value, bool &first)
   }
 }
 
+/*
+  Blob data. These fill in nd.dtype, nd.partOfs and nd.partBytes. The caller fills in nd.shape
+  and nd.range.
+  Float and double arrays are narrowed to ctx.blobDtype if it's set, and widened back when
+  reading. Other types are always full width.
+*/
+
+template<typename T>
+static string blobDtypeFor(WrJsonContext &ctx, T const &x)
+{
+  return ndarray_dtype(x);
+}
+
+static string blobDtypeFor(WrJsonContext &ctx, double const &x)
+{
+  return ndarray_reduced_size(ctx.blobDtype) ? ctx.blobDtype : ndarray_dtype(x);
+}
+
+static string blobDtypeFor(WrJsonContext &ctx, float const &x)
+{
+  return ndarray_reduced_size(ctx.blobDtype) ? ctx.blobDtype : ndarray_dtype(x);
+}
+
+template<typename T>
+static void wrBlobData(WrJsonContext &ctx, ndarray &nd, T const *data, size_t n)
+{
+  nd.dtype = ndarray_dtype(T());
+  nd.partBytes = mul_overflow< size_t >(n, sizeof(T));
+  nd.partOfs = ctx.blobs->writeChunk(reinterpret_cast<char const *>(data), nd.partBytes);
+}
+
+template<typename T>
+static void wrBlobDataNarrow(WrJsonContext &ctx, ndarray &nd, T const *data, size_t n)
+{
+  size_t elemSize = ndarray_reduced_size(ctx.blobDtype);
+  if (elemSize && ndarray_is_scaled(ctx.blobDtype)) {
+    // The scale comes from the range, so it has to ignore NaNs (which get their own code)
+    double rangeMin = 0.0, rangeMax = 0.0;
+    if (ndarray_finite_range(data, n, rangeMin, rangeMax)) {
+      nd.range.min = rangeMin;
+      nd.range.max = rangeMax;
+    } else {
+      elemSize = 0;
+    }
+  }
+  if (!elemSize) {
+    return wrBlobData< T >(ctx, nd, data, n);
+  }
+  vector< u_char > narrow(mul_overflow< size_t >(n, elemSize));
+  ndarray_narrow(ctx.blobDtype, nd.range.min, nd.range.max, data, n, narrow.data());
+  nd.dtype = ctx.blobDtype;
+  nd.partBytes = narrow.size();
+  nd.partOfs = ctx.blobs->writeChunk(reinterpret_cast<char const *>(narrow.data()), nd.partBytes);
+}
+
+static void wrBlobData(WrJsonContext &ctx, ndarray &nd, double const *data, size_t n)
+{
+  wrBlobDataNarrow(ctx, nd, data, n);
+}
+
+static void wrBlobData(WrJsonContext &ctx, ndarray &nd, float const *data, size_t n)
+{
+  wrBlobDataNarrow(ctx, nd, data, n);
+}
+
+template<typename T>
+static bool canWiden(T const & /* x */)
+{
+  return false;
+}
+
+static bool canWiden(double const & /* x */)
+{
+  return true;
+}
+
+static bool canWiden(float const & /* x */)
+{
+  return true;
+}
+
+template<typename T>
+static void blobWiden(ndarray const &nd, u_char const *src, size_t n, T *dst)
+{
+  throw logic_error("blobWiden: not a float type");
+}
+
+static void blobWiden(ndarray const &nd, u_char const *src, size_t n, double *dst)
+{
+  ndarray_widen(nd.dtype, nd.range.min, nd.range.max, src, n, dst);
+}
+
+static void blobWiden(ndarray const &nd, u_char const *src, size_t n, float *dst)
+{
+  ndarray_widen(nd.dtype, nd.range.min, nd.range.max, src, n, dst);
+}
+
+/*
+  Bytes per element in the blob, or 0 if we can't read nd.dtype into a T
+*/
+template<typename T>
+static size_t rdBlobElemSize(ndarray const &nd)
+{
+  if (nd.dtype == ndarray_dtype(T())) return sizeof(T);
+  if (canWiden(T())) return ndarray_reduced_size(nd.dtype);
+  return 0;
+}
+
+/*
+  Check that n elements of T match the ndarray, before allocating space for them
+*/
+template<typename T>
+static bool rdBlobCheck(ndarray const &nd, size_t n)
+{
+  size_t elemSize = rdBlobElemSize< T >(nd);
+  return elemSize && mul_overflow< size_t >(n, elemSize) == nd.partBytes;
+}
+
+template<typename T>
+static bool rdBlobData(RdJsonContext &ctx, ndarray const &nd, T *data, size_t n)
+{
+  if (!rdBlobCheck< T >(nd, n)) return false;
+  if (nd.dtype == ndarray_dtype(T())) {
+    return ctx.blobs->readChunk(reinterpret_cast<char *>(data), nd.partOfs, nd.partBytes);
+  }
+  vector< u_char > narrow(nd.partBytes);
+  if (!ctx.blobs->readChunk(reinterpret_cast<char *>(narrow.data()), nd.partOfs, nd.partBytes)) return false;
+  blobWiden(nd, narrow.data(), n, data);
+  return true;
+}
+
 
 /*
   Json - arma::Col< T >
@@ -667,7 +799,7 @@ template<typename T>
 void wrJsonSize(WrJsonContext &ctx, arma::Col< T > const &arr) {
   if (ctx.blobs) {
     // fake numbers other than 0 or 1 (which are optimized) to allocate size for any number
-    ndarray nd(9, 9, ndarray_dtype(arr[0]), vector< U64 >({arr.n_elem}), MinMax(9.0, 9.0));
+    ndarray nd(9, 9, blobDtypeFor(ctx, T()), vector< U64 >({arr.n_elem}), MinMax(9.0, 9.0));
     wrJsonSize(ctx, nd);
   } else {
     ctx.size += 2 + arr.n_elem; // brackets, commas
@@ -680,9 +812,10 @@ void wrJsonSize(WrJsonContext &ctx, arma::Col< T > const &arr) {
 template<typename T>
 void wrJson(WrJsonContext &ctx, arma::Col< T > const &arr) {
   if (ctx.blobs) {
-    size_t partBytes = mul_overflow< size_t >((size_t)arr.n_elem, sizeof(arr[0]));
-    off_t partOfs = ctx.blobs->writeChunk(reinterpret_cast<char const *>(arr.memptr()), partBytes);
-    ndarray nd(partOfs, partBytes, ndarray_dtype(arr[0]), vector< U64 >({arr.n_elem}), arma_MinMax(arr));
+    ndarray nd;
+    nd.shape.push_back(arr.n_elem);
+    nd.range = arma_MinMax(arr);
+    wrBlobData(ctx, nd, arr.memptr(), (size_t)arr.n_elem);
     wrJson(ctx, nd);
   } else {
     *ctx.s++ = '[';
@@ -733,17 +866,15 @@ bool rdJson(RdJsonContext &ctx, arma::Col< T > &arr) {
   else if (*ctx.s == '{' && ctx.blobs) {
     ndarray nd;
     if (!rdJson(ctx, nd)) return ctx.fail(typeid(arr), "rdJson(nd)");
+    if (nd.shape.size() != 1 || !rdBlobCheck< T >(nd, nd.shape[0])) {
+      return ctx.fail(typeid(arr), "Wrong dtype or size");
+    }
     arr.set_size(nd.shape[0]);
     if ((size_t)arr.n_elem > (size_t)numeric_limits< int >::max() / sizeof(arr[0])) throw length_error("rdJson< arma::Col >");
-    size_t partBytes = mul_overflow< size_t >((size_t)arr.n_elem, sizeof(arr[0]));
-    string arr_dtype = ndarray_dtype(arr[0]);
-    if (arr_dtype == nd.dtype && partBytes == nd.partBytes) {
-      ctx.blobs->readChunk(reinterpret_cast<char *>(arr.memptr()), nd.partOfs, partBytes);
-      return true;
-    }
-    else {
-      return ctx.fail(typeid(arr), "Wrong dtype or size");
+    if (!rdBlobData(ctx, nd, arr.memptr(), (size_t)arr.n_elem)) {
+      return ctx.fail(typeid(arr), "no chunk");
     }
+    return true;
   }
   else {
     return ctx.fail(typeid(arr), "Expected [ or {");
@@ -907,21 +1038,19 @@ template<typename T>
 void wrJsonBin(WrJsonContext &ctx, vector< T > const &arr)
 {
   ndarray nd;
-  nd.partBytes = mul_overflow< size_t >(arr.size(), sizeof(T));
-  nd.partOfs = ctx.blobs->writeChunk(reinterpret_cast<char const *>(&arr[0]), nd.partBytes);
-  nd.dtype = ndarray_dtype(T());
   nd.shape.push_back(arr.size());
   bool first = true;
   for (auto it : arr) {
     accum_range(nd.range, it, first);
   }
+  wrBlobData(ctx, nd, arr.data(), arr.size());
   wrJson(ctx, nd);
 }
 
 template<typename T>
 void wrJsonSizeBin(WrJsonContext &ctx, vector< T > const &arr)
 {
-  ndarray nd(9, 9, ndarray_dtype(T()), vector< U64 >({(U64)arr.size()}), MinMax(9.0, 9.0));
+  ndarray nd(9, 9, blobDtypeFor(ctx, T()), vector< U64 >({(U64)arr.size()}), MinMax(9.0, 9.0));
   wrJsonSize(ctx, nd);
 }
 
@@ -930,9 +1059,9 @@ bool rdJsonBin(RdJsonContext &ctx, vector< T > &arr)
 {
   ndarray nd;
   if (rdJson(ctx, nd)) {
-    if (nd.dtype == ndarray_dtype(T()) && nd.shape.size() == 1 && mul_overflow< size_t >(nd.shape[0], sizeof(T)) == nd.partBytes) {
+    if (nd.shape.size() == 1 && rdBlobCheck< T >(nd, nd.shape[0])) {
       arr.resize(nd.shape[0]);
-      if (ctx.blobs->readChunk(reinterpret_cast<char *>(arr.data()), nd.partOfs, nd.partBytes)) {
+      if (rdBlobData(ctx, nd, arr.data(), arr.size())) {
         return true;
       }
     }
@@ -1156,18 +1285,16 @@ void wrJsonBin(WrJsonContext &ctx, vector< typename arma::Col< T > > const &arr)
       accum_range(nd.range, slice[i * n + k], first);
     }
   }
-  nd.partBytes = mul_overflow< size_t >(slice.size(), sizeof(T));
-  nd.partOfs = ctx.blobs->writeChunk(reinterpret_cast<char const *>(slice.data()), nd.partBytes);
-  nd.dtype = ndarray_dtype(T());
   nd.shape.push_back(arr.size());
   nd.shape.push_back(n);
+  wrBlobData(ctx, nd, slice.data(), slice.size());
   wrJson(ctx, nd);
 }
 
 template<typename T>
 void wrJsonSizeBin(WrJsonContext &ctx, vector< typename arma::Col< T > > const &arr)
 {
-  ndarray nd(9, 9, ndarray_dtype(T()), vector< U64 >({9, 9}), MinMax(9.0, 9.0));
+  ndarray nd(9, 9, blobDtypeFor(ctx, T()), vector< U64 >({9, 9}), MinMax(9.0, 9.0));
   wrJsonSize(ctx, nd);
 }
 
@@ -1187,13 +1314,14 @@ bool rdJsonBin(RdJsonContext &ctx, vector< typename arma::Col< T > > &arr)
   arr.resize(nd.shape[0]);
   size_t n = nd.shape[1];
 
-  vector< T > tmp(nd.shape[0] * nd.shape[1]);
-  if (tmp.size() * sizeof(T) != nd.partBytes) {
+  size_t nElem = mul_overflow< size_t >(nd.shape[0], nd.shape[1]);
+  if (!rdBlobCheck< T >(nd, nElem)) {
     return ctx.fail(typeid(arr), stringprintf(
-      "rdJson(arma::Col< T >: size mismatch: %zu*%zu != %zu\\n",
-      tmp.size(), sizeof(T), (size_t)nd.partBytes));
+      "rdJson(arma::Col< T >: size mismatch: %zu*%zu != %zu (dtype %s)\\n",
+      nElem, rdBlobElemSize< T >(nd), (size_t)nd.partBytes, nd.dtype.c_str()));
   }
-  if (!ctx.blobs->readChunk(reinterpret_cast<char *>(tmp.data()), nd.partOfs, nd.partBytes)) {
+  vector< T > tmp(nElem);
+  if (!rdBlobData(ctx, nd, tmp.data(), tmp.size())) {
     return ctx.fail(typeid(arr), stringprintf(
       "rdJson(arma::Col< T >): no chunk %zu %zu\\n",
       (size_t)nd.partOfs, (size_t)nd.partBytes));
@@ -1225,18 +1353,16 @@ void wrJsonBin(WrJsonContext &ctx, vector< typename arma::Row< T > > const &arr)
       accum_range(nd.range, slice[i * n + k], first);
     }
   }
-  nd.partBytes = mul_overflow< size_t >(slice.size(), sizeof(T));
-  nd.partOfs = ctx.blobs->writeChunk(reinterpret_cast<char const *>(slice.data()), nd.partBytes);
-  nd.dtype = ndarray_dtype(T());
   nd.shape.push_back(arr.size());
   nd.shape.push_back(n);
+  wrBlobData(ctx, nd, slice.data(), slice.size());
   wrJson(ctx, nd);
 }
 
 template<typename T>
 void wrJsonSizeBin(WrJsonContext &ctx, vector< typename arma::Row< T > > const &arr)
 {
-  ndarray nd(9, 9, ndarray_dtype(T()), vector< U64 >({9, 9}), MinMax(9.0, 9.0));
+  ndarray nd(9, 9, blobDtypeFor(ctx, T()), vector< U64 >({9, 9}), MinMax(9.0, 9.0));
   wrJsonSize(ctx, nd);
 }
 
@@ -1256,13 +1382,14 @@ bool rdJsonBin(RdJsonContext &ctx, vector< typename arma::Row< T > > &arr)
   arr.resize(nd.shape[0]);
   size_t n = nd.shape[1];
 
-  vector< T > tmp(nd.shape[0] * nd.shape[1]);
-  if (tmp.size() * sizeof(T) != nd.partBytes) {
+  size_t nElem = mul_overflow< size_t >(nd.shape[0], nd.shape[1]);
+  if (!rdBlobCheck< T >(nd, nElem)) {
     return ctx.fail(typeid(arr), stringprintf(
-      "rdJson(arma::Row< T >: size mismatch: %zu*%zu != %zu\\n",
-      tmp.size(), sizeof(T), (size_t)nd.partBytes));
+      "rdJson(arma::Row< T >: size mismatch: %zu*%zu != %zu (dtype %s)\\n",
+      nElem, rdBlobElemSize< T >(nd), (size_t)nd.partBytes, nd.dtype.c_str()));
   }
-  if (!ctx.blobs->readChunk(reinterpret_cast<char *>(tmp.data()), nd.partOfs, nd.partBytes)) {
+  vector< T > tmp(nElem);
+  if (!rdBlobData(ctx, nd, tmp.data(), tmp.size())) {
     return ctx.fail(typeid(arr), stringprintf("rdJson(arma::Row< T >): no chunk %zu %zu\\n",
       (size_t)nd.partOfs, (size_t)nd.partBytes));
   }
@@ -1296,19 +1423,17 @@ void wrJsonBin(WrJsonContext &ctx, vector< typename arma::Mat< T > > const &arr)
       accum_range(nd.range, slice[i * ne + k], first);
     }
   }
-  nd.partBytes = mul_overflow< size_t >(slice.size(), sizeof(T));
-  nd.partOfs = ctx.blobs->writeChunk(reinterpret_cast<char const *>(slice.data()), nd.partBytes);
-  nd.dtype = ndarray_dtype(T());
   nd.shape.push_back(arr.size());
   nd.shape.push_back(nc);
   nd.shape.push_back(nr);
+  wrBlobData(ctx, nd, slice.data(), slice.size());
   wrJson(ctx, nd);
 }
 
 template<typename T>
 void wrJsonSizeBin(WrJsonContext &ctx, vector< typename arma::Mat< T > > const &arr)
 {
-  ndarray nd(9, 9, ndarray_dtype(T()), vector< U64 >({9, 9, 9}), MinMax(9.0, 9.0));
+  ndarray nd(9, 9, blobDtypeFor(ctx, T()), vector< U64 >({9, 9, 9}), MinMax(9.0, 9.0));
   wrJsonSize(ctx, nd);
 }
 
@@ -1331,13 +1456,14 @@ bool rdJsonBin(RdJsonContext &ctx, vector< typename arma::Mat< T > > &arr)
   size_t nr = nd.shape[2];
   size_t ne = nr*nc;
 
-  vector< T > tmp(nd.shape[0] * ne);
-  if (tmp.size() * sizeof(T) != nd.partBytes) {
+  size_t nElem = mul_overflow< size_t >(nd.shape[0], ne);
+  if (!rdBlobCheck< T >(nd, nElem)) {
     return ctx.fail(typeid(arr), stringprintf(
-      "rdJson(arma::Mat< T >: size mismatch: %zu*%zu != %zu\\n",
-      tmp.size(), sizeof(T), (size_t)nd.partBytes));
+      "rdJson(arma::Mat< T >: size mismatch: %zu*%zu != %zu (dtype %s)\\n",
+      nElem, rdBlobElemSize< T >(nd), (size_t)nd.partBytes, nd.dtype.c_str()));
   }
-  if (!ctx.blobs->readChunk(reinterpret_cast<char *>(tmp.data()), nd.partOfs, nd.partBytes)) {
+  vector< T > tmp(nElem);
+  if (!rdBlobData(ctx, nd, tmp.data(), tmp.size())) {
     return ctx.fail(typeid(arr), stringprintf(
       "rdJson(arma::Mat< T >): no chunk %zu %zu\\n",
       (size_t)nd.partOfs, (size_t)nd.partBytes));
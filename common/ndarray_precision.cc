@@ -0,0 +1,363 @@
+#include "tlbcore/common/std_headers.h"
+#include "./ndarray_precision.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  include <immintrin.h>
+#  define NDARRAY_X86_DISPATCH 1
+#endif
+
+size_t ndarray_reduced_size(string const &dtype)
+{
+  if (dtype == "float16" || dtype == "bfloat16" || dtype == "scaled_uint16") return 2;
+  if (dtype == "scaled_uint8") return 1;
+  return 0;
+}
+
+bool ndarray_is_scaled(string const &dtype)
+{
+  return dtype == "scaled_uint8" || dtype == "scaled_uint16";
+}
+
+template<typename T>
+static bool finite_range(T const *src, size_t n, double &rangeMin, double &rangeMax)
+{
+  bool first = true;
+  T lo = 0, hi = 0;
+  for (size_t i = 0; i < n; i++) {
+    T x = src[i];
+    if (isnan(x)) continue;
+    if (isinf(x)) return false;
+    if (first) {
+      lo = hi = x;
+      first = false;
+    } else {
+      lo = min(lo, x);
+      hi = max(hi, x);
+    }
+  }
+  rangeMin = (double)lo;
+  rangeMax = (double)hi;
+  return true;
+}
+
+bool ndarray_finite_range(float const *src, size_t n, double &rangeMin, double &rangeMax)
+{
+  return finite_range(src, n, rangeMin, rangeMax);
+}
+
+bool ndarray_finite_range(double const *src, size_t n, double &rangeMin, double &rangeMax)
+{
+  return finite_range(src, n, rangeMin, rangeMax);
+}
+
+/* ----------------------------------------------------------------------
+   Scalar conversions. Round to nearest even, like the hardware does.
+*/
+
+static inline uint16_t float_to_half1(float f)
+{
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  uint32_t absx = x & 0x7fffffff;
+
+  if (absx >= 0x7f800000) { // Inf or NaN. Keep NaNs quiet
+    return (uint16_t)(sign | 0x7c00 | (absx > 0x7f800000 ? (0x200 | ((absx >> 13) & 0x3ff)) : 0));
+  }
+  if (absx >= 0x477ff000) { // >= 65520 rounds to Inf
+    return (uint16_t)(sign | 0x7c00);
+  }
+  if (absx < 0x38800000) { // Result is subnormal or zero. Let the FPU do the rounding by adding 0.5
+    float af;
+    memcpy(&af, &absx, sizeof(af));
+    af += 0.5f;
+    uint32_t r;
+    memcpy(&r, &af, sizeof(r));
+    return (uint16_t)(sign | (r - 0x3f000000));
+  }
+  uint32_t mantOdd = (absx >> 13) & 1;
+  absx += 0xc8000fff + mantOdd; // rebias exponent by -112 and round
+  return (uint16_t)(sign | (absx >> 13));
+}
+
+static inline float half_to_float1(uint16_t h)
+{
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t em = h & 0x7fff;
+  uint32_t x;
+  if (em >= 0x7c00) { // Inf or NaN
+    x = 0x7f800000 | ((em & 0x3ff) << 13);
+  }
+  else if (em >= 0x0400) { // normal
+    x = (em << 13) + 0x38000000;
+  }
+  else { // subnormal or zero: em * 2^-24
+    float f = (float)em * 5.9604644775390625e-8f;
+    memcpy(&x, &f, sizeof(x));
+  }
+  x |= sign;
+  float ret;
+  memcpy(&ret, &x, sizeof(ret));
+  return ret;
+}
+
+static inline uint16_t float_to_bfloat1(float f)
+{
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  if ((x & 0x7fffffff) > 0x7f800000) { // NaN. Make sure truncation doesn't turn it into Inf
+    return (uint16_t)((x >> 16) | 0x0040);
+  }
+  x += 0x7fff + ((x >> 16) & 1);
+  return (uint16_t)(x >> 16);
+}
+
+static inline float bfloat_to_float1(uint16_t b)
+{
+  uint32_t x = (uint32_t)b << 16;
+  float ret;
+  memcpy(&ret, &x, sizeof(ret));
+  return ret;
+}
+
+/* ----------------------------------------------------------------------
+   SIMD kernels, selected at runtime
+*/
+
+#if defined(NDARRAY_X86_DISPATCH)
+
+static bool have_f16c()
+{
+  static bool ret = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+  return ret;
+}
+
+static bool have_avx2()
+{
+  static bool ret = __builtin_cpu_supports("avx2");
+  return ret;
+}
+
+__attribute__((target("avx,f16c")))
+static void cvt_float_to_half_f16c(float const *src, size_t n, uint16_t *dst)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_loadu_ps(src + i);
+    __m128i h = _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), h);
+  }
+  for (; i < n; i++) {
+    dst[i] = float_to_half1(src[i]);
+  }
+}
+
+__attribute__((target("avx,f16c")))
+static void cvt_half_to_float_f16c(uint16_t const *src, size_t n, float *dst)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i h = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i));
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+  }
+  for (; i < n; i++) {
+    dst[i] = half_to_float1(src[i]);
+  }
+}
+
+__attribute__((target("avx2")))
+static void cvt_float_to_bfloat_avx2(float const *src, size_t n, uint16_t *dst)
+{
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i roundBias = _mm256_set1_epi32(0x7fff);
+  const __m256i quietBit = _mm256_set1_epi32(0x0040);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_loadu_ps(src + i);
+    __m256i bits = _mm256_castps_si256(v);
+    __m256i hi = _mm256_srli_epi32(bits, 16);
+    __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(bits, _mm256_add_epi32(roundBias, _mm256_and_si256(hi, one))), 16);
+    __m256i isNan = _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+    __m256i out = _mm256_blendv_epi8(rounded, _mm256_or_si256(hi, quietBit), isNan);
+    // All lanes are < 0x10000, so the unsigned saturating pack is exact
+    __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(out), _mm256_extracti128_si256(out, 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), packed);
+  }
+  for (; i < n; i++) {
+    dst[i] = float_to_bfloat1(src[i]);
+  }
+}
+
+__attribute__((target("avx2")))
+static void cvt_bfloat_to_float_avx2(uint16_t const *src, size_t n, float *dst)
+{
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i b = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i));
+    __m256i bits = _mm256_slli_epi32(_mm256_cvtepu16_epi32(b), 16);
+    _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(bits));
+  }
+  for (; i < n; i++) {
+    dst[i] = bfloat_to_float1(src[i]);
+  }
+}
+
+#endif
+
+void cvt_float_to_half(float const *src, size_t n, uint16_t *dst)
+{
+#if defined(NDARRAY_X86_DISPATCH)
+  if (have_f16c()) return cvt_float_to_half_f16c(src, n, dst);
+#endif
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = float_to_half1(src[i]);
+  }
+}
+
+void cvt_half_to_float(uint16_t const *src, size_t n, float *dst)
+{
+#if defined(NDARRAY_X86_DISPATCH)
+  if (have_f16c()) return cvt_half_to_float_f16c(src, n, dst);
+#endif
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = half_to_float1(src[i]);
+  }
+}
+
+void cvt_float_to_bfloat(float const *src, size_t n, uint16_t *dst)
+{
+#if defined(NDARRAY_X86_DISPATCH)
+  if (have_avx2()) return cvt_float_to_bfloat_avx2(src, n, dst);
+#endif
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = float_to_bfloat1(src[i]);
+  }
+}
+
+void cvt_bfloat_to_float(uint16_t const *src, size_t n, float *dst)
+{
+#if defined(NDARRAY_X86_DISPATCH)
+  if (have_avx2()) return cvt_bfloat_to_float_avx2(src, n, dst);
+#endif
+  for (size_t i = 0; i < n; i++) {
+    dst[i] = bfloat_to_float1(src[i]);
+  }
+}
+
+/* ----------------------------------------------------------------------
+   Scaled integer codes. The top code is reserved for NaN.
+*/
+
+template<typename T, typename Q>
+static void narrow_scaled(double rangeMin, double rangeMax, T const *src, size_t n, Q *dst)
+{
+  const Q nanCode = numeric_limits< Q >::max();
+  const double steps = (double)nanCode - 1.0;
+  double scale = (rangeMax > rangeMin) ? steps / (rangeMax - rangeMin) : 0.0;
+  for (size_t i = 0; i < n; i++) {
+    double x = (double)src[i];
+    if (isnan(x)) {
+      dst[i] = nanCode;
+    } else {
+      double q = (x - rangeMin) * scale + 0.5;
+      dst[i] = (Q)max(0.0, min(steps, q));
+    }
+  }
+}
+
+template<typename T, typename Q>
+static void widen_scaled(double rangeMin, double rangeMax, Q const *src, size_t n, T *dst)
+{
+  const Q nanCode = numeric_limits< Q >::max();
+  const double steps = (double)nanCode - 1.0;
+  double step = (rangeMax - rangeMin) / steps;
+  for (size_t i = 0; i < n; i++) {
+    Q q = src[i];
+    dst[i] = (q == nanCode) ? numeric_limits< T >::quiet_NaN() : (T)(rangeMin + (double)q * step);
+  }
+}
+
+/*
+  The half-width kernels take floats, so doubles go through a small buffer.
+*/
+static const size_t CVT_BATCH = 1024;
+
+void ndarray_narrow(string const &dtype, double rangeMin, double rangeMax, float const *src, size_t n, u_char *dst)
+{
+  if (dtype == "float16") {
+    cvt_float_to_half(src, n, reinterpret_cast<uint16_t *>(dst));
+  }
+  else if (dtype == "bfloat16") {
+    cvt_float_to_bfloat(src, n, reinterpret_cast<uint16_t *>(dst));
+  }
+  else if (dtype == "scaled_uint8") {
+    narrow_scaled(rangeMin, rangeMax, src, n, reinterpret_cast<uint8_t *>(dst));
+  }
+  else if (dtype == "scaled_uint16") {
+    narrow_scaled(rangeMin, rangeMax, src, n, reinterpret_cast<uint16_t *>(dst));
+  }
+  else {
+    throw runtime_error("ndarray_narrow: unknown dtype " + dtype);
+  }
+}
+
+void ndarray_narrow(string const &dtype, double rangeMin, double rangeMax, double const *src, size_t n, u_char *dst)
+{
+  if (dtype == "scaled_uint8") {
+    narrow_scaled(rangeMin, rangeMax, src, n, reinterpret_cast<uint8_t *>(dst));
+  }
+  else if (dtype == "scaled_uint16") {
+    narrow_scaled(rangeMin, rangeMax, src, n, reinterpret_cast<uint16_t *>(dst));
+  }
+  else {
+    size_t elemSize = ndarray_reduced_size(dtype);
+    float tmp[CVT_BATCH];
+    for (size_t i = 0; i < n; i += CVT_BATCH) {
+      size_t todo = min(CVT_BATCH, n - i);
+      for (size_t k = 0; k < todo; k++) {
+        tmp[k] = (float)src[i + k];
+      }
+      ndarray_narrow(dtype, rangeMin, rangeMax, tmp, todo, dst + i * elemSize);
+    }
+  }
+}
+
+void ndarray_widen(string const &dtype, double rangeMin, double rangeMax, u_char const *src, size_t n, float *dst)
+{
+  if (dtype == "float16") {
+    cvt_half_to_float(reinterpret_cast<uint16_t const *>(src), n, dst);
+  }
+  else if (dtype == "bfloat16") {
+    cvt_bfloat_to_float(reinterpret_cast<uint16_t const *>(src), n, dst);
+  }
+  else if (dtype == "scaled_uint8") {
+    widen_scaled(rangeMin, rangeMax, reinterpret_cast<uint8_t const *>(src), n, dst);
+  }
+  else if (dtype == "scaled_uint16") {
+    widen_scaled(rangeMin, rangeMax, reinterpret_cast<uint16_t const *>(src), n, dst);
+  }
+  else {
+    throw runtime_error("ndarray_widen: unknown dtype " + dtype);
+  }
+}
+
+void ndarray_widen(string const &dtype, double rangeMin, double rangeMax, u_char const *src, size_t n, double *dst)
+{
+  if (dtype == "scaled_uint8") {
+    widen_scaled(rangeMin, rangeMax, reinterpret_cast<uint8_t const *>(src), n, dst);
+  }
+  else if (dtype == "scaled_uint16") {
+    widen_scaled(rangeMin, rangeMax, reinterpret_cast<uint16_t const *>(src), n, dst);
+  }
+  else {
+    size_t elemSize = ndarray_reduced_size(dtype);
+    float tmp[CVT_BATCH];
+    for (size_t i = 0; i < n; i += CVT_BATCH) {
+      size_t todo = min(CVT_BATCH, n - i);
+      ndarray_widen(dtype, rangeMin, rangeMax, src + i * elemSize, todo, tmp);
+      for (size_t k = 0; k < todo; k++) {
+        dst[i + k] = (double)tmp[k];
+      }
+    }
+  }
+}
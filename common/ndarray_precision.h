@@ -0,0 +1,49 @@
+#pragma once
+
+/*
+  Reduced-precision storage for blob arrays.
+
+  When writing JSON with blobs, float and double arrays are normally written at full width.
+  Set WrJsonContext::blobDtype (or jsonstr::blobDtype before calling toJson) to trade
+  precision for size:
+    "float16"         IEEE half. About 3 significant digits, range +-65504. 2 bytes.
+    "bfloat16"        The top half of a float32. Full float range, about 2 significant digits. 2 bytes.
+    "scaled_uint8"    Linear over [range.min .. range.max] in 254 steps. 1 byte, 0xff is NaN.
+    "scaled_uint16"   Linear over [range.min .. range.max] in 65534 steps. 2 bytes, 0xffff is NaN.
+
+  The scaled types use the MinMax range stored in the ndarray header, so readers need that to
+  decode. If the data contains infinities there's no sensible scale, so the writer falls back to
+  full width.
+
+  Other element types (ints, complex, bool) are always written at full width.
+  rdJson widens back to the declared C++ type automatically.
+
+  The float16 and bfloat16 kernels use F16C and AVX2 when the CPU has them (checked at runtime),
+  and scalar code otherwise.
+*/
+
+// Bytes per element for a reduced-precision dtype, or 0 if it isn't one.
+size_t ndarray_reduced_size(string const &dtype);
+bool ndarray_is_scaled(string const &dtype);
+
+/*
+  Compute min and max over the finite elements, ignoring NaNs.
+  Returns false if there are infinities (so a scaled encoding won't work).
+*/
+bool ndarray_finite_range(float const *src, size_t n, double &rangeMin, double &rangeMax);
+bool ndarray_finite_range(double const *src, size_t n, double &rangeMin, double &rangeMax);
+
+/*
+  Convert n elements to/from the reduced-precision dtype. dst (for narrow) or src (for widen)
+  holds n * ndarray_reduced_size(dtype) bytes. rangeMin and rangeMax are only used for the scaled types.
+*/
+void ndarray_narrow(string const &dtype, double rangeMin, double rangeMax, float const *src, size_t n, u_char *dst);
+void ndarray_narrow(string const &dtype, double rangeMin, double rangeMax, double const *src, size_t n, u_char *dst);
+void ndarray_widen(string const &dtype, double rangeMin, double rangeMax, u_char const *src, size_t n, float *dst);
+void ndarray_widen(string const &dtype, double rangeMin, double rangeMax, u_char const *src, size_t n, double *dst);
+
+// The kernels themselves
+void cvt_float_to_half(float const *src, size_t n, uint16_t *dst);
+void cvt_half_to_float(uint16_t const *src, size_t n, float *dst);
+void cvt_float_to_bfloat(float const *src, size_t n, uint16_t *dst);
+void cvt_bfloat_to_float(uint16_t const *src, size_t n, float *dst);
@@ -0,0 +1,413 @@
+#include "tlbcore/common/std_headers.h"
+#include "./packet_log.h"
+#include "./packetbuf_types.h"
+#include "./crc32c.h"
+#include <thread>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zstd.h>
+
+static const char PACKET_LOG_MAGIC[8] = {'T', 'L', 'B', 'P', 'K', 'L', 'O', 'G'};
+static const char PACKET_LOG_INDEX_MAGIC[8] = {'T', 'L', 'B', 'P', 'K', 'I', 'D', 'X'};
+static const U32 PACKET_LOG_VERSION = 1;
+static const U32 PACKET_LOG_BLOCK_MAGIC = 0x4b424c50; // "PLBK"
+static const U32 PACKET_LOG_ZSTD = 1;
+
+static const size_t PACKET_LOG_HDR_SIZE = 16;
+static const size_t PACKET_LOG_FOOTER_SIZE = 24;
+
+static_assert(sizeof(packet_log_block_hdr) == 48, "packet_log_block_hdr has padding");
+static_assert(sizeof(packet_log_block_info) == 40, "packet_log_block_info has padding");
+
+
+packet_log_writer::packet_log_writer(string const &_fn, bool append, int _level, size_t _block_size)
+  :fn(_fn),
+   level(_level),
+   block_size(_block_size),
+   cur(_block_size + _block_size / 8)
+{
+  struct stat st;
+  if (append && stat(fn.c_str(), &st) == 0 && st.st_size > 0) {
+    packet_log_reader old(fn);
+    index = old.index;
+    next_seq = old.size();
+    file_pos = (off_t)old.data_end;
+
+    fd = open(fn.c_str(), O_WRONLY, 0);
+    if (fd < 0) throw runtime_error(fn + string(": ") + string(strerror(errno)));
+    // Drop the old index and footer, or a partial block if it crashed. We'll write new ones.
+    if (ftruncate(fd, file_pos) < 0 || lseek(fd, file_pos, SEEK_SET) < 0) {
+      int err = errno;
+      ::close(fd);
+      fd = -1;
+      throw runtime_error(fn + string(": ") + string(strerror(err)));
+    }
+    return;
+  }
+
+  fd = open(fn.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if (fd < 0) throw runtime_error(fn + string(": ") + string(strerror(errno)));
+  packet hdr;
+  hdr.add_bytes(PACKET_LOG_MAGIC, sizeof(PACKET_LOG_MAGIC));
+  hdr.add(PACKET_LOG_VERSION);
+  hdr.add((U32)0);
+  write_all(hdr.ptr(), hdr.size());
+}
+
+packet_log_writer::~packet_log_writer()
+{
+  try {
+    close();
+  }
+  catch (exception const &ex) {
+    eprintf("packet_log_writer: %s\n", ex.what());
+  }
+}
+
+void packet_log_writer::write_all(void const *data, size_t size)
+{
+  auto p = reinterpret_cast< char const * >(data);
+  while (size > 0) {
+    ssize_t nw = write(fd, p, size);
+    if (nw < 0 && errno == EINTR) continue;
+    if (nw < 0) throw runtime_error(fn + string(": write failed: ") + string(strerror(errno)));
+    p += nw;
+    size -= (size_t)nw;
+    file_pos += nw;
+  }
+}
+
+void packet_log_writer::add(packet const &it, double ts)
+{
+  if (fd < 0) throw runtime_error(fn + ": add after close");
+  if (cur_n == 0) cur_first_ts = ts;
+  cur.add(ts);
+  cur.add_pkt(it);
+  cur_last_ts = ts;
+  cur_n++;
+  next_seq++;
+  if (cur.size() >= block_size) flush();
+}
+
+void packet_log_writer::flush()
+{
+  if (cur_n == 0) return;
+
+  packet_log_block_hdr hdr {};
+  hdr.magic = PACKET_LOG_BLOCK_MAGIC;
+  hdr.first_seq = next_seq - cur_n;
+  hdr.n_packets = cur_n;
+  hdr.raw_size = (U32)cur.size();
+  hdr.first_ts = cur_first_ts;
+  hdr.last_ts = cur_last_ts;
+
+  string comp;
+  char const *stored = reinterpret_cast< char const * >(cur.ptr());
+  size_t stored_size = cur.size();
+  if (level > 0) {
+    zstdCompress(stored, stored_size, comp, level);
+    // Incompressible data gets stored as is
+    if (comp.size() < stored_size) {
+      hdr.flags |= PACKET_LOG_ZSTD;
+      stored = comp.data();
+      stored_size = comp.size();
+    }
+  }
+  hdr.stored_size = (U32)stored_size;
+  hdr.crc = crc32c(0, stored, stored_size);
+
+  packet_log_block_info info {};
+  info.offset = (U64)file_pos;
+  info.first_seq = hdr.first_seq;
+  info.n_packets = hdr.n_packets;
+  info.flags = hdr.flags;
+  info.first_ts = hdr.first_ts;
+  info.last_ts = hdr.last_ts;
+
+  write_all(&hdr, sizeof(hdr));
+  write_all(stored, stored_size);
+  index.push_back(info);
+
+  cur.clear();
+  cur_n = 0;
+}
+
+void packet_log_writer::close()
+{
+  if (fd < 0) return;
+  flush();
+
+  packet footer(index.size() * sizeof(packet_log_block_info) + PACKET_LOG_FOOTER_SIZE);
+  U64 index_offset = (U64)file_pos;
+  if (!index.empty()) {
+    footer.add_bytes(reinterpret_cast< u_char const * >(index.data()), index.size() * sizeof(packet_log_block_info));
+  }
+  footer.add(index_offset);
+  footer.add((U64)index.size());
+  footer.add_bytes(PACKET_LOG_INDEX_MAGIC, sizeof(PACKET_LOG_INDEX_MAGIC));
+  write_all(footer.ptr(), footer.size());
+
+  int rc = ::close(fd);
+  fd = -1;
+  if (rc < 0) throw runtime_error(fn + string(": ") + string(strerror(errno)));
+}
+
+// ----------------------------------------------------------------------
+
+struct packet_log_map {
+  ~packet_log_map()
+  {
+    if (data) munmap(const_cast< u_char * >(data), size);
+  }
+
+  u_char const *data {nullptr};
+  size_t size {0};
+};
+
+// Packets pointing into the map of an uncompressed log keep it alive
+static void packet_log_release(packet_contents *it)
+{
+  delete reinterpret_cast< shared_ptr< packet_log_map > * >(it->release_arg);
+}
+
+packet_log_reader::packet_log_reader(string const &_fn)
+  :fn(_fn),
+   map(make_shared< packet_log_map >())
+{
+  int fd = open(fn.c_str(), O_RDONLY, 0);
+  if (fd < 0) throw runtime_error(fn + string(": ") + string(strerror(errno)));
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int err = errno;
+    ::close(fd);
+    throw runtime_error(fn + string(": ") + string(strerror(err)));
+  }
+  size_t total = (size_t)st.st_size;
+  if (total < PACKET_LOG_HDR_SIZE) {
+    ::close(fd);
+    throw runtime_error(fn + ": not a packet log (too short)");
+  }
+  void *mapped = mmap(nullptr, total, PROT_READ, MAP_PRIVATE, fd, 0);
+  int err = errno;
+  ::close(fd);
+  if (mapped == MAP_FAILED) throw runtime_error(fn + string(": mmap: ") + string(strerror(err)));
+  map->data = reinterpret_cast< u_char const * >(mapped);
+  map->size = total;
+
+  auto base = map->data;
+  U32 version;
+  memcpy(&version, base + 8, sizeof(version));
+  if (memcmp(base, PACKET_LOG_MAGIC, sizeof(PACKET_LOG_MAGIC)) != 0 || version != PACKET_LOG_VERSION) {
+    throw runtime_error(fn + ": not a packet log (bad header)");
+  }
+
+  auto valid_block = [base](U64 off, U64 end, U64 expected_seq, packet_log_block_hdr &hdr) {
+    if (off + sizeof(hdr) > end) return false;
+    memcpy(&hdr, base + off, sizeof(hdr));
+    return hdr.magic == PACKET_LOG_BLOCK_MAGIC &&
+      off + sizeof(hdr) + hdr.stored_size <= end &&
+      hdr.first_seq == expected_seq;
+  };
+
+  // Use the index at the end if it's there and consistent
+  if (total >= PACKET_LOG_HDR_SIZE + PACKET_LOG_FOOTER_SIZE) {
+    U64 index_offset, n_blocks;
+    memcpy(&index_offset, base + total - PACKET_LOG_FOOTER_SIZE, 8);
+    memcpy(&n_blocks, base + total - PACKET_LOG_FOOTER_SIZE + 8, 8);
+    if (memcmp(base + total - 8, PACKET_LOG_INDEX_MAGIC, 8) == 0 &&
+        index_offset >= PACKET_LOG_HDR_SIZE &&
+        n_blocks <= total / sizeof(packet_log_block_info) &&
+        index_offset + n_blocks * sizeof(packet_log_block_info) + PACKET_LOG_FOOTER_SIZE == total) {
+      index.resize(n_blocks);
+      if (n_blocks) memcpy(index.data(), base + index_offset, n_blocks * sizeof(packet_log_block_info));
+      U64 seq = 0;
+      bool ok = true;
+      for (auto &it : index) {
+        packet_log_block_hdr hdr;
+        if (it.first_seq != seq || !valid_block(it.offset, index_offset, seq, hdr) || hdr.n_packets != it.n_packets) {
+          ok = false;
+          break;
+        }
+        seq += it.n_packets;
+      }
+      if (ok) {
+        data_end = index_offset;
+        return;
+      }
+      index.clear();
+    }
+  }
+
+  // No footer, probably because the writer died. Walk the blocks instead.
+  recovered = true;
+  U64 pos = PACKET_LOG_HDR_SIZE;
+  U64 seq = 0;
+  packet_log_block_hdr hdr;
+  while (valid_block(pos, total, seq, hdr)) {
+    packet_log_block_info info {};
+    info.offset = pos;
+    info.first_seq = hdr.first_seq;
+    info.n_packets = hdr.n_packets;
+    info.flags = hdr.flags;
+    info.first_ts = hdr.first_ts;
+    info.last_ts = hdr.last_ts;
+    index.push_back(info);
+    seq += hdr.n_packets;
+    pos += sizeof(hdr) + hdr.stored_size;
+  }
+  data_end = pos;
+}
+
+packet_log_reader::~packet_log_reader()
+{
+}
+
+U64 packet_log_reader::size() const
+{
+  if (index.empty()) return 0;
+  return index.back().first_seq + index.back().n_packets;
+}
+
+size_t packet_log_reader::find_seq(U64 seq) const
+{
+  auto it = upper_bound(index.begin(), index.end(), seq, [](U64 a, packet_log_block_info const &b) {
+    return a < b.first_seq;
+  });
+  if (it == index.begin()) return index.size();
+  --it;
+  if (seq >= it->first_seq + it->n_packets) return index.size();
+  return (size_t)(it - index.begin());
+}
+
+size_t packet_log_reader::find_time(double ts) const
+{
+  auto it = lower_bound(index.begin(), index.end(), ts, [](packet_log_block_info const &a, double b) {
+    return a.last_ts < b;
+  });
+  return (size_t)(it - index.begin());
+}
+
+packet packet_log_reader::read_block(size_t block_index) const
+{
+  auto &info = index.at(block_index);
+  packet_log_block_hdr hdr;
+  memcpy(&hdr, map->data + info.offset, sizeof(hdr));
+  auto stored = map->data + info.offset + sizeof(hdr);
+
+  if (crc32c(0, stored, hdr.stored_size) != hdr.crc) {
+    throw runtime_error(fn + ": checksum mismatch in block " + to_string(block_index) + " at " + to_string(info.offset));
+  }
+  if (hdr.flags & PACKET_LOG_ZSTD) {
+    packet ret(hdr.raw_size);
+    size_t rc = ZSTD_decompress(ret.wr_ptr(), hdr.raw_size, stored, hdr.stored_size);
+    if (ZSTD_isError(rc) || rc != hdr.raw_size) {
+      throw runtime_error(fn + ": bad compressed data in block " + to_string(block_index));
+    }
+    ret.wr_pos = rc;
+    return ret;
+  }
+  return packet::from_external(stored, hdr.stored_size, packet_log_release, new shared_ptr< packet_log_map >(map));
+}
+
+packet_log_cursor packet_log_reader::seek(U64 seq) const
+{
+  return packet_log_cursor(*this, find_seq(seq), seq);
+}
+
+packet_log_cursor packet_log_reader::seek_time(double ts) const
+{
+  size_t block_index = find_time(ts);
+  if (block_index >= index.size()) return packet_log_cursor(*this, block_index, size());
+
+  packet_log_cursor ret(*this, block_index, index[block_index].first_seq);
+  while (ret.block.remaining() > 0) {
+    size_t save_rd_pos = ret.block.rd_pos;
+    double pkt_ts;
+    ret.block.get(pkt_ts);
+    if (pkt_ts >= ts) {
+      ret.block.rd_pos = save_rd_pos;
+      break;
+    }
+    ret.block.get_pkt();
+    ret.seq++;
+  }
+  return ret;
+}
+
+void packet_log_reader::scan_parallel(U64 begin_seq, U64 end_seq, size_t n_threads,
+                                      std::function< void(U64 seq, double ts, packet &it) > const &f) const
+{
+  end_seq = min(end_seq, size());
+  if (begin_seq >= end_seq) return;
+  size_t first_block = find_seq(begin_seq);
+  size_t end_block = find_seq(end_seq - 1) + 1;
+
+  if (n_threads == 0) n_threads = thread::hardware_concurrency();
+  n_threads = max(size_t(1), min(n_threads, end_block - first_block));
+
+  std::atomic< size_t > next_block {first_block};
+  std::atomic< bool > failed {false};
+  mutex err_mutex;
+  exception_ptr err;
+
+  auto worker = [&]() {
+    try {
+      while (!failed.load(std::memory_order_relaxed)) {
+        size_t block_index = next_block.fetch_add(1);
+        if (block_index >= end_block) break;
+        packet block = read_block(block_index);
+        U64 seq = index[block_index].first_seq;
+        while (block.remaining() > 0 && seq < end_seq) {
+          double ts;
+          block.get(ts);
+          packet it = block.get_pkt();
+          if (seq >= begin_seq) f(seq, ts, it);
+          seq++;
+        }
+      }
+    }
+    catch (...) {
+      unique_lock< mutex > lock(err_mutex);
+      if (!err) err = current_exception();
+      failed = true;
+    }
+  };
+
+  vector< thread > threads;
+  for (size_t i = 1; i < n_threads; i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &it : threads) it.join();
+  if (err) rethrow_exception(err);
+}
+
+// ----------------------------------------------------------------------
+
+packet_log_cursor::packet_log_cursor(packet_log_reader const &_owner, size_t _block_index, U64 _seq)
+  :owner(&_owner),
+   block_index(_block_index),
+   seq(_seq)
+{
+  if (block_index < owner->n_blocks()) {
+    block = owner->read_block(block_index);
+    for (U64 i = owner->index[block_index].first_seq; i < seq; i++) {
+      block.get_skip(sizeof(double));
+      block.get_pkt();
+    }
+  }
+}
+
+bool packet_log_cursor::next(packet &it, double &ts)
+{
+  if (block_index >= owner->n_blocks()) return false;
+  while (block.remaining() == 0) {
+    block_index++;
+    if (block_index >= owner->n_blocks()) return false;
+    block = owner->read_block(block_index);
+  }
+  block.get(ts);
+  it = block.get_pkt();
+  seq++;
+  return true;
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include "./packetbuf.h"
+#include "./zstd_io.h"
+
+/*
+  An append-only log of timestamped packets, for recording streams that are too big to replay
+  from the start every time like to_file_boxed files.
+
+  File layout (all integers little-endian):
+    header: "TLBPKLOG" U32 version U32 reserved
+    blocks: packet_log_block_hdr followed by stored_size bytes
+    index:  one packet_log_block_info per block
+    footer: U64 index_offset U64 n_blocks "TLBPKIDX"
+
+  A block holds about block_size bytes of packets, each as a double timestamp followed by the
+  packet in packet::add_pkt format, and is compressed with zstd (unless the level is 0) and
+  checksummed with crc32c. The index at the end gives the first sequence number and timestamp
+  range of every block, so the reader can find the block holding the Nth packet, or a given time,
+  by binary search and only decompress that one. If the writer didn't get to close the file (so
+  there's no footer), the reader rebuilds the index by walking the block headers, and a writer
+  opened with append=true truncates any partial block and carries on.
+
+  Timestamps should be nondecreasing, or seek_time won't find the right place.
+
+  The reader mmaps the file and is safe to use from several threads at once, so you can give
+  each thread its own cursor over a disjoint range of the log, or use scan_parallel.
+*/
+
+struct packet_log_block_hdr {
+  U32 magic;
+  U32 flags;
+  U64 first_seq;
+  U32 n_packets;
+  U32 stored_size;
+  U32 raw_size;
+  U32 crc;
+  double first_ts;
+  double last_ts;
+};
+
+struct packet_log_block_info {
+  U64 offset; // of the packet_log_block_hdr
+  U64 first_seq;
+  U32 n_packets;
+  U32 flags;
+  double first_ts;
+  double last_ts;
+};
+
+struct packet_log_writer {
+  packet_log_writer(string const &_fn, bool append = false, int _level = ZSTD_IO_DEFAULT_LEVEL, size_t _block_size = 1024*1024);
+  ~packet_log_writer();
+  packet_log_writer(packet_log_writer const &) = delete;
+  packet_log_writer & operator=(packet_log_writer const &) = delete;
+
+  void add(packet const &it, double ts); // Writes the bytes between its rd_pos and wr_pos
+  void flush(); // Write out the current block
+  void close(); // Write the index and footer. Called by the destructor if you don't
+
+  U64 size() const { return next_seq; }
+
+  string fn;
+  int level;
+  size_t block_size;
+  int fd {-1};
+  off_t file_pos {0};
+  U64 next_seq {0};
+  vector< packet_log_block_info > index;
+
+  packet cur;
+  U32 cur_n {0};
+  double cur_first_ts {0.0};
+  double cur_last_ts {0.0};
+
+private:
+  void write_all(void const *data, size_t size);
+};
+
+struct packet_log_map;
+struct packet_log_reader;
+
+/*
+  Reads packets in order starting from wherever it was created (see packet_log_reader::seek).
+  The packets it returns share the decompressed block (or, for uncompressed logs, the mapped
+  file) rather than copying.
+*/
+struct packet_log_cursor {
+  packet_log_cursor(packet_log_reader const &_owner, size_t _block_index, U64 _seq);
+
+  bool next(packet &it, double &ts); // Returns false at the end of the log
+
+  packet_log_reader const *owner;
+  size_t block_index;
+  U64 seq; // of the packet next() will return
+  packet block;
+};
+
+struct packet_log_reader {
+  explicit packet_log_reader(string const &_fn);
+  ~packet_log_reader();
+
+  U64 size() const; // Number of packets
+  size_t n_blocks() const { return index.size(); }
+
+  // Index of the block containing packet seq, or the first one with a packet at or after ts.
+  // Return n_blocks() if there's no such block.
+  size_t find_seq(U64 seq) const;
+  size_t find_time(double ts) const;
+
+  // The decompressed contents of a block. Throws runtime_error if it's corrupt
+  packet read_block(size_t block_index) const;
+
+  packet_log_cursor seek(U64 seq) const;
+  packet_log_cursor seek_time(double ts) const;
+
+  /*
+    Call f for every packet in [begin_seq, end_seq) from n_threads threads, each taking a block
+    at a time. Calls for different blocks happen concurrently and in no particular order. If f
+    throws, the other threads stop after their current block and the exception is rethrown here.
+  */
+  void scan_parallel(U64 begin_seq, U64 end_seq, size_t n_threads,
+                     std::function< void(U64 seq, double ts, packet &it) > const &f) const;
+
+  string fn;
+  shared_ptr< packet_log_map > map;
+  vector< packet_log_block_info > index;
+  size_t data_end {0}; // end of the last valid block
+  bool recovered {false}; // There was no footer and we rebuilt the index from the blocks
+};
@@ -0,0 +1,379 @@
+#include "tlbcore/common/std_headers.h"
+#include "./packet_ring.h"
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <thread>
+#if defined(__linux__)
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#endif
+
+static const U64 PACKET_RING_MAGIC = 0x474e49524b504c54ULL; // "TLPKRING"
+static const U32 PACKET_RING_VERSION = 1;
+static const size_t PACKET_RING_REC_HDR = 8;
+
+/*
+  Lives in the first page of the memfd. Things written by different sides are on different cache
+  lines: writers contend on reserve_pos, and the reader only touches commit_pos to read it.
+*/
+struct packet_ring_shared {
+  U64 magic;
+  U32 version;
+  U32 reserved;
+  U64 capacity;
+
+  alignas(64) std::atomic< U64 > reserve_pos;
+  alignas(64) std::atomic< U64 > commit_pos;
+  std::atomic< U32 > data_seq; // bumped to wake the reader
+  std::atomic< U32 > reader_waiting;
+  alignas(64) std::atomic< U64 > read_pos;
+  std::atomic< U32 > space_seq; // bumped to wake writers
+  std::atomic< U32 > writers_waiting;
+};
+
+static_assert(sizeof(std::atomic< U32 >) == sizeof(U32), "futexes need plain 32-bit words");
+
+/*
+  How many times to poll before sleeping on the futex. Spinning only helps if the other side is
+  running on another core at the same time.
+ */
+static int ring_spins()
+{
+  static int ret = thread::hardware_concurrency() > 1 ? 2000 : 0;
+  return ret;
+}
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+static inline size_t ring_rec_size(size_t pkt_size)
+{
+  return PACKET_RING_REC_HDR + ((pkt_size + 7) & ~size_t(7));
+}
+
+static size_t ring_hdr_size()
+{
+  return max(size_t(sysconf(_SC_PAGESIZE)), sizeof(packet_ring_shared));
+}
+
+#if defined(__linux__)
+/*
+  Not FUTEX_PRIVATE_FLAG, since the other side is usually in another process.
+  A timeout < 0 waits forever.
+ */
+static void ring_futex_wait(std::atomic< U32 > *addr, U32 val, double timeout)
+{
+  struct timespec ts;
+  if (timeout >= 0.0) {
+    ts.tv_sec = (time_t)timeout;
+    ts.tv_nsec = (long)((timeout - (double)ts.tv_sec) * 1e9);
+  }
+  syscall(SYS_futex, reinterpret_cast< U32 * >(addr), FUTEX_WAIT, val, timeout >= 0.0 ? &ts : nullptr, nullptr, 0);
+}
+
+static void ring_futex_wake(std::atomic< U32 > *addr, int n)
+{
+  syscall(SYS_futex, reinterpret_cast< U32 * >(addr), FUTEX_WAKE, n, nullptr, nullptr, 0);
+}
+#else
+static void ring_futex_wait(std::atomic< U32 > *addr, U32 val, double timeout)
+{
+  sched_yield();
+}
+
+static void ring_futex_wake(std::atomic< U32 > *addr, int n)
+{
+}
+#endif
+
+
+packet_ring::packet_ring()
+{
+}
+
+packet_ring::~packet_ring()
+{
+  close();
+}
+
+void packet_ring::close()
+{
+  if (shared) {
+    munmap(reinterpret_cast< void * >(shared), map_size);
+    shared = nullptr;
+    data = nullptr;
+    map_size = 0;
+  }
+  if (fd != -1) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+void packet_ring::create(size_t _capacity)
+{
+#if defined(__linux__)
+  if (shared) throw runtime_error("packet_ring::create: already open");
+  size_t page = ring_hdr_size();
+  capacity = page;
+  while (capacity < _capacity) capacity *= 2;
+
+  fd = (int)syscall(SYS_memfd_create, "packet_ring", 1 /* MFD_CLOEXEC */);
+  if (fd < 0) throw runtime_error(string("memfd_create: ") + string(strerror(errno)));
+  if (ftruncate(fd, (off_t)(ring_hdr_size() + capacity)) < 0) {
+    int err = errno;
+    close();
+    throw runtime_error(string("packet_ring: ftruncate: ") + string(strerror(err)));
+  }
+  map_ring();
+  // The memfd starts zeroed, so the positions and counters are already 0
+  shared->capacity = capacity;
+  shared->version = PACKET_RING_VERSION;
+  shared->magic = PACKET_RING_MAGIC;
+#else
+  throw runtime_error("packet_ring: needs Linux");
+#endif
+}
+
+void packet_ring::attach(int _fd)
+{
+  if (shared) throw runtime_error("packet_ring::attach: already open");
+  fd = _fd;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int err = errno;
+    close();
+    throw runtime_error(string("packet_ring: fstat: ") + string(strerror(err)));
+  }
+  packet_ring_shared hdr;
+  if (size_t(st.st_size) < ring_hdr_size() || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+      hdr.magic != PACKET_RING_MAGIC || hdr.version != PACKET_RING_VERSION ||
+      size_t(st.st_size) != ring_hdr_size() + hdr.capacity || (hdr.capacity & (hdr.capacity - 1)) != 0) {
+    close();
+    throw runtime_error("packet_ring: fd is not a packet_ring");
+  }
+  capacity = hdr.capacity;
+  map_ring();
+}
+
+/*
+  Map the header and data, then the data again right after, so data[capacity + i] is data[i].
+  We reserve the whole range first so nothing else can land in the middle.
+ */
+void packet_ring::map_ring()
+{
+  size_t hdr_size = ring_hdr_size();
+  map_size = hdr_size + 2 * capacity;
+  auto base = reinterpret_cast< uint8_t * >(mmap(nullptr, map_size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0));
+  if (base == MAP_FAILED) {
+    int err = errno;
+    map_size = 0;
+    close();
+    throw runtime_error(string("packet_ring: mmap: ") + string(strerror(err)));
+  }
+  if (mmap(base, hdr_size + capacity, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED ||
+      mmap(base + hdr_size + capacity, capacity, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, (off_t)hdr_size) == MAP_FAILED) {
+    int err = errno;
+    munmap(base, map_size);
+    map_size = 0;
+    close();
+    throw runtime_error(string("packet_ring: mmap: ") + string(strerror(err)));
+  }
+  shared = reinterpret_cast< packet_ring_shared * >(base);
+  data = base + hdr_size;
+}
+
+size_t packet_ring::max_size() const
+{
+  return capacity - PACKET_RING_REC_HDR;
+}
+
+size_t packet_ring::used() const
+{
+  return (size_t)(shared->commit_pos.load(std::memory_order_acquire) - shared->read_pos.load(std::memory_order_acquire));
+}
+
+
+// ----------------------------------------------------------------------
+
+bool packet_ring::write_records(packet const *its, size_t n, bool block)
+{
+  if (!shared) throw runtime_error("packet_ring: not open");
+  U64 need = 0;
+  for (size_t i = 0; i < n; i++) {
+    size_t size = (size_t)its[i].remaining();
+    if (size > max_size()) {
+      throw fmt_runtime_error("packet_ring: packet of %zu bytes can't fit in a ring of %zu", size, capacity);
+    }
+    need += ring_rec_size(size);
+  }
+  if (need == 0) return true;
+  if (need > capacity) throw fmt_runtime_error("packet_ring: batch of %lu bytes can't fit in a ring of %zu", (u_long)need, capacity);
+
+  // Claim [pos, pos+need)
+  U64 pos = shared->reserve_pos.load(std::memory_order_relaxed);
+  int spins = 0;
+  while (true) {
+    U64 rd = shared->read_pos.load(std::memory_order_acquire);
+    if (pos + need - rd <= capacity) {
+      if (shared->reserve_pos.compare_exchange_weak(pos, pos + need, std::memory_order_relaxed)) break;
+      continue;
+    }
+    if (!block) return false;
+    if (++spins < ring_spins()) {
+      cpu_relax();
+    }
+    else {
+      U32 seq = shared->space_seq.load();
+      shared->writers_waiting.fetch_add(1);
+      pos = shared->reserve_pos.load();
+      if (pos + need - shared->read_pos.load() > capacity) {
+        ring_futex_wait(&shared->space_seq, seq, -1.0);
+      }
+      shared->writers_waiting.fetch_sub(1);
+    }
+    pos = shared->reserve_pos.load(std::memory_order_relaxed);
+  }
+
+  U64 wr = pos;
+  for (size_t i = 0; i < n; i++) {
+    uint8_t *rec = data + (wr & (capacity - 1));
+    size_t size = (size_t)its[i].remaining();
+    U32 hdr[2] = {(U32)size, 0};
+    memcpy(rec, hdr, sizeof(hdr));
+    memcpy(rec + PACKET_RING_REC_HDR, its[i].rd_ptr(), size);
+    wr += ring_rec_size(size);
+  }
+
+  // Publish in claim order, so wait for any writer that claimed before us
+  spins = 0;
+  while (shared->commit_pos.load(std::memory_order_acquire) != pos) {
+    if (++spins < ring_spins()) {
+      cpu_relax();
+    } else {
+      sched_yield();
+    }
+  }
+  shared->commit_pos.store(pos + need);
+  if (shared->reader_waiting.load()) {
+    shared->data_seq.fetch_add(1);
+    ring_futex_wake(&shared->data_seq, 1);
+  }
+  return true;
+}
+
+void packet_ring::write(packet const &it)
+{
+  write_records(&it, 1, true);
+}
+
+bool packet_ring::try_write(packet const &it)
+{
+  return write_records(&it, 1, false);
+}
+
+void packet_ring::write_batch(packet const *its, size_t n)
+{
+  write_records(its, n, true);
+}
+
+bool packet_ring::try_write_batch(packet const *its, size_t n)
+{
+  return write_records(its, n, false);
+}
+
+
+// ----------------------------------------------------------------------
+
+/*
+  The ring is shared with other processes, so don't trust a record's size: it has to fit in the
+  ring and end at or before commit_pos. Anything else means a writer scribbled on the ring, and
+  there's no way to find the next record boundary, so give up.
+*/
+U32 packet_ring::read_rec_size(U64 pos, U64 end) const
+{
+  uint8_t const *rec = data + (pos & (capacity - 1));
+  U32 size;
+  memcpy(&size, rec, sizeof(size));
+  if (size > max_size() || pos + ring_rec_size(size) > end) {
+    throw fmt_runtime_error("packet_ring: corrupt record of %lu bytes at %lu (committed to %lu)",
+      (u_long)size, (u_long)pos, (u_long)end);
+  }
+  return size;
+}
+
+bool packet_ring::try_read(packet &it)
+{
+  if (!shared) throw runtime_error("packet_ring: not open");
+  U64 pos = shared->read_pos.load(std::memory_order_relaxed);
+  U64 end = shared->commit_pos.load(std::memory_order_acquire);
+  if (pos >= end) return false;
+
+  uint8_t const *rec = data + (pos & (capacity - 1));
+  U32 size = read_rec_size(pos, end);
+  it.clear();
+  it.add_bytes(rec + PACKET_RING_REC_HDR, size);
+
+  shared->read_pos.store(pos + ring_rec_size(size));
+  if (shared->writers_waiting.load()) {
+    shared->space_seq.fetch_add(1);
+    ring_futex_wake(&shared->space_seq, INT_MAX);
+  }
+  return true;
+}
+
+size_t packet_ring::read_batch(vector< packet > &its, size_t max_n)
+{
+  if (!shared) throw runtime_error("packet_ring: not open");
+  U64 pos = shared->read_pos.load(std::memory_order_relaxed);
+  U64 end = shared->commit_pos.load(std::memory_order_acquire);
+  size_t n = 0;
+  while (pos < end && n < max_n) {
+    uint8_t const *rec = data + (pos & (capacity - 1));
+    U32 size = read_rec_size(pos, end);
+    its.emplace_back(rec + PACKET_RING_REC_HDR, (size_t)size);
+    pos += ring_rec_size(size);
+    n++;
+  }
+  if (n == 0) return 0;
+
+  shared->read_pos.store(pos);
+  if (shared->writers_waiting.load()) {
+    shared->space_seq.fetch_add(1);
+    ring_futex_wake(&shared->space_seq, INT_MAX);
+  }
+  return n;
+}
+
+bool packet_ring::read(packet &it, double timeout)
+{
+  for (int spins = 0; spins < ring_spins(); spins++) {
+    if (try_read(it)) return true;
+    cpu_relax();
+  }
+  double deadline = timeout >= 0.0 ? realtime() + timeout : 0.0;
+  while (true) {
+    U32 seq = shared->data_seq.load();
+    shared->reader_waiting.store(1);
+    if (shared->commit_pos.load() == shared->read_pos.load(std::memory_order_relaxed)) {
+      if (timeout < 0.0) {
+        ring_futex_wait(&shared->data_seq, seq, -1.0);
+      }
+      else {
+        double remaining = deadline - realtime();
+        if (remaining <= 0.0) {
+          shared->reader_waiting.store(0);
+          return false;
+        }
+        ring_futex_wait(&shared->data_seq, seq, remaining);
+      }
+    }
+    shared->reader_waiting.store(0);
+    if (try_read(it)) return true;
+  }
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include "./packetbuf.h"
+
+/*
+  A ring buffer in shared memory for passing packets between processes (or threads) on one host
+  without a syscall per message. Linux only: it's a memfd mapped twice back to back, so a record
+  that runs off the end of the ring continues at the start without any special cases.
+
+  Any number of writers (in any process) can share a ring, but only one reader. Writers claim
+  space with a CAS on reserve_pos, copy the record in, then publish by advancing commit_pos in
+  claim order. A writer that dies between claiming and publishing stalls the ring.
+
+  A record is a U32 size, 4 bytes of padding, then the packet's unread bytes (from rd_pos to
+  wr_pos, so a slice from get_pkt forwards as itself), rounded up to 8.
+
+  The reader (or a writer, when the ring is full) spins briefly and then sleeps on a futex in the
+  shared header, so an idle reader costs nothing and one that's keeping up never makes a syscall.
+  Writers only wake the reader when it's actually asleep.
+
+  Example: {
+    packet_ring ring;
+    ring.create(16*1024*1024);
+    UvProcess child(loop, "./child", {"./child"}, {}, nullptr, nullptr, nullptr, exit_cb, {ring.fd});
+    ring.write(pkt);
+  }
+  and in the child, which gets extra fds starting at 3: {
+    packet_ring ring;
+    ring.attach(3);
+    packet rx;
+    while (ring.read(rx)) { ... }
+  }
+*/
+
+struct packet_ring_shared;
+
+struct packet_ring {
+  packet_ring();
+  ~packet_ring();
+  packet_ring(packet_ring const &) = delete;
+  packet_ring & operator=(packet_ring const &) = delete;
+
+  // Make a new ring. capacity is rounded up to a power of 2, at least a page
+  void create(size_t capacity);
+  // Map a ring made by create in some other process. We take ownership of the fd
+  void attach(int _fd);
+  void close();
+
+  // Block until there's room. Throws runtime_error if it can never fit (see max_size)
+  void write(packet const &it);
+  bool try_write(packet const &it);
+  // All or nothing, with one wakeup for the reader
+  void write_batch(packet const *its, size_t n);
+  bool try_write_batch(packet const *its, size_t n);
+
+  // Wait up to timeout seconds (forever if negative) for a packet. Returns false on timeout.
+  // The readers throw runtime_error if they find a corrupt record
+  bool read(packet &it, double timeout = -1.0);
+  bool try_read(packet &it);
+  // Append up to max_n waiting packets to its, without blocking. Returns the number read
+  size_t read_batch(vector< packet > &its, size_t max_n);
+
+  size_t max_size() const; // Biggest packet that fits
+  size_t used() const; // Bytes of records waiting to be read
+
+  int fd {-1};
+  size_t capacity {0};
+  packet_ring_shared *shared {nullptr};
+  uint8_t *data {nullptr};
+  size_t map_size {0};
+
+private:
+  void map_ring();
+  U32 read_rec_size(U64 pos, U64 end) const;
+  bool write_records(packet const *its, size_t n, bool block);
+};
@@ -1,40 +1,247 @@
 #include "tlbcore/common/std_headers.h"
 #include <sys/stat.h>
+#if !defined(WIN32)
+#  include <sys/mman.h>
+#endif
 #include <mutex>
+#include <thread>
 #include "./jsonio.h"
 #include "./packetbuf.h"
 #include "./packetbuf_types.h"
+#include "./packetbuf_compact.h"
 
-packet_stats packet::stats;
-
-mutex refcnt_mutex;
+/*
+  Per-thread counters. Only the owning thread writes them, so a relaxed load and store is enough
+  and compiles to a plain increment. Other threads only read them, in get_stats.
+*/
+struct packet_thread_stats {
+  packet_thread_stats();
+  ~packet_thread_stats();
+
+  void add_to(packet_stats &tot) const;
+  void clear();
+
+  std::atomic< long long > incref_count {0};
+  std::atomic< long long > decref_count {0};
+  std::atomic< long long > alloc_count {0};
+  std::atomic< long long > free_count {0};
+  std::atomic< long long > cow_count {0};
+  std::atomic< long long > expand_count {0};
+  std::atomic< long long > copy_bytes_count {0};
+  std::atomic< long long > pool_hit_count {0};
+  std::atomic< long long > pool_miss_count {0};
+  std::atomic< long long > pool_overflow_count {0};
+  std::atomic< long long > queue_push_count {0};
+  std::atomic< long long > queue_pop_count {0};
+  std::atomic< long long > queue_drop_count {0};
+  std::atomic< long long > queue_reject_count {0};
+};
+
+static inline void bump(std::atomic< long long > &counter, long long inc = 1)
+{
+  counter.store(counter.load(std::memory_order_relaxed) + inc, std::memory_order_relaxed);
+}
+
+static mutex stats_registry_mutex;
+static set< packet_thread_stats * > *stats_registry; // never freed, so it outlives thread_local destructors
+static packet_stats stats_retired; // from threads that have exited
+
+packet_thread_stats::packet_thread_stats()
+{
+  unique_lock< mutex > lock(stats_registry_mutex);
+  if (!stats_registry) stats_registry = new set< packet_thread_stats * >();
+  stats_registry->insert(this);
+}
+
+packet_thread_stats::~packet_thread_stats()
+{
+  unique_lock< mutex > lock(stats_registry_mutex);
+  add_to(stats_retired);
+  stats_registry->erase(this);
+}
+
+void packet_thread_stats::add_to(packet_stats &tot) const
+{
+  tot.incref_count += incref_count.load(std::memory_order_relaxed);
+  tot.decref_count += decref_count.load(std::memory_order_relaxed);
+  tot.alloc_count += alloc_count.load(std::memory_order_relaxed);
+  tot.free_count += free_count.load(std::memory_order_relaxed);
+  tot.cow_count += cow_count.load(std::memory_order_relaxed);
+  tot.expand_count += expand_count.load(std::memory_order_relaxed);
+  tot.copy_bytes_count += copy_bytes_count.load(std::memory_order_relaxed);
+  tot.pool_hit_count += pool_hit_count.load(std::memory_order_relaxed);
+  tot.pool_miss_count += pool_miss_count.load(std::memory_order_relaxed);
+  tot.pool_overflow_count += pool_overflow_count.load(std::memory_order_relaxed);
+  tot.queue_push_count += queue_push_count.load(std::memory_order_relaxed);
+  tot.queue_pop_count += queue_pop_count.load(std::memory_order_relaxed);
+  tot.queue_drop_count += queue_drop_count.load(std::memory_order_relaxed);
+  tot.queue_reject_count += queue_reject_count.load(std::memory_order_relaxed);
+}
+
+void packet_thread_stats::clear()
+{
+  incref_count.store(0, std::memory_order_relaxed);
+  decref_count.store(0, std::memory_order_relaxed);
+  alloc_count.store(0, std::memory_order_relaxed);
+  free_count.store(0, std::memory_order_relaxed);
+  cow_count.store(0, std::memory_order_relaxed);
+  expand_count.store(0, std::memory_order_relaxed);
+  copy_bytes_count.store(0, std::memory_order_relaxed);
+  pool_hit_count.store(0, std::memory_order_relaxed);
+  pool_miss_count.store(0, std::memory_order_relaxed);
+  pool_overflow_count.store(0, std::memory_order_relaxed);
+  queue_push_count.store(0, std::memory_order_relaxed);
+  queue_pop_count.store(0, std::memory_order_relaxed);
+  queue_drop_count.store(0, std::memory_order_relaxed);
+  queue_reject_count.store(0, std::memory_order_relaxed);
+}
+
+static thread_local packet_thread_stats stats;
 
 // ----------------------------------------------------------------------
 
-packet_contents *packet::alloc_contents(size_t alloc)
+/*
+  Pool of freed packet_contents, per thread, in power-of-2 size classes from 128 bytes to 64 KB
+  (including the header). Bigger ones go straight to malloc. A block freed on a different thread
+  than it was allocated on goes into the freeing thread's pool.
+*/
+static const size_t PACKET_POOL_MIN_BLOCK = 128;
+static const int PACKET_POOL_CLASSES = 10;
+
+static std::atomic< size_t > pool_max_blocks_per_class {1024};
+static std::atomic< size_t > pool_max_bytes_per_thread {16*1024*1024};
+
+struct packet_pool {
+  ~packet_pool();
+
+  packet_contents *free_list[PACKET_POOL_CLASSES] {};
+  size_t count[PACKET_POOL_CLASSES] {};
+  size_t bytes {0};
+};
+
+static thread_local packet_pool pool;
+static thread_local bool pool_dead; // Set once pool is destroyed, for frees during thread exit
+
+packet_pool::~packet_pool()
+{
+  for (int cls = 0; cls < PACKET_POOL_CLASSES; cls++) {
+    while (free_list[cls]) {
+      packet_contents *it = free_list[cls];
+      free_list[cls] = reinterpret_cast< packet_contents * >(it->release_arg);
+      free(it);
+    }
+  }
+  pool_dead = true;
+}
+
+// Returns the size class for a block of total bytes, or -1 if too big to pool
+static inline int pool_class(size_t total)
+{
+  size_t block = PACKET_POOL_MIN_BLOCK;
+  for (int cls = 0; cls < PACKET_POOL_CLASSES; cls++) {
+    if (total <= block) return cls;
+    block *= 2;
+  }
+  return -1;
+}
+
+static inline size_t pool_block_size(int cls)
 {
-  stats.alloc_count++;
+  return PACKET_POOL_MIN_BLOCK << cls;
+}
+
+// Pass 0 to turn pooling off
+void packet::set_pool_limits(size_t max_blocks_per_class, size_t max_bytes_per_thread)
+{
+  pool_max_blocks_per_class = max_blocks_per_class;
+  pool_max_bytes_per_thread = max_bytes_per_thread;
+}
+
+static void free_contents(packet_contents *it)
+{
+  int cls = pool_class(it->alloc + sizeof(packet_contents));
+  if (cls >= 0 && !pool_dead) {
+    size_t block = pool_block_size(cls);
+    if (pool.count[cls] < pool_max_blocks_per_class.load(std::memory_order_relaxed) &&
+        pool.bytes + block <= pool_max_bytes_per_thread.load(std::memory_order_relaxed)) {
+      // The free list is linked through release_arg
+      it->release_arg = pool.free_list[cls];
+      pool.free_list[cls] = it;
+      pool.count[cls]++;
+      pool.bytes += block;
+      return;
+    }
+    bump(stats.pool_overflow_count);
+  }
+  free(it);
+}
 
-  size_t roundup_alloc = ((alloc + sizeof(packet_contents) + 1023) & ~1023) - sizeof(packet_contents);
-  auto contents = reinterpret_cast<packet_contents *>(malloc(sizeof(packet_contents) + roundup_alloc));
-  contents->refcnt = 1;
+packet_contents *packet::alloc_contents(size_t alloc)
+{
+  bump(stats.alloc_count);
+
+  packet_contents *contents = nullptr;
+  size_t roundup_alloc;
+  int cls = pool_class(alloc + sizeof(packet_contents));
+  if (cls >= 0) {
+    roundup_alloc = pool_block_size(cls) - sizeof(packet_contents);
+    if (!pool_dead && pool.free_list[cls]) {
+      contents = pool.free_list[cls];
+      pool.free_list[cls] = reinterpret_cast< packet_contents * >(contents->release_arg);
+      pool.count[cls]--;
+      pool.bytes -= pool_block_size(cls);
+      bump(stats.pool_hit_count);
+    }
+    else {
+      bump(stats.pool_miss_count);
+    }
+  }
+  else {
+    roundup_alloc = ((alloc + sizeof(packet_contents) + 4095) & ~4095) - sizeof(packet_contents);
+  }
+  if (!contents) {
+    contents = reinterpret_cast<packet_contents *>(malloc(sizeof(packet_contents) + roundup_alloc));
+    if (!contents) throw bad_alloc();
+  }
+  new (&contents->refcnt) std::atomic< int >(1);
   contents->alloc = roundup_alloc;
+  contents->data = contents->buf;
+  contents->release = nullptr;
+  contents->release_arg = nullptr;
+  return contents;
+}
+
+packet_contents *packet::alloc_external(uint8_t const *data, size_t size, void (*release)(packet_contents *it), void *release_arg)
+{
+  bump(stats.alloc_count);
+
+  auto contents = reinterpret_cast<packet_contents *>(malloc(sizeof(packet_contents)));
+  new (&contents->refcnt) std::atomic< int >(1);
+  contents->alloc = size;
+  contents->data = const_cast<uint8_t *>(data);
+  contents->release = release;
+  contents->release_arg = release_arg;
   return contents;
 }
 
 void packet::decref(packet_contents *&it)
 {
   if (!it) return;
-  stats.decref_count++;
-
-  int newrefs;
-  {
-    unique_lock< mutex > l1(refcnt_mutex);
-    newrefs = --it->refcnt;
-  }
-  if (newrefs == 0) {
-    stats.free_count++;
-    free(it);
+  bump(stats.decref_count);
+
+  /*
+    Release so our writes to the contents happen before whoever frees it, and acquire
+    so if that's us, we see everyone else's writes.
+  */
+  if (it->refcnt.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    bump(stats.free_count);
+    if (it->release) {
+      it->release(it);
+      free(it);
+    }
+    else {
+      free_contents(it);
+    }
     it = nullptr;
   }
 }
@@ -42,15 +249,14 @@ void packet::decref(packet_contents *&it)
 void packet::decref(packet_annotations *&it)
 {
   if (!it) return;
-  stats.decref_count++;
-
-  int newrefs;
-  {
-    unique_lock< mutex > l1(refcnt_mutex);
-    newrefs = --it->refcnt;
-  }
-  if (newrefs == 0) {
-    stats.free_count++;
+  bump(stats.decref_count);
+
+  /*
+    Release so our writes to the contents happen before whoever frees it, and acquire
+    so if that's us, we see everyone else's writes.
+  */
+  if (it->refcnt.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    bump(stats.free_count);
     delete it;
     it = nullptr;
   }
@@ -58,40 +264,38 @@ void packet::decref(packet_annotations *&it)
 
 void packet::incref(packet_contents *it)
 {
-  {
-    unique_lock< mutex > l1(refcnt_mutex);
-    it->refcnt++;
-  }
-  stats.incref_count++;
+  // We already hold a reference, so nothing needs ordering here
+  it->refcnt.fetch_add(1, std::memory_order_relaxed);
+  bump(stats.incref_count);
 }
 
 void packet::incref(packet_annotations *it)
 {
   if (!it) return;
-  {
-    unique_lock< mutex > l1(refcnt_mutex);
-    it->refcnt++;
-  }
-  stats.incref_count++;
+  // We already hold a reference, so nothing needs ordering here
+  it->refcnt.fetch_add(1, std::memory_order_relaxed);
+  bump(stats.incref_count);
 }
 
 void packet::reserve(size_t new_size)
 {
-  if (new_size > contents->alloc || contents->refcnt > 1) {
+  if (new_size > contents->alloc || contents->refcnt.load(std::memory_order_acquire) > 1 || contents->release) {
     if (new_size > size_t(0x3fffffff)) die("packet::reserve too large (0x%lx)", (u_long)new_size);
     packet_contents *old_contents = contents;
 
     size_t new_alloc = old_contents->alloc;
     if (new_size > new_alloc) {
       new_alloc = max(new_size, new_alloc * 2);
-      stats.expand_count ++;
+      bump(stats.expand_count);
     } else {
-      stats.cow_count ++;
+      bump(stats.cow_count);
     }
     contents = alloc_contents(new_alloc);
 
-    memcpy(contents->buf, old_contents->buf, old_contents->alloc);
-    stats.copy_bytes_count += old_contents->alloc;
+    // Only [0, wr_pos) is meaningful, and can be much less than the allocation
+    size_t copy_size = min(wr_pos, old_contents->alloc);
+    memcpy(contents->data, old_contents->data, copy_size);
+    bump(stats.copy_bytes_count, (long long)copy_size);
 
     decref(old_contents);
   }
@@ -100,20 +304,20 @@ void packet::reserve(size_t new_size)
 // ----------------------------------------------------------------------
 
 packet::packet()
-  :contents(alloc_contents(1000)), annotations(nullptr), rd_pos(0), wr_pos(0)
+  :contents(alloc_contents(64)), annotations(nullptr), rd_pos(0), wr_pos(0)
 {
 }
 
 packet::packet(u_char const *data, size_t size)
   :contents(alloc_contents(size)), annotations(nullptr), rd_pos(0), wr_pos(size)
 {
-  memcpy(contents->buf, data, size);
+  memcpy(contents->data, data, size);
 }
 
 packet::packet(string const &data)
   :contents(alloc_contents(data.size())), annotations(nullptr), rd_pos(0), wr_pos(data.size())
 {
-  memcpy(contents->buf, data.data(), data.size());
+  memcpy(contents->data, data.data(), data.size());
 }
 
 packet::packet(size_t size)
@@ -121,6 +325,15 @@ packet::packet(size_t size)
 {
 }
 
+/*
+  Wrap someone else's memory without copying. release(contents) is called when the last
+  packet referring to it goes away, and can find release_arg in contents->release_arg.
+*/
+packet packet::from_external(uint8_t const *data, size_t size, void (*release)(packet_contents *it), void *release_arg)
+{
+  return packet(alloc_external(data, size, release, release_arg), size, adopt_tag());
+}
+
 packet::packet(const packet &other)
   :contents(other.contents), annotations(other.annotations), rd_pos(other.rd_pos), wr_pos(other.wr_pos)
 {
@@ -145,6 +358,23 @@ packet & packet::operator= (packet const &other)
   return *this;
 }
 
+packet & packet::operator= (packet &&other) noexcept
+{
+  if (this == &other) return *this;
+
+  decref(contents);
+  contents = other.contents;
+  other.contents = nullptr;
+
+  decref(annotations);
+  annotations = other.annotations;
+  other.annotations = nullptr;
+
+  rd_pos = other.rd_pos;
+  wr_pos = other.wr_pos;
+  return *this;
+}
+
 packet::~packet()
 {
   decref(contents);
@@ -170,18 +400,18 @@ size_t packet::size_bits() const { return wr_pos * 8; }
 float packet::size_kbits() const { return wr_pos * (8.0f / 1024.0f); }
 size_t packet::alloc() const { return contents->alloc; }
 
-const u_char *packet::wr_ptr() const { return contents->buf + wr_pos; }
-const u_char *packet::rd_ptr() const { return contents->buf + rd_pos; }
-const u_char *packet::ptr()    const { return contents->buf; }
-const u_char *packet::begin()  const { return contents->buf; }
-const u_char *packet::end()    const { return contents->buf + wr_pos; }
+const u_char *packet::wr_ptr() const { return contents->data + wr_pos; }
+const u_char *packet::rd_ptr() const { return contents->data + rd_pos; }
+const u_char *packet::ptr()    const { return contents->data; }
+const u_char *packet::begin()  const { return contents->data; }
+const u_char *packet::end()    const { return contents->data + wr_pos; }
 u_char packet::operator[] (int index) const { return ptr()[index]; }
 
-u_char *packet::wr_ptr() { return contents->buf + wr_pos; }
-u_char *packet::rd_ptr() { return contents->buf + rd_pos; }
-u_char *packet::ptr()    { return contents->buf; }
-u_char *packet::begin()  { return contents->buf; }
-u_char *packet::end()    { return contents->buf + wr_pos; }
+u_char *packet::wr_ptr() { return contents->data + wr_pos; }
+u_char *packet::rd_ptr() { return contents->data + rd_pos; }
+u_char *packet::ptr()    { return contents->data; }
+u_char *packet::begin()  { return contents->data; }
+u_char *packet::end()    { return contents->data + wr_pos; }
 u_char & packet::operator[] (int index) { return ptr()[index]; }
 
 bool operator ==(packet const &a, packet const &b)
@@ -258,14 +488,51 @@ int packet::to_file(FILE *fp) const
   return nw;
 }
 
+#if !defined(WIN32)
+/*
+  Write all of iov, in batches of IOV_MAX, picking up where it left off after a short write.
+  Modifies iov. Returns the number of bytes written, or -1 with errno set.
+*/
+static ssize_t writev_all(int fd, struct iovec *iov, size_t iovcnt)
+{
+  ssize_t total = 0;
+  while (iovcnt > 0) {
+    if (iov->iov_len == 0) {
+      iov++;
+      iovcnt--;
+      continue;
+    }
+    ssize_t nw = writev(fd, iov, (int)min(iovcnt, size_t(IOV_MAX)));
+    if (nw < 0 && errno == EINTR) continue;
+    if (nw < 0) return -1;
+    total += nw;
+    size_t done = (size_t)nw;
+    while (iovcnt > 0 && done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (done > 0) {
+      iov->iov_base = reinterpret_cast< char * >(iov->iov_base) + done;
+      iov->iov_len -= done;
+    }
+  }
+  return total;
+}
+#endif
+
 void packet::to_file_boxed(int fd) const
 {
 #if !defined(WIN32)
   int todo = size();
-  int nw_todo = write(fd, &todo, sizeof(todo));
-  int nw_ptr = write(fd, ptr(), todo);
-  if (nw_todo < 0 || nw_ptr < 0) diee("to_file_boxed: write");
-  if (nw_ptr != todo) die("to_file_boxed: short write");
+  struct iovec iov[2];
+  iov[0].iov_base = &todo;
+  iov[0].iov_len = sizeof(todo);
+  iov[1].iov_base = const_cast< uint8_t * >(ptr());
+  iov[1].iov_len = (size_t)todo;
+  ssize_t nw = writev_all(fd, iov, 2);
+  if (nw < 0) diee("to_file_boxed: write");
+  if (nw != (ssize_t)(sizeof(todo) + todo)) die("to_file_boxed: short write");
 #else
   die("WRITEME: packet::to_file_boxed");
 #endif
@@ -333,6 +600,19 @@ ssize_t packet::add_read(FILE *fp, size_t readsize)
 void packet::add_file_contents(int fd)
 {
 #if !defined(WIN32)
+  if (rd_pos == 0 && wr_pos == 0) {
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos == 0) {
+      auto mapped = map_contents(fd);
+      if (mapped) {
+        decref(contents);
+        contents = mapped;
+        wr_pos = mapped->alloc;
+        lseek(fd, 0, SEEK_END);
+        return;
+      }
+    }
+  }
   while (1) {
     int nr = add_read(fd, 65536);
     if (nr < 0) diee("packet::from_file");
@@ -355,7 +635,7 @@ void packet::add_file_contents(FILE *fp)
 void packet::add_bytes(const u_char *data, size_t size)
 {
   reserve(wr_pos + size);
-  memcpy(contents->buf + wr_pos, data, size);
+  memcpy(contents->data + wr_pos, data, size);
   wr_pos += size;
 }
 
@@ -446,11 +726,11 @@ void packet::dump(FILE *fp) const
     fprintf(fp, "%04x: ", i);
     int todo = min(16, (int)(wr_pos - i));
     for (int j=i; j<i+todo; j++) {
-      fprintf(fp, " %02x", (int)(u_char)contents->buf[j]);
+      fprintf(fp, " %02x", (int)(u_char)contents->data[j]);
     }
     fprintf(fp,"   ");
     for (int j=i; j<i+todo; j++) {
-      fprintf(fp, "%s", charname_hex((u_char)contents->buf[j]));
+      fprintf(fp, "%s", charname_hex((u_char)contents->data[j]));
     }
     fprintf(fp,"\n");
     i += todo;
@@ -473,7 +753,7 @@ void packet::get_skip(int n)
 bool packet::get_test(u_char *data, size_t size)
 {
   if ((int)rd_pos + (int)size <= (int)wr_pos) {
-    memcpy(data, contents->buf + rd_pos, size);
+    memcpy(data, contents->data + rd_pos, size);
     rd_pos+=size;
     return true;
   }
@@ -515,6 +795,25 @@ packet packet::get_pkt()
   return ret;
 }
 
+packet_view packet::view() const
+{
+  return packet_view(*this);
+}
+
+packet_view packet::get_view()
+{
+  u_int len;
+  get(len);
+
+  if ((ssize_t)len > remaining()) {
+    throw packet_rd_overrun_err(len - remaining());
+  }
+  packet_view ret(*this);
+  ret.p.wr_pos = ret.p.rd_pos + len;
+  get_skip(len);
+  return ret;
+}
+
 u_int packet::get_be_uint32()
 {
   u_char buf[4];
@@ -575,24 +874,151 @@ string packet::get_nl_string()
 {
   string ret;
   while (rd_pos < wr_pos) {
-    u_char c = contents->buf[rd_pos++];
+    u_char c = contents->data[rd_pos++];
     if (c == '\n') break;
     ret.push_back(c);
   }
   return ret;
 }
 
+
+// ----------------------------------------------------------------------
+
+static thread_local packet_typetag_dict *cur_typetags;
+
+static const u_char TYPETAG_DEF = 0xfe;
+static const u_char TYPETAG_REF = 0xff;
+
+packet_typetag_scope::packet_typetag_scope(packet_typetag_dict *dict)
+  :saved(cur_typetags)
+{
+  cur_typetags = dict;
+}
+
+packet_typetag_scope::~packet_typetag_scope()
+{
+  cur_typetags = saved;
+}
+
+void packet_typetag_dict::clear()
+{
+  wr_by_ptr.clear();
+  wr_by_name.clear();
+  rd_names.clear();
+  rd_matched.clear();
+}
+
+/*
+  Tags must outlive the dictionary, or a new tag at the same address would get the old one's id.
+  They're always string literals in practice.
+ */
+U32 packet_typetag_dict::wr_id(char const *tag, bool &is_new)
+{
+  auto ptr_it = wr_by_ptr.find(tag);
+  if (ptr_it != wr_by_ptr.end()) {
+    is_new = false;
+    return ptr_it->second;
+  }
+  auto ins = wr_by_name.emplace(string(tag), (U32)wr_by_name.size());
+  is_new = ins.second;
+  wr_by_ptr[tag] = ins.first->second;
+  return ins.first->second;
+}
+
+void packet_typetag_dict::define(U32 id, string const &tag)
+{
+  if (id > rd_names.size()) throw runtime_error("packet_typetag_dict::define: id out of sequence");
+  if (id == rd_names.size()) {
+    rd_names.emplace_back();
+    rd_matched.push_back(nullptr);
+  }
+  // We see the same definition again if test_typetag rewinds over it
+  if (rd_names[id] != tag) {
+    rd_names[id] = tag;
+    rd_matched[id] = nullptr;
+  }
+}
+
+bool packet_typetag_dict::rd_match(U32 id, char const *expected)
+{
+  if (id >= rd_names.size()) return false;
+  if (rd_matched[id] == expected) return true;
+  if (rd_names[id].empty() || rd_names[id] != expected) return false;
+  rd_matched[id] = expected;
+  return true;
+}
+
+string const &packet_typetag_dict::name(U32 id) const
+{
+  static const string undefined("(undefined typetag id)");
+  if (id >= rd_names.size() || rd_names[id].empty()) return undefined;
+  return rd_names[id];
+}
+
 void packet::add_typetag(char const *tag)
 {
   size_t size = strlen(tag);
-  if (!(size < 255)) {
+  if (!(size < TYPETAG_DEF)) {
     die("add_typetag: tag too long (len=%d)\n", (int)size);
     return;
   }
+  if (auto dict = cur_typetags) {
+    bool is_new = false;
+    U32 id = dict->wr_id(tag, is_new);
+    if (is_new) {
+      add(TYPETAG_DEF);
+      packet_wr_varint(*this, id);
+      add((u_char)size);
+      add_bytes(tag, size);
+    } else {
+      add(TYPETAG_REF);
+      packet_wr_varint(*this, id);
+    }
+    return;
+  }
   add((u_char)size);
   add_bytes(tag, size);
 }
 
+/*
+  Read a type tag and compare it with expected. If it doesn't match, set got to what we found
+  for the error message.
+ */
+static bool rd_typetag(packet &p, char const *expected, string &got)
+{
+  auto size = static_cast< size_t >(p.fget< u_char >());
+  if (size < TYPETAG_DEF) {
+    char buf[256];
+    p.get_bytes(buf, size);
+    buf[size] = 0;
+    if (strcmp(expected, buf) == 0) return true;
+    got = buf;
+    return false;
+  }
+  auto dict = cur_typetags;
+  if (!dict) {
+    throw packet_rd_type_err(expected, "(typetag id with no packet_typetag_scope)");
+  }
+  U64 id = packet_rd_varint(p);
+  /*
+    The writer hands out ids in order, so a definition is for the next id (or one we've seen,
+    if test_typetag rewound over it) and a reference is to one already defined. Anything else
+    is a corrupt or hostile packet, and mustn't get to size rd_names.
+  */
+  if (size == TYPETAG_DEF ? id > dict->rd_names.size() : id >= dict->rd_names.size()) {
+    throw packet_rd_type_err(expected, "(typetag id out of sequence)");
+  }
+  if (size == TYPETAG_DEF) {
+    auto len = static_cast< size_t >(p.fget< u_char >());
+    char buf[256];
+    p.get_bytes(buf, len);
+    dict->define((U32)id, string(buf, len));
+  }
+  if (dict->rd_match((U32)id, expected)) return true;
+  got = dict->name((U32)id);
+  return false;
+}
+
 /*
   Check for a given type tag. Consume the tag if matched, else rewind.
   There must be a proper type tag, though, or an exception will be thrown.
@@ -600,11 +1026,8 @@ void packet::add_typetag(char const *tag)
 bool packet::test_typetag(char const *expected)
 {
   int save_rd_pos = rd_pos;
-  auto size = static_cast< size_t >(fget< u_char >());
-  char got[256];
-  get_bytes(got, size);
-  got[size] = 0;
-  if (strcmp(expected, got) != 0) {
+  string got;
+  if (!rd_typetag(*this, expected, got)) {
     rd_pos = save_rd_pos;
     return false;
   }
@@ -613,11 +1036,8 @@ bool packet::test_typetag(char const *expected)
 
 void packet::check_typetag(char const *expected)
 {
-  auto size = static_cast< size_t >(fget< u_char >());
-  char got[256];
-  get_bytes(got, size);
-  got[size] = 0;
-  if (strcmp(expected, got) != 0) {
+  string got;
+  if (!rd_typetag(*this, expected, got)) {
     throw packet_rd_type_err(expected, got); // takes a copy of both strings
   }
 }
@@ -651,6 +1071,36 @@ packet packet::from_file_boxed(int fd)
   return ret;
 }
 
+static void release_munmap(packet_contents *it)
+{
+  munmap(it->data, it->alloc);
+}
+
+/*
+  Map a whole regular file read-only, if it's big enough to be worth it. Returns nullptr if
+  not, or if mmap fails, and the caller should read it instead.
+  The pages come from the page cache, so opening a big log costs nothing up front and
+  several processes reading the same file share the memory. As with any mmap, if someone
+  truncates the file while it's mapped, reading the missing part gets SIGBUS.
+*/
+packet_contents *packet::map_contents(int fd)
+{
+  struct stat st {};
+  if (fstat(fd, &st) < 0) return nullptr;
+  if (!S_ISREG(st.st_mode) || st.st_size < (off_t)mmap_threshold) return nullptr;
+
+  size_t size = (size_t)st.st_size;
+  void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapped == MAP_FAILED) {
+    if (0) eprintf("packet::map_contents: mmap: %s\n", strerror(errno));
+    return nullptr;
+  }
+#if defined(MADV_SEQUENTIAL)
+  madvise(mapped, size, MADV_SEQUENTIAL);
+#endif
+  return alloc_external(reinterpret_cast< uint8_t const * >(mapped), size, release_munmap, nullptr);
+}
+
 packet packet::read_from_fd(int fd)
 {
   struct stat st {};
@@ -658,6 +1108,12 @@ packet packet::read_from_fd(int fd)
     return packet(0);
   }
 
+  auto mapped = map_contents(fd);
+  if (mapped) {
+    close(fd);
+    return packet(mapped, mapped->alloc, adopt_tag());
+  }
+
   packet ret(st.st_size + 8192);
   ret.add_file_contents(fd);
   close(fd);
@@ -671,16 +1127,403 @@ packet packet::read_from_file(char const *fn)
     eprintf("Can't open %s: %s\n", fn, strerror(errno));
     return packet(0);
   }
-  packet ret = read_from_fd(fd);
-  close(fd);
+  return read_from_fd(fd); // closes fd
+}
+#endif
+
+// ----------------------------------------------------------------------
+
+size_t packet_chain::size() const
+{
+  return closed_size + (tail_open ? segs.back().remaining() : 0);
+}
+
+void packet_chain::clear()
+{
+  segs.clear();
+  closed_size = 0;
+  tail_open = false;
+}
+
+packet &packet_chain::tail()
+{
+  if (!tail_open) {
+    segs.emplace_back();
+    tail_open = true;
+  }
+  return segs.back();
+}
+
+void packet_chain::close_tail()
+{
+  if (tail_open) {
+    closed_size += segs.back().remaining();
+    tail_open = false;
+  }
+}
+
+void packet_chain::add_bytes(char const *data, size_t size)
+{
+  tail().add_bytes(data, size);
+}
+
+void packet_chain::add_bytes(uint8_t const *data, size_t size)
+{
+  tail().add_bytes(data, size);
+}
+
+void packet_chain::add_ref(packet const &wr)
+{
+  auto wr_size = wr.remaining();
+  if (wr_size <= 0) return;
+  close_tail();
+  segs.push_back(wr);
+  closed_size += (size_t)wr_size;
+}
+
+void packet_chain::add_pkt(packet const &wr)
+{
+  add(static_cast< u_int >(wr.remaining()));
+  if ((size_t)wr.remaining() < copy_threshold) {
+    add_bytes(wr.rd_ptr(), wr.remaining());
+  } else {
+    add_ref(wr);
+  }
+}
+
+void packet_chain::add_chain(packet_chain const &other)
+{
+  // By index, so chain.add_chain(chain) works
+  size_t n = other.segs.size();
+  for (size_t i = 0; i < n; i++) {
+    add_ref(other.segs[i]);
+  }
+}
+
+void packet_chain::add_external(uint8_t const *data, size_t size, void (*release)(packet_contents *it), void *release_arg)
+{
+  add_ref(packet::from_external(data, size, release, release_arg));
+}
+
+packet packet_chain::flatten() const
+{
+  packet ret(size());
+  for (auto &it : segs) {
+    ret.add_bytes(it.rd_ptr(), it.remaining());
+  }
   return ret;
 }
+
+#if !defined(WIN32)
+void packet_chain::fill_iovec(vector< struct iovec > &iov) const
+{
+  iov.reserve(iov.size() + segs.size());
+  for (auto &it : segs) {
+    if (it.remaining() <= 0) continue;
+    struct iovec v;
+    v.iov_base = const_cast< uint8_t * >(it.rd_ptr());
+    v.iov_len = (size_t)it.remaining();
+    iov.push_back(v);
+  }
+}
+
+ssize_t packet_chain::to_file(int fd) const
+{
+  vector< struct iovec > iov;
+  fill_iovec(iov);
+  return writev_all(fd, iov.data(), iov.size());
+}
+
+void packet_chain::to_file_boxed(int fd) const
+{
+  int todo = size();
+  vector< struct iovec > iov;
+  iov.reserve(segs.size() + 1);
+  iov.push_back(iovec { &todo, sizeof(todo) });
+  fill_iovec(iov);
+  ssize_t nw = writev_all(fd, iov.data(), iov.size());
+  if (nw < 0) diee("packet_chain::to_file_boxed: write");
+  if (nw != (ssize_t)(sizeof(todo) + todo)) die("packet_chain::to_file_boxed: short write");
+}
 #endif
 
+
+// ----------------------------------------------------------------------
+
+// Spinning before sleeping only helps if there's another core for the other side to run on
+static int queue_spins()
+{
+  static int ret = thread::hardware_concurrency() > 1 ? 100 : 0;
+  return ret;
+}
+
+packet_mpmc_queue::packet_mpmc_queue(size_t _capacity, packet_queue_overflow _overflow)
+  :overflow(_overflow),
+   enq_pos(0),
+   deq_pos(0),
+   closed(false),
+   push_waiters(0),
+   pop_waiters(0)
+{
+  size_t cap = 2;
+  while (cap < _capacity) cap *= 2;
+  mask = cap - 1;
+  cells = new cell[cap];
+  for (size_t i = 0; i < cap; i++) {
+    cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+}
+
+packet_mpmc_queue::~packet_mpmc_queue()
+{
+  packet tmp;
+  while (dequeue(tmp)) {
+    bump(stats.queue_drop_count);
+  }
+  delete[] cells;
+}
+
+/*
+  A cell is free for the push at pos when its seq == pos, and full for the pop at pos when its
+  seq == pos + 1. The pop sets it to pos + capacity, which is when the next lap's push can use it.
+ */
+bool packet_mpmc_queue::enqueue(packet &it)
+{
+  size_t pos = enq_pos.load(std::memory_order_relaxed);
+  cell *c;
+  while (true) {
+    c = &cells[pos & mask];
+    size_t seq = c->seq.load(std::memory_order_acquire);
+    auto diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+    if (diff == 0) {
+      if (enq_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    }
+    else if (diff < 0) {
+      return false; // full
+    }
+    else {
+      pos = enq_pos.load(std::memory_order_relaxed);
+    }
+  }
+  new (c->storage) packet(std::move(it));
+  c->seq.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool packet_mpmc_queue::dequeue(packet &it)
+{
+  size_t pos = deq_pos.load(std::memory_order_relaxed);
+  cell *c;
+  while (true) {
+    c = &cells[pos & mask];
+    size_t seq = c->seq.load(std::memory_order_acquire);
+    auto diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+    if (diff == 0) {
+      if (deq_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    }
+    else if (diff < 0) {
+      return false; // empty
+    }
+    else {
+      pos = deq_pos.load(std::memory_order_relaxed);
+    }
+  }
+  auto p = reinterpret_cast< packet * >(c->storage);
+  it = std::move(*p);
+  p->~packet();
+  c->seq.store(pos + mask + 1, std::memory_order_release);
+  return true;
+}
+
+/*
+  Waiters bump the count and then look again with the mutex held, so taking the mutex here before
+  notifying means they either see our packet or are already waiting.
+ */
+void packet_mpmc_queue::wake_poppers(bool all)
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (pop_waiters.load(std::memory_order_relaxed) > 0) {
+    unique_lock< mutex > lock(wait_mutex);
+    if (all) {
+      not_empty.notify_all();
+    } else {
+      not_empty.notify_one();
+    }
+  }
+}
+
+/*
+  Don't wake pushers until a quarter of the queue is free. Otherwise a consumer draining a full
+  queue takes the mutex on every pop, and the pushers wake up to add one packet each.
+ */
+void packet_mpmc_queue::wake_pushers()
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (push_waiters.load(std::memory_order_relaxed) > 0 && depth() <= capacity() - capacity() / 4) {
+    unique_lock< mutex > lock(wait_mutex);
+    not_full.notify_all();
+  }
+}
+
+bool packet_mpmc_queue::try_push(packet &&it)
+{
+  if (is_closed() || !enqueue(it)) {
+    bump(stats.queue_reject_count);
+    return false;
+  }
+  bump(stats.queue_push_count);
+  wake_poppers(false);
+  return true;
+}
+
+bool packet_mpmc_queue::push(packet &&it)
+{
+  if (overflow == PACKET_QUEUE_REJECT) return try_push(std::move(it));
+  if (is_closed()) {
+    bump(stats.queue_reject_count);
+    return false;
+  }
+  if (enqueue(it)) {
+    bump(stats.queue_push_count);
+    wake_poppers(false);
+    return true;
+  }
+
+  if (overflow == PACKET_QUEUE_DROP_OLDEST) {
+    packet old;
+    while (!enqueue(it)) {
+      if (dequeue(old)) bump(stats.queue_drop_count);
+    }
+  }
+  else {
+    bool queued = false;
+    for (int spins = 0; spins < queue_spins() && !queued; spins++) {
+      queued = enqueue(it);
+    }
+    if (!queued) {
+      unique_lock< mutex > lock(wait_mutex);
+      push_waiters.fetch_add(1);
+      while (!(queued = enqueue(it)) && !is_closed()) {
+        not_full.wait(lock);
+      }
+      push_waiters.fetch_sub(1);
+    }
+    if (!queued) {
+      bump(stats.queue_reject_count);
+      return false;
+    }
+  }
+  bump(stats.queue_push_count);
+  wake_poppers(false);
+  return true;
+}
+
+size_t packet_mpmc_queue::push_batch(packet *its, size_t n)
+{
+  size_t ret = 0;
+  size_t woken = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (!is_closed() && enqueue(its[i])) {
+      bump(stats.queue_push_count);
+      ret++;
+      continue;
+    }
+    if (overflow == PACKET_QUEUE_REJECT || is_closed()) {
+      bump(stats.queue_reject_count);
+      break;
+    }
+    // Full. Let consumers at what we've queued so far before we wait or drop
+    if (ret > woken) wake_poppers(true);
+    if (!push(std::move(its[i]))) break;
+    ret++;
+    woken = ret;
+  }
+  if (ret > woken) wake_poppers(true);
+  return ret;
+}
+
+bool packet_mpmc_queue::try_pop(packet &it)
+{
+  if (!dequeue(it)) return false;
+  bump(stats.queue_pop_count);
+  wake_pushers();
+  return true;
+}
+
+bool packet_mpmc_queue::pop(packet &it, double timeout)
+{
+  for (int spins = 0; spins <= queue_spins(); spins++) {
+    if (try_pop(it)) return true;
+  }
+  if (timeout == 0.0) return false;
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::duration< double >(max(0.0, timeout));
+  bool found = false;
+  {
+    unique_lock< mutex > lock(wait_mutex);
+    pop_waiters.fetch_add(1);
+    while (!(found = dequeue(it)) && !is_closed()) {
+      if (timeout < 0.0) {
+        not_empty.wait(lock);
+      }
+      else if (not_empty.wait_until(lock, deadline) == std::cv_status::timeout) {
+        found = dequeue(it);
+        break;
+      }
+    }
+    pop_waiters.fetch_sub(1);
+  }
+  if (!found) return false;
+  bump(stats.queue_pop_count);
+  wake_pushers();
+  return true;
+}
+
+size_t packet_mpmc_queue::pop_batch(vector< packet > &its, size_t max_n)
+{
+  size_t ret = 0;
+  packet tmp;
+  while (ret < max_n && dequeue(tmp)) {
+    its.push_back(std::move(tmp));
+    ret++;
+  }
+  if (ret > 0) {
+    bump(stats.queue_pop_count, ret);
+    wake_pushers();
+  }
+  return ret;
+}
+
+void packet_mpmc_queue::close()
+{
+  closed.store(true, std::memory_order_release);
+  unique_lock< mutex > lock(wait_mutex);
+  not_empty.notify_all();
+  not_full.notify_all();
+}
+
+size_t packet_mpmc_queue::depth() const
+{
+  size_t enq = enq_pos.load(std::memory_order_acquire);
+  size_t deq = deq_pos.load(std::memory_order_acquire);
+  return enq > deq ? enq - deq : 0;
+}
+
 // ----------------------------------------------------------------------
 
+packet_stats packet::get_stats()
+{
+  unique_lock< mutex > lock(stats_registry_mutex);
+  packet_stats ret = stats_retired;
+  if (stats_registry) {
+    for (auto it : *stats_registry) it->add_to(ret);
+  }
+  return ret;
+}
+
 string packet::stats_str()
 {
+  auto stats = get_stats();
   ostringstream s;
   s << "incref_count=" << stats.incref_count << "\n";
   s << "decref_count=" << stats.decref_count << "\n";
@@ -689,12 +1532,25 @@ string packet::stats_str()
   s << "cow_count=" << stats.cow_count << "\n";
   s << "expand_count=" << stats.expand_count << "\n";
   s << "copy_bytes_count=" << stats.copy_bytes_count << "\n";
+  s << "pool_hit_count=" << stats.pool_hit_count << "\n";
+  s << "pool_miss_count=" << stats.pool_miss_count << "\n";
+  s << "pool_overflow_count=" << stats.pool_overflow_count << "\n";
+  s << "queue_push_count=" << stats.queue_push_count << "\n";
+  s << "queue_pop_count=" << stats.queue_pop_count << "\n";
+  s << "queue_drop_count=" << stats.queue_drop_count << "\n";
+  s << "queue_reject_count=" << stats.queue_reject_count << "\n";
+  s << "queue_depth=" << (stats.queue_push_count - stats.queue_pop_count - stats.queue_drop_count) << "\n";
   return s.str();
 }
 
+// Counts from other threads running at the same time may survive
 void packet::clear_stats()
 {
-  memset(&stats, 0, sizeof(stats));
+  unique_lock< mutex > lock(stats_registry_mutex);
+  memset(&stats_retired, 0, sizeof(stats_retired));
+  if (stats_registry) {
+    for (auto it : *stats_registry) it->clear();
+  }
 }
 
 
@@ -837,6 +1693,41 @@ void packet_rd_value(packet &p, arma::cx_double &x) {
 
 // ----------------------------------------------------------------------
 
+// For run_test(6): a telemetry record with 50 fixed-size fields
+struct packet_test_telemetry {
+  double a[20];
+  float b[20];
+  U32 c[6];
+  S16 d[4];
+};
+
+template<>
+struct packet_fixed_size< packet_test_telemetry > : integral_constant< size_t, 20*8 + 20*4 + 6*4 + 4*2 > {};
+
+static void packet_rd_fixed(packet_rd_unchecked &r, packet_test_telemetry &x)
+{
+  for (auto &it : x.a) r.get(it);
+  for (auto &it : x.b) r.get(it);
+  for (auto &it : x.c) r.get(it);
+  for (auto &it : x.d) r.get(it);
+}
+
+static void packet_wr_fixed(packet_wr_unchecked &w, packet_test_telemetry const &x)
+{
+  for (auto &it : x.a) w.add(it);
+  for (auto &it : x.b) w.add(it);
+  for (auto &it : x.c) w.add(it);
+  for (auto &it : x.d) w.add(it);
+}
+
+static void packet_rd_checked_fields(packet &p, packet_test_telemetry &x)
+{
+  for (auto &it : x.a) p.get(it);
+  for (auto &it : x.b) p.get(it);
+  for (auto &it : x.c) p.get(it);
+  for (auto &it : x.d) p.get(it);
+}
+
 string packet::run_test(int testid)
 {
   clear_stats();
@@ -848,6 +1739,247 @@ string packet::run_test(int testid)
     packet wr2 = wr;
     return packet::stats_str();
   }
+  else if (testid==1) {
+    /*
+      Copy and destroy one packet from many threads at once, which is what fan-out to several
+      consumers does. This is all refcount traffic on one cache line.
+    */
+    packet shared;
+    shared.add(17);
+    size_t nThreads = max(2U, thread::hardware_concurrency());
+    const int iters = 1000000;
+    vector< thread > threads;
+    double t0 = realtime();
+    for (size_t ti = 0; ti < nThreads; ti++) {
+      threads.emplace_back([&shared, iters]() {
+        for (int i = 0; i < iters; i++) {
+          packet copy = shared;
+          packet copy2 = copy;
+        }
+      });
+    }
+    for (auto &it : threads) it.join();
+    double t1 = realtime();
+    double ops = 2.0 * iters * nThreads;
+    return packet::stats_str() + stringprintf("threads=%zu copy_destroy_per_sec=%0.3g ns_per_copy_destroy=%0.3g\n",
+      nThreads, ops / (t1 - t0), (t1 - t0) * 1e9 / ops);
+  }
+  else if (testid==2) {
+    // Packet-per-sample telemetry: lots of small, short-lived packets
+    const int iters = 10000000;
+    double t0 = realtime();
+    for (int i = 0; i < iters; i++) {
+      packet wr;
+      wr.add((double)i);
+    }
+    double t1 = realtime();
+    return packet::stats_str() + stringprintf("alloc_free_per_sec=%0.3g ns_per_alloc_free=%0.3g\n",
+      iters / (t1 - t0), (t1 - t0) * 1e9 / iters);
+  }
+  else if (testid==3) {
+    // Big arma::vec round trip, which should run at memcpy speed
+    arma::vec orig(1000000);
+    for (size_t i = 0; i < orig.n_elem; i++) orig[i] = (double)i;
+    const int iters = 20;
+    double t0 = realtime();
+    for (int i = 0; i < iters; i++) {
+      packet wr;
+      wr.add(orig);
+      arma::vec back;
+      wr.get(back);
+      if (back.n_elem != orig.n_elem || back[orig.n_elem-1] != orig[orig.n_elem-1]) throw runtime_error("Mismatch");
+    }
+    double t1 = realtime();
+    double bytes = 2.0 * iters * orig.n_elem * sizeof(double);
+    return packet::stats_str() + stringprintf("vec_bytes_per_sec=%0.3g\n", bytes / (t1 - t0));
+  }
+  else if (testid==4) {
+    // Compact encoding of small unsorted and sorted vector<U32>s: size and decode speed
+    vector< U32 > small(1000000), sorted(1000000);
+    U32 acc = 0;
+    for (size_t i = 0; i < small.size(); i++) {
+      small[i] = (U32)(i * 2654435761U) >> (i % 3 == 0 ? 16 : 24);
+      acc += small[i] & 0xff;
+      sorted[i] = acc;
+    }
+    packet plain, comp_small, comp_sorted;
+    plain.add(small);
+    comp_small.add_compact(small);
+    comp_sorted.add_compact(sorted);
+    const int iters = 20;
+    double t0 = realtime();
+    for (int i = 0; i < iters; i++) {
+      vector< U32 > back;
+      comp_small.rewind();
+      comp_small.get_compact(back);
+      if (back != small) throw runtime_error("Mismatch");
+    }
+    double t1 = realtime();
+    return stringprintf("plain_bytes=%zu\ncompact_bytes=%zu\ncompact_sorted_bytes=%zu\ncompact_values_per_sec=%0.3g\n",
+      plain.size(), comp_small.size(), comp_sorted.size(), (double)iters * small.size() / (t1 - t0));
+  }
+  else if (testid==5) {
+    // Decode 100000 small nested messages with get_pkt and with get_view
+    packet wr;
+    const int n_msgs = 100000;
+    for (int i = 0; i < n_msgs; i++) {
+      packet inner;
+      inner.add((U32)i);
+      inner.add(1.5);
+      wr.add_pkt(inner);
+    }
+    double t0 = realtime();
+    double sum_pkt = 0.0;
+    for (int i = 0; i < n_msgs; i++) {
+      packet inner = wr.get_pkt();
+      sum_pkt += inner.fget< U32 >() + inner.fget< double >();
+    }
+    double t1 = realtime();
+    auto stats_pkt = get_stats();
+    clear_stats();
+    wr.rewind();
+    double t2 = realtime();
+    double sum_view = 0.0;
+    for (int i = 0; i < n_msgs; i++) {
+      packet_view inner = wr.get_view();
+      sum_view += inner.fget< U32 >() + inner.fget< double >();
+    }
+    double t3 = realtime();
+    auto stats_view = get_stats();
+    if (sum_pkt != sum_view) throw runtime_error("Mismatch");
+    return stringprintf("get_pkt_ns=%0.3g\nget_pkt_incref_count=%lld\nget_view_ns=%0.3g\nget_view_incref_count=%lld\n",
+      (t1 - t0) / n_msgs * 1e9, stats_pkt.incref_count, (t3 - t2) / n_msgs * 1e9, stats_view.incref_count);
+  }
+  else if (testid==6) {
+    // Decode 100000 telemetry records a field at a time, checked and with get_fixed
+    const int n_recs = 100000;
+    packet_test_telemetry rec {};
+    for (int i = 0; i < 20; i++) rec.a[i] = i * 0.5;
+    for (int i = 0; i < 6; i++) rec.c[i] = i;
+    packet wr;
+    for (int i = 0; i < n_recs; i++) {
+      rec.c[0] = i;
+      wr.add_fixed(rec);
+    }
+    double t0 = realtime();
+    U64 sum_checked = 0;
+    for (int i = 0; i < n_recs; i++) {
+      packet_rd_checked_fields(wr, rec);
+      sum_checked += rec.c[0];
+    }
+    double t1 = realtime();
+    wr.rewind();
+    U64 sum_fixed = 0;
+    for (int i = 0; i < n_recs; i++) {
+      wr.get_fixed(rec);
+      sum_fixed += rec.c[0];
+    }
+    double t2 = realtime();
+    if (sum_checked != sum_fixed) throw runtime_error("Mismatch");
+    return stringprintf("checked_ns_per_rec=%0.3g\nfixed_ns_per_rec=%0.3g\n",
+      (t1 - t0) / n_recs * 1e9, (t2 - t1) / n_recs * 1e9);
+  }
+  else if (testid==7) {
+    // A stream of small checked messages, with plain typetags and with a packet_typetag_dict
+    const int n_msgs = 100000;
+    packet_typetag_dict tx, rx;
+    packet plain, interned;
+    for (int i = 0; i < n_msgs; i++) {
+      plain.add_checked((U32)i);
+      plain.add_checked((double)i);
+      plain.add_checked(string("ok"));
+    }
+    {
+      packet_typetag_scope scope(&tx);
+      for (int i = 0; i < n_msgs; i++) {
+        interned.add_checked((U32)i);
+        interned.add_checked((double)i);
+        interned.add_checked(string("ok"));
+      }
+    }
+    U32 u;
+    double d;
+    string s;
+    double t0 = realtime();
+    U64 sum_plain = 0;
+    for (int i = 0; i < n_msgs; i++) {
+      plain.get_checked(u);
+      plain.get_checked(d);
+      plain.get_checked(s);
+      sum_plain += u;
+    }
+    double t1 = realtime();
+    U64 sum_interned = 0;
+    {
+      packet_typetag_scope scope(&rx);
+      for (int i = 0; i < n_msgs; i++) {
+        interned.get_checked(u);
+        interned.get_checked(d);
+        interned.get_checked(s);
+        sum_interned += u;
+      }
+    }
+    double t2 = realtime();
+    if (sum_plain != sum_interned) throw runtime_error("Mismatch");
+    return stringprintf("plain_bytes_per_msg=%0.3g\ninterned_bytes_per_msg=%0.3g\nplain_ns_per_msg=%0.3g\ninterned_ns_per_msg=%0.3g\n",
+      (double)plain.size() / n_msgs, (double)interned.size() / n_msgs,
+      (t1 - t0) / n_msgs * 1e9, (t2 - t1) / n_msgs * 1e9);
+  }
+  else if (testid==9) {
+    // Sensor fan-in: 4 producer threads into one consumer, through a mutex+deque and through packet_mpmc_queue
+    const int n_producers = 4;
+    const int per_producer = 200000;
+    const int total = n_producers * per_producer;
+
+    mutex dq_mutex;
+    condition_variable dq_cv;
+    packet_queue dq;
+    vector< thread > producers;
+    double t0 = realtime();
+    for (int pi = 0; pi < n_producers; pi++) {
+      producers.emplace_back([&dq_mutex, &dq_cv, &dq, per_producer]() {
+        for (int i = 0; i < per_producer; i++) {
+          packet p(16);
+          p.add((U32)i);
+          unique_lock< mutex > lock(dq_mutex);
+          dq.push_back(std::move(p));
+          dq_cv.notify_one();
+        }
+      });
+    }
+    U64 sum_dq = 0;
+    for (int i = 0; i < total; i++) {
+      unique_lock< mutex > lock(dq_mutex);
+      dq_cv.wait(lock, [&dq]() { return !dq.empty(); });
+      sum_dq += dq.front().fget< U32 >();
+      dq.pop_front();
+    }
+    for (auto &it : producers) it.join();
+    producers.clear();
+    double t1 = realtime();
+
+    packet_mpmc_queue q(4096);
+    for (int pi = 0; pi < n_producers; pi++) {
+      producers.emplace_back([&q, per_producer]() {
+        for (int i = 0; i < per_producer; i++) {
+          packet p(16);
+          p.add((U32)i);
+          q.push(std::move(p));
+        }
+      });
+    }
+    U64 sum_q = 0;
+    packet rx;
+    for (int i = 0; i < total; i++) {
+      q.pop(rx);
+      sum_q += rx.fget< U32 >();
+    }
+    for (auto &it : producers) it.join();
+    double t2 = realtime();
+    if (sum_dq != sum_q) throw runtime_error("Mismatch");
+    return stringprintf("deque_ns_per_packet=%0.3g\nmpmc_ns_per_packet=%0.3g\n",
+      (t1 - t0) / total * 1e9, (t2 - t1) / total * 1e9);
+  }
   else {
     throw runtime_error("No such test");
   }
@@ -1,5 +1,10 @@
 #pragma once
-
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#if !defined(WIN32)
+#  include <sys/uio.h>
+#endif
 
 
 /*
@@ -56,20 +61,28 @@
 
 struct packet_contents;
 struct packet_annotations;
+struct packet_view;
 struct jsonstr;
 
 /*
-  This is the actual data in the packet
+  This is the actual data in the packet.
+  Usually the bytes live in buf, right after the header. External contents (see
+  packet::from_external) point data at someone else's memory instead, and call release when the
+  last reference goes away. External contents are read-only: the add_* functions go through
+  reserve, which copies them first, but don't write through the non-const ptr() of such a packet.
 */
 struct packet_contents {
-  int refcnt; // should be std::atomic
+  std::atomic< int > refcnt;
   size_t alloc;
+  uint8_t *data;
+  void (*release)(packet_contents *it);
+  void *release_arg;
   uint8_t buf[1];
 };
 
 struct packet_annotations {
   packet_annotations() = default;
-  int refcnt = 0;
+  std::atomic< int > refcnt {0};
   map<string, string> table;
 };
 
@@ -91,17 +104,106 @@ struct packet_rd_type_err : invalid_argument {
   string got;
 };
 
+/*
+  Counters are kept per thread so they don't become a contention point themselves.
+  packet::get_stats() adds up all the threads, including ones that have exited.
+*/
 struct packet_stats {
-  int incref_count;
-  int decref_count;
-  int alloc_count;
-  int free_count;
-  int cow_count;
-  int expand_count;
+  long long incref_count;
+  long long decref_count;
+  long long alloc_count;
+  long long free_count;
+  long long cow_count;
+  long long expand_count;
   long long copy_bytes_count;
+  long long pool_hit_count;
+  long long pool_miss_count;
+  long long pool_overflow_count; // freed to malloc because the pool was full
+  long long queue_push_count; // packet_mpmc_queue
+  long long queue_pop_count;
+  long long queue_drop_count; // PACKET_QUEUE_DROP_OLDEST
+  long long queue_reject_count; // full with PACKET_QUEUE_REJECT, or closed
+};
+
+/*
+  A per-stream dictionary of typetags, so checked mode doesn't spend most of every small message
+  on strings like "arma::Col:1". While a packet_typetag_scope is active on a thread, add_typetag
+  sends each tag's string only the first time, with an id, and after that just the id (2 bytes
+  for the first 128 tags). test_typetag and check_typetag, in a scope with the receiving end's
+  dictionary, compare the id against the one that last matched the expected tag, which is an
+  integer compare once each (id, call site) pair has been seen.
+
+  Wire format, in place of the usual length byte and string:
+    0xfe varint(id) u_char(len) bytes   -- defines id and means that tag
+    0xff varint(id)                     -- a tag defined earlier
+  Plain tags have length < 254, so a reader with a dictionary also reads plain packets. One
+  without a dictionary throws packet_rd_type_err on a dictionary tag.
+
+  Use one dictionary for each direction of each connection, and read packets in the order they
+  were written: a packet that was built but never sent may hold the only definition of an id. If
+  you reconnect, clear() both ends. A dictionary isn't thread safe, but a stream is normally only
+  encoded (or decoded) by one thread at a time anyway.
+*/
+struct packet_typetag_dict {
+  void clear();
+
+  // Writer side. Sets is_new if this is the first time we've seen this tag
+  U32 wr_id(char const *tag, bool &is_new);
+
+  // Reader side
+  void define(U32 id, string const &tag);
+  bool rd_match(U32 id, char const *expected);
+  string const &name(U32 id) const;
+
+  unordered_map< char const *, U32 > wr_by_ptr; // Tags are almost always string literals
+  unordered_map< string, U32 > wr_by_name; // for different pointers to the same string
+  vector< string > rd_names;
+  vector< char const * > rd_matched; // the last expected pointer that matched each id
+};
+
+/*
+  Use dict for typetags on this thread until the scope is destroyed. Scopes nest, and a null dict
+  goes back to plain tags.
+    packet_typetag_scope scope(&conn->tx_typetags);
+    wr.add_checked(x);
+*/
+struct packet_typetag_scope {
+  explicit packet_typetag_scope(packet_typetag_dict *dict);
+  ~packet_typetag_scope();
+  packet_typetag_scope(packet_typetag_scope const &) = delete;
+  packet_typetag_scope & operator=(packet_typetag_scope const &) = delete;
+
+  packet_typetag_dict *saved;
 };
 
 
+// ----------------------------------------------------------------------
+
+/*
+  Cursors for reading and writing types with a fixed wire size (see packet_fixed_size in
+  packetbuf_types.h) without bounds checks. packet::get_fixed and add_fixed check the whole size
+  once and then hand you one of these.
+*/
+struct packet_rd_unchecked {
+  uint8_t const *ptr;
+
+  template<typename T>
+  void get(T &x) {
+    packet_rd_fixed(*this, x);
+  }
+};
+
+struct packet_wr_unchecked {
+  uint8_t *ptr;
+
+  template<typename T>
+  void add(T const &x) {
+    packet_wr_fixed(*this, x);
+  }
+};
+
+template<typename T> struct packet_fixed_size;
+
 // ----------------------------------------------------------------------
 
 struct packet {
@@ -179,6 +281,31 @@ struct packet {
     packet_wr_value(*this, x);
   }
 
+  // See packetbuf_compact.h
+  template<typename T>
+  void add_compact(const T &x) {
+    packet_wr_compact(*this, x);
+  }
+
+  template<typename T>
+  void add_compact_checked(const T &x) {
+    add_typetag("compact:1");
+    packet_wr_typetag(*this, x);
+    packet_wr_compact(*this, x);
+  }
+
+  // For types with a packet_fixed_size: one bounds check for the whole thing
+  template<typename T>
+  void add_fixed(const T &x) {
+    const size_t n = packet_fixed_size< T >::value;
+    static_assert(n > 0, "add_fixed needs a type with a fixed wire size");
+    reserve(wr_pos + n);
+    packet_wr_unchecked w { wr_ptr() };
+    packet_wr_fixed(w, x);
+    assert(w.ptr == wr_ptr() + n);
+    wr_pos += n;
+  }
+
   void add_be_uint32(uint32_t x);
   void add_be_uint24(uint32_t x);
   void add_be_uint16(uint32_t x);
@@ -231,8 +358,35 @@ struct packet {
     return ret;
   }
 
+  template<typename T>
+  void get_fixed(T &x) {
+    const size_t n = packet_fixed_size< T >::value;
+    static_assert(n > 0, "get_fixed needs a type with a fixed wire size");
+    if ((ssize_t)n > remaining()) throw packet_rd_overrun_err(n - remaining());
+    packet_rd_unchecked r { rd_ptr() };
+    packet_rd_fixed(r, x);
+    assert(r.ptr == rd_ptr() + n);
+    rd_pos += n;
+  }
+
+  template<typename T>
+  void get_compact(T &x) {
+    packet_rd_compact(*this, x);
+  }
+
+  template<typename T>
+  void get_compact_checked(T &x) {
+    check_typetag("compact:1");
+    packet_rd_typetag(*this, x);
+    packet_rd_compact(*this, x);
+  }
+
   packet get_pkt();
 
+  // See packet_view. Neither copies nor touches the refcount
+  packet_view view() const;
+  packet_view get_view(); // Like get_pkt
+
   bool test_typetag(char const *expected);
   void check_typetag(char const *expected);
 
@@ -243,15 +397,39 @@ struct packet {
   double get_be_double();
   string get_nl_string();
 
+  /*
+    Files of at least mmap_threshold bytes are mapped read-only rather than read, and unmapped
+    when the last copy of the packet goes away. Writing to one copies it first, like any
+    shared packet. add_file_contents does the same when the packet is empty and fd is at the
+    start of the file. read_from_fd closes fd.
+  */
   static packet read_from_file(char const *fn);
+  static packet from_external(uint8_t const *data, size_t size, void (*release)(packet_contents *it), void *release_arg);
   static packet read_from_fd(int fd);
+  static const size_t mmap_threshold = 65536;
 
   // stats
+  static packet_stats get_stats();
   static string stats_str();
   static void clear_stats();
 
+  // Limits on the per-thread pool of free packet buffers. See alloc_contents
+  static void set_pool_limits(size_t max_blocks_per_class, size_t max_bytes_per_thread);
+
   // internals
+  struct borrow_tag {};
+  packet(packet const &other, borrow_tag) noexcept // Shares other's contents without a reference
+  :contents(other.contents), annotations(other.annotations), rd_pos(other.rd_pos), wr_pos(other.wr_pos)
+  {
+  }
+  struct adopt_tag {};
+  packet(packet_contents *c, size_t size, adopt_tag) noexcept // Takes over the caller's reference to c
+  :contents(c), annotations(nullptr), rd_pos(0), wr_pos(size)
+  {
+  }
   static packet_contents *alloc_contents(size_t alloc);
+  static packet_contents *alloc_external(uint8_t const *data, size_t size, void (*release)(packet_contents *it), void *release_arg);
+  static packet_contents *map_contents(int fd);
   static void decref(packet_contents *&it);
   static void incref(packet_contents *it);
   void reserve(size_t new_size);
@@ -267,14 +445,235 @@ struct packet {
   packet_annotations *annotations { nullptr };
   size_t rd_pos { 0 };
   size_t wr_pos { 0 };
-
-  static packet_stats stats;
 };
 
 bool operator ==(packet const &a, packet const &b);
 
 // ----------------------------------------------------------------------
 
+/*
+  A read-only cursor over part of a packet, for decoding without refcount traffic.
+  p.view() covers p's unread bytes, and p.get_view() (or v.get_view()) reads a sub-packet
+  written by add_pkt, like get_pkt does. Making, copying and destroying views doesn't touch the
+  refcounts, so it's cheap to decode nested messages with them.
+
+  Inside is a packet that borrows the contents without holding a reference, so all the
+  packet_rd_value overloads (which take a packet &) work on a view with get / get_checked.
+  The price is that a view mustn't outlive the packet it came from, and an overload mustn't
+  write to or assign the packet it's given. Use to_packet() for something you can keep.
+*/
+struct packet_view {
+  explicit packet_view(packet const &src) noexcept
+  :p(src, packet::borrow_tag())
+  {
+  }
+  packet_view(packet_view const &other) noexcept
+  :p(other.p, packet::borrow_tag())
+  {
+  }
+  packet_view & operator= (packet_view const &other) noexcept
+  {
+    p.contents = other.p.contents;
+    p.annotations = other.p.annotations;
+    p.rd_pos = other.p.rd_pos;
+    p.wr_pos = other.p.wr_pos;
+    return *this;
+  }
+  ~packet_view()
+  {
+    // So ~packet doesn't drop a reference we don't have
+    p.contents = nullptr;
+    p.annotations = nullptr;
+  }
+
+  ssize_t remaining() const { return p.remaining(); }
+  const uint8_t *rd_ptr() const { return p.rd_ptr(); }
+  void get_skip(int n) { p.get_skip(n); }
+  bool get_test(uint8_t *data, size_t size) { return p.get_test(data, size); }
+  void get_bytes(uint8_t *data, size_t size) { p.get_bytes(data, size); }
+  void get_bytes(char *data, size_t size) { p.get_bytes(data, size); }
+  bool test_typetag(char const *expected) { return p.test_typetag(expected); }
+  void check_typetag(char const *expected) { p.check_typetag(expected); }
+  string annotation(string const &key) const { return static_cast< packet const & >(p).annotation(key); }
+  bool has_annotation(string const &key) const { return p.has_annotation(key); }
+
+  template<typename T>
+  void get(T &x) {
+    packet_rd_value(p, x);
+  }
+
+  template<typename T>
+  void get_checked(T &x) {
+    packet_rd_typetag(p, x);
+    packet_rd_value(p, x);
+  }
+
+  template<typename T>
+  T fget() {
+    T ret;
+    packet_rd_value(p, ret);
+    return ret;
+  }
+
+  template<typename T>
+  T fget_checked() {
+    T ret;
+    packet_rd_typetag(p, ret);
+    packet_rd_value(p, ret);
+    return ret;
+  }
+
+  template<typename T>
+  void get_fixed(T &x) {
+    p.get_fixed(x);
+  }
+
+  template<typename T>
+  void get_compact(T &x) {
+    p.get_compact(x);
+  }
+
+  template<typename T>
+  void get_compact_checked(T &x) {
+    p.get_compact_checked(x);
+  }
+
+  packet_view get_view() { return p.get_view(); }
+  packet to_packet() const { return p; } // Takes a real reference, covering the same bytes
+
+  packet p;
+};
+
+// ----------------------------------------------------------------------
+
+/*
+  A chain of packets written out back to back, for assembling big messages without copying.
+
+  Appending a packet (add_ref, add_pkt) or someone else's buffer (add_external) takes a
+  reference to its bytes instead of copying them, so an append costs the same however big the
+  chain already is. Small values (add, add_bytes) go into a tail packet owned by the chain.
+  Each segment contributes the bytes between its rd_pos and wr_pos, and the result is byte for
+  byte what a packet would contain after the same sequence of calls.
+
+  Segments are shared, not owned: changing a packet after adding it is fine as long as you go
+  through the add_* functions (which copy-on-write), but not if you write through ptr().
+
+  to_file and UvStream::write(packet_chain) hand all the segments to the kernel in one writev.
+  flatten() copies everything into one packet, for when you need to read it back.
+*/
+struct packet_chain {
+  packet_chain() = default;
+
+  size_t size() const;
+  bool empty() const { return size() == 0; }
+  size_t n_segs() const { return segs.size(); }
+  void clear();
+
+  // writing
+  void add_bytes(char const *data, size_t size);
+  void add_bytes(uint8_t const *data, size_t size);
+  void add_ref(packet const &wr);
+  void add_pkt(packet const &wr); // Same wire format as packet::add_pkt
+  void add_chain(packet_chain const &other);
+  void add_external(uint8_t const *data, size_t size, void (*release)(packet_contents *it), void *release_arg);
+
+  template<typename T>
+  void add(const T &x) {
+    packet_wr_value(tail(), x);
+  }
+
+  // output
+  packet flatten() const;
+  void fill_iovec(vector< struct iovec > &iov) const;
+  ssize_t to_file(int fd) const; // Retries short writes. Returns bytes written or -1 with errno set
+  void to_file_boxed(int fd) const; // Same format as packet::to_file_boxed
+
+  // Packets smaller than this get copied by add_pkt instead of becoming their own segment
+  static const size_t copy_threshold = 256;
+
+  // internals
+  packet &tail();
+  void close_tail();
+
+  vector< packet > segs;
+  size_t closed_size { 0 }; // Bytes in segs, not counting an open tail
+  bool tail_open { false };
+};
+
+// ----------------------------------------------------------------------
+
+// Single-threaded. To pass packets between threads, use packet_mpmc_queue
 using packet_queue = deque< packet >;
 
+enum packet_queue_overflow {
+  PACKET_QUEUE_BLOCK, // push waits for room
+  PACKET_QUEUE_REJECT, // push returns false
+  PACKET_QUEUE_DROP_OLDEST, // push discards the packet at the head to make room
+};
+
+/*
+  A bounded queue of packets for any number of producer and consumer threads, without a lock on
+  the fast path. It's Vyukov's array queue (1024cores.net, "Bounded MPMC queue"): each slot has a
+  sequence number saying whose turn it is, so a push or pop is one CAS on enq_pos or deq_pos plus
+  a move. Packets are moved in and out, never copied, so no refcount traffic either.
+
+  Blocking (pop with a timeout, or push with PACKET_QUEUE_BLOCK) spins briefly and then waits on
+  a condition variable. The other side only takes the mutex if somebody is waiting, and waiting
+  pushers are woken once a quarter of the queue is free rather than on every pop.
+
+  close() wakes everyone up: after that, push fails and pop returns what's left and then false.
+
+  Pushes, pops, drops and rejects are counted in packet::get_stats, so queue_depth there is the
+  total of all queues.
+*/
+struct packet_mpmc_queue {
+  explicit packet_mpmc_queue(size_t _capacity, packet_queue_overflow _overflow = PACKET_QUEUE_BLOCK);
+  ~packet_mpmc_queue();
+  packet_mpmc_queue(packet_mpmc_queue const &) = delete;
+  packet_mpmc_queue & operator=(packet_mpmc_queue const &) = delete;
+
+  // According to the overflow policy. Returns false if the packet wasn't queued
+  bool push(packet &&it);
+  // Never waits or drops
+  bool try_push(packet &&it);
+  // Moves from its[0..n) in order, applying the overflow policy to each. Returns the number queued
+  size_t push_batch(packet *its, size_t n);
+
+  // Wait up to timeout seconds (forever if negative). Returns false on timeout or once closed and empty
+  bool pop(packet &it, double timeout = -1.0);
+  bool try_pop(packet &it);
+  // Append up to max_n packets to its without waiting. Returns the number popped
+  size_t pop_batch(vector< packet > &its, size_t max_n);
+
+  void close();
+  bool is_closed() const { return closed.load(std::memory_order_acquire); }
+
+  size_t capacity() const { return mask + 1; }
+  size_t depth() const; // Approximate if other threads are pushing or popping
+
+  struct cell {
+    std::atomic< size_t > seq;
+    alignas(packet) unsigned char storage[sizeof(packet)];
+  };
+
+  packet_queue_overflow overflow;
+  size_t mask;
+  cell *cells;
+
+  alignas(64) std::atomic< size_t > enq_pos;
+  alignas(64) std::atomic< size_t > deq_pos;
+  alignas(64) std::atomic< bool > closed;
+  std::atomic< int > push_waiters;
+  std::atomic< int > pop_waiters;
+  std::mutex wait_mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+
+private:
+  bool enqueue(packet &it);
+  bool dequeue(packet &it);
+  void wake_poppers(bool all); // One packet only needs to wake one waiter
+  void wake_pushers();
+};
+
 ostream & operator <<(ostream &s, packet const &it);
@@ -0,0 +1,350 @@
+#include "tlbcore/common/std_headers.h"
+#include "./packetbuf_compact.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  include <immintrin.h>
+#  define PACKET_COMPACT_X86_DISPATCH 1
+#endif
+
+void packet_wr_varint(packet &p, U64 x)
+{
+  u_char buf[10];
+  size_t n = 0;
+  while (x >= 0x80) {
+    buf[n++] = static_cast< u_char >(x | 0x80);
+    x >>= 7;
+  }
+  buf[n++] = static_cast< u_char >(x);
+  p.add_bytes(buf, n);
+}
+
+U64 packet_rd_varint(packet &p)
+{
+  u_char const *ptr = p.rd_ptr();
+  size_t avail = static_cast< size_t >(p.remaining());
+  U64 ret = 0;
+  for (size_t i = 0; i < 10; i++) {
+    if (i >= avail) throw packet_rd_overrun_err(1);
+    u_char b = ptr[i];
+    ret |= static_cast< U64 >(b & 0x7f) << (7 * i);
+    if (!(b & 0x80)) {
+      p.rd_pos += i + 1;
+      return ret;
+    }
+  }
+  throw runtime_error("packet_rd_varint: more than 10 bytes");
+}
+
+template<typename T>
+static T compact_check_range(U64 v, char const *name)
+{
+  if (v > static_cast< U64 >(numeric_limits< T >::max())) {
+    throw fmt_runtime_error("packet_rd_compact: %llu out of range for %s", (unsigned long long)v, name);
+  }
+  return static_cast< T >(v);
+}
+
+template<typename T>
+static T compact_check_range(S64 v, char const *name)
+{
+  if (v > static_cast< S64 >(numeric_limits< T >::max()) || v < static_cast< S64 >(numeric_limits< T >::min())) {
+    throw fmt_runtime_error("packet_rd_compact: %lld out of range for %s", (long long)v, name);
+  }
+  return static_cast< T >(v);
+}
+
+void packet_wr_compact(packet &p, U16 const &x) { packet_wr_varint(p, x); }
+void packet_wr_compact(packet &p, S16 const &x) { packet_wr_varint(p, zigzag_encode(x)); }
+void packet_wr_compact(packet &p, U32 const &x) { packet_wr_varint(p, x); }
+void packet_wr_compact(packet &p, S32 const &x) { packet_wr_varint(p, zigzag_encode(x)); }
+void packet_wr_compact(packet &p, U64 const &x) { packet_wr_varint(p, x); }
+void packet_wr_compact(packet &p, S64 const &x) { packet_wr_varint(p, zigzag_encode(x)); }
+
+void packet_rd_compact(packet &p, U16 &x) { x = compact_check_range< U16 >(packet_rd_varint(p), "U16"); }
+void packet_rd_compact(packet &p, S16 &x) { x = compact_check_range< S16 >(zigzag_decode(packet_rd_varint(p)), "S16"); }
+void packet_rd_compact(packet &p, U32 &x) { x = compact_check_range< U32 >(packet_rd_varint(p), "U32"); }
+void packet_rd_compact(packet &p, S32 &x) { x = compact_check_range< S32 >(zigzag_decode(packet_rd_varint(p)), "S32"); }
+void packet_rd_compact(packet &p, U64 &x) { x = packet_rd_varint(p); }
+void packet_rd_compact(packet &p, S64 &x) { x = zigzag_decode(packet_rd_varint(p)); }
+
+void packet_wr_compact(packet &p, string const &x)
+{
+  if (!(x.size() < size_t(0x3fffffff))) throw fmt_runtime_error("Unreasonable size %zu", x.size());
+  packet_wr_varint(p, x.size());
+  p.add_bytes(x.data(), x.size());
+}
+
+void packet_rd_compact(packet &p, string &x)
+{
+  U64 size = packet_rd_varint(p);
+  if (!(size < U64(0x3fffffff))) throw fmt_runtime_error("Unreasonable size %lu", (u_long)size);
+  if (size > static_cast< U64 >(p.remaining())) throw packet_rd_overrun_err(size - p.remaining());
+  x.resize(size);
+  p.get_bytes(&x[0], size);
+}
+
+// ----------------------------------------------------------------------
+
+/*
+  Stream VByte. See the comment in packetbuf_compact.h for the format.
+  The tables turn a control byte (4 values of U32) or nibble (2 values of U64) into the number of
+  data bytes it covers, and a pshufb mask that moves those bytes into place and zero-fills the rest.
+*/
+struct svb_tables {
+  svb_tables();
+
+  u_char len32[256];
+  u_char shuf32[256][16];
+  u_char len64[16];
+  u_char shuf64[16][16];
+};
+
+svb_tables::svb_tables()
+{
+  for (int c = 0; c < 256; c++) {
+    int pos = 0;
+    for (int lane = 0; lane < 4; lane++) {
+      int len = ((c >> (2 * lane)) & 3) + 1;
+      for (int k = 0; k < 4; k++) {
+        shuf32[c][lane * 4 + k] = k < len ? static_cast< u_char >(pos + k) : 0x80;
+      }
+      pos += len;
+    }
+    len32[c] = static_cast< u_char >(pos);
+  }
+  for (int c = 0; c < 16; c++) {
+    int pos = 0;
+    for (int lane = 0; lane < 2; lane++) {
+      int len = 1 << ((c >> (2 * lane)) & 3);
+      for (int k = 0; k < 8; k++) {
+        shuf64[c][lane * 8 + k] = k < len ? static_cast< u_char >(pos + k) : 0x80;
+      }
+      pos += len;
+    }
+    len64[c] = static_cast< u_char >(pos);
+  }
+}
+
+static svb_tables const &get_svb_tables()
+{
+  static const svb_tables ret;
+  return ret;
+}
+
+static inline int svb_code(U32 v) { return (v > 0xff) + (v > 0xffff) + (v > 0xffffff); }
+static inline int svb_code(U64 v) { return v <= 0xff ? 0 : v <= 0xffff ? 1 : v <= 0xffffffff ? 2 : 3; }
+static inline size_t svb_code_len(U32 const *, int code) { return static_cast< size_t >(code) + 1; }
+static inline size_t svb_code_len(U64 const *, int code) { return size_t(1) << code; }
+
+static size_t svb_data_len(u_char const *ctrl, size_t n, U32 const *)
+{
+  auto &t = get_svb_tables();
+  size_t ret = 0;
+  for (size_t i = 0; i < n / 4; i++) ret += t.len32[ctrl[i]];
+  for (size_t i = n & ~size_t(3); i < n; i++) ret += ((ctrl[i / 4] >> (2 * (i % 4))) & 3) + 1;
+  return ret;
+}
+
+static size_t svb_data_len(u_char const *ctrl, size_t n, U64 const *)
+{
+  auto &t = get_svb_tables();
+  size_t ret = 0;
+  for (size_t i = 0; i < n / 4; i++) ret += t.len64[ctrl[i] & 15] + t.len64[ctrl[i] >> 4];
+  for (size_t i = n & ~size_t(3); i < n; i++) ret += size_t(1) << ((ctrl[i / 4] >> (2 * (i % 4))) & 3);
+  return ret;
+}
+
+template<typename U>
+static u_char const *svb_decode_scalar(u_char const *ctrl, u_char const *data, U *out, size_t i, size_t n)
+{
+  for (; i < n; i++) {
+    int code = (ctrl[i / 4] >> (2 * (i % 4))) & 3;
+    size_t len = svb_code_len(out, code);
+    U v = 0;
+    memcpy(&v, data, len); // little-endian
+    out[i] = v;
+    data += len;
+  }
+  return data;
+}
+
+#if defined(PACKET_COMPACT_X86_DISPATCH)
+
+static bool have_ssse3()
+{
+  static bool ret = __builtin_cpu_supports("ssse3");
+  return ret;
+}
+
+/*
+  The 16-byte loads can read past the end of the encoded data, so they stop once they'd go past
+  safe_end (the end of the packet's bytes) and the scalar loop does the rest.
+*/
+__attribute__((target("ssse3")))
+static u_char const *svb_decode_ssse3(u_char const *ctrl, u_char const *data, u_char const *safe_end, U32 *out, size_t n)
+{
+  auto &t = get_svb_tables();
+  size_t i = 0;
+  while (i + 4 <= n && data + 16 <= safe_end) {
+    u_char c = ctrl[i / 4];
+    __m128i v = _mm_loadu_si128(reinterpret_cast< __m128i const * >(data));
+    __m128i shuf = _mm_loadu_si128(reinterpret_cast< __m128i const * >(t.shuf32[c]));
+    _mm_storeu_si128(reinterpret_cast< __m128i * >(out + i), _mm_shuffle_epi8(v, shuf));
+    data += t.len32[c];
+    i += 4;
+  }
+  return svb_decode_scalar(ctrl, data, out, i, n);
+}
+
+__attribute__((target("ssse3")))
+static u_char const *svb_decode_ssse3(u_char const *ctrl, u_char const *data, u_char const *safe_end, U64 *out, size_t n)
+{
+  auto &t = get_svb_tables();
+  size_t i = 0;
+  while (i + 2 <= n && data + 16 <= safe_end) {
+    u_char c = (ctrl[i / 4] >> (2 * (i % 4))) & 15;
+    __m128i v = _mm_loadu_si128(reinterpret_cast< __m128i const * >(data));
+    __m128i shuf = _mm_loadu_si128(reinterpret_cast< __m128i const * >(t.shuf64[c]));
+    _mm_storeu_si128(reinterpret_cast< __m128i * >(out + i), _mm_shuffle_epi8(v, shuf));
+    data += t.len64[c];
+    i += 2;
+  }
+  return svb_decode_scalar(ctrl, data, out, i, n);
+}
+
+#endif
+
+template<typename U>
+static u_char const *svb_decode(u_char const *ctrl, u_char const *data, u_char const *safe_end, U *out, size_t n)
+{
+#if defined(PACKET_COMPACT_X86_DISPATCH)
+  if (have_ssse3()) return svb_decode_ssse3(ctrl, data, safe_end, out, n);
+#endif
+  return svb_decode_scalar(ctrl, data, out, 0, n);
+}
+
+template<typename U>
+static void svb_wr(packet &p, U const *x, size_t n, bool is_signed)
+{
+  using S = typename make_signed< U >::type;
+  if (!(n < 0x3fffffff)) throw fmt_runtime_error("Unreasonable size %zu", n);
+
+  u_char flags = 0;
+  if (n > 1) {
+    bool sorted = true;
+    for (size_t i = 1; i < n; i++) {
+      if (is_signed ? static_cast< S >(x[i-1]) > static_cast< S >(x[i]) : x[i-1] > x[i]) {
+        sorted = false;
+        break;
+      }
+    }
+    if (sorted) flags = PACKET_COMPACT_DELTA;
+  }
+  if (!flags && is_signed) flags = PACKET_COMPACT_ZIGZAG;
+
+  packet_wr_varint(p, n);
+  p.add(flags);
+  if (n == 0) return;
+
+  size_t ctrl_size = (n + 3) / 4;
+  // Writing each value at full width and advancing by its length stays inside this
+  p.reserve(p.wr_pos + ctrl_size + n * sizeof(U));
+  u_char *ctrl = p.wr_ptr();
+  u_char *data = ctrl + ctrl_size;
+  memset(ctrl, 0, ctrl_size);
+  U prev = 0;
+  for (size_t i = 0; i < n; i++) {
+    U v = x[i];
+    if (flags & PACKET_COMPACT_DELTA) {
+      U d = v - prev;
+      prev = v;
+      v = d;
+    }
+    else if (flags & PACKET_COMPACT_ZIGZAG) {
+      v = static_cast< U >(v << 1) ^ static_cast< U >(static_cast< S >(v) >> (8 * sizeof(U) - 1));
+    }
+    int code = svb_code(v);
+    ctrl[i / 4] |= static_cast< u_char >(code << (2 * (i % 4)));
+    memcpy(data, &v, sizeof(U));
+    data += svb_code_len(x, code);
+  }
+  p.wr_pos = static_cast< size_t >(data - p.ptr());
+}
+
+// T is U or its signed twin
+template<typename U, typename T>
+static void svb_rd(packet &p, vector< T > &x)
+{
+  using S = typename make_signed< U >::type;
+  U64 n = packet_rd_varint(p);
+  if (!(n < 0x3fffffff)) throw fmt_runtime_error("Unreasonable size %lu", (u_long)n);
+  u_char flags = p.fget< u_char >();
+  if (flags & ~(PACKET_COMPACT_DELTA | PACKET_COMPACT_ZIGZAG)) {
+    throw fmt_runtime_error("packet_rd_compact: unknown vector flags 0x%x", (int)flags);
+  }
+  size_t ctrl_size = (n + 3) / 4;
+  size_t avail = static_cast< size_t >(p.remaining());
+  if (ctrl_size > avail) throw packet_rd_overrun_err(ctrl_size - avail);
+  u_char const *ctrl = p.rd_ptr();
+  size_t data_len = svb_data_len(ctrl, n, static_cast< U const * >(nullptr));
+  if (ctrl_size + data_len > avail) throw packet_rd_overrun_err(ctrl_size + data_len - avail);
+
+  x.resize(n);
+  if (n == 0) return;
+  U *out = reinterpret_cast< U * >(x.data());
+  svb_decode(ctrl, ctrl + ctrl_size, ctrl + avail, out, n);
+  p.rd_pos += ctrl_size + data_len;
+
+  if (flags & PACKET_COMPACT_DELTA) {
+    U acc = 0;
+    for (size_t i = 0; i < n; i++) {
+      acc += out[i];
+      out[i] = acc;
+    }
+  }
+  if (flags & PACKET_COMPACT_ZIGZAG) {
+    for (size_t i = 0; i < n; i++) {
+      out[i] = static_cast< U >(out[i] >> 1) ^ static_cast< U >(-static_cast< S >(out[i] & 1));
+    }
+  }
+}
+
+void packet_wr_compact(packet &p, vector< U32 > const &x)
+{
+  svb_wr(p, x.data(), x.size(), false);
+}
+
+void packet_wr_compact(packet &p, vector< S32 > const &x)
+{
+  svb_wr(p, reinterpret_cast< U32 const * >(x.data()), x.size(), true);
+}
+
+void packet_wr_compact(packet &p, vector< U64 > const &x)
+{
+  svb_wr(p, x.data(), x.size(), false);
+}
+
+void packet_wr_compact(packet &p, vector< S64 > const &x)
+{
+  svb_wr(p, reinterpret_cast< U64 const * >(x.data()), x.size(), true);
+}
+
+void packet_rd_compact(packet &p, vector< U32 > &x)
+{
+  svb_rd< U32 >(p, x);
+}
+
+void packet_rd_compact(packet &p, vector< S32 > &x)
+{
+  svb_rd< U32 >(p, x);
+}
+
+void packet_rd_compact(packet &p, vector< U64 > &x)
+{
+  svb_rd< U64 >(p, x);
+}
+
+void packet_rd_compact(packet &p, vector< S64 > &x)
+{
+  svb_rd< U64 >(p, x);
+}
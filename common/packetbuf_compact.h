@@ -0,0 +1,162 @@
+#pragma once
+#include "./packetbuf_types.h"
+
+/*
+  A compact encoding for packets, for when most of the integers are small.
+
+  Use p.add_compact(x) / p.get_compact(x) instead of p.add(x) / p.get(x), or the _checked
+  versions, which put a "compact:1" typetag in front of the usual one so reading a compact
+  value with plain get_checked (or vice versa) throws packet_rd_type_err instead of
+  returning garbage. It's opt-in per value: the normal encoding doesn't change.
+
+  Encodings:
+    Unsigned integers (16 bits and up): LEB128 varint, 7 bits per byte, low bits first.
+    Signed integers: zigzag (0, -1, 1, -2, ... => 0, 1, 2, 3, ...) then varint.
+    Strings, vectors, maps: varint size, then the items in compact form.
+    Everything else (8-bit ints, bool, float, double, ...): same as packet_wr_value.
+
+    vector< U32 / S32 / U64 / S64 >: Stream VByte (Lemire et al, arXiv:1709.08990):
+      varint size, a flags byte, then a 2-bit length code per value packed 4 to a control byte,
+      then the value bytes. Keeping the lengths separate from the data means we can decode 4
+      values at a time with one SSSE3 shuffle instead of a branch per byte.
+      32-bit values take 1, 2, 3 or 4 bytes. 64-bit ones take 1, 2, 4 or 8 bytes.
+      If the vector is sorted, we store differences between successive values (flag
+      PACKET_COMPACT_DELTA); otherwise signed values are zigzagged (PACKET_COMPACT_ZIGZAG).
+*/
+
+static const u_char PACKET_COMPACT_DELTA = 1;
+static const u_char PACKET_COMPACT_ZIGZAG = 2;
+
+inline U64 zigzag_encode(S64 x) { return (static_cast< U64 >(x) << 1) ^ static_cast< U64 >(x >> 63); }
+inline S64 zigzag_decode(U64 x) { return static_cast< S64 >(x >> 1) ^ -static_cast< S64 >(x & 1); }
+
+void packet_wr_varint(packet &p, U64 x);
+U64 packet_rd_varint(packet &p); // throws packet_rd_overrun_err if truncated, runtime_error if too long
+
+void packet_wr_compact(packet &p, U16 const &x);
+void packet_wr_compact(packet &p, S16 const &x);
+void packet_wr_compact(packet &p, U32 const &x);
+void packet_wr_compact(packet &p, S32 const &x);
+void packet_wr_compact(packet &p, U64 const &x);
+void packet_wr_compact(packet &p, S64 const &x);
+void packet_wr_compact(packet &p, string const &x);
+void packet_wr_compact(packet &p, vector< U32 > const &x);
+void packet_wr_compact(packet &p, vector< S32 > const &x);
+void packet_wr_compact(packet &p, vector< U64 > const &x);
+void packet_wr_compact(packet &p, vector< S64 > const &x);
+
+void packet_rd_compact(packet &p, U16 &x);
+void packet_rd_compact(packet &p, S16 &x);
+void packet_rd_compact(packet &p, U32 &x);
+void packet_rd_compact(packet &p, S32 &x);
+void packet_rd_compact(packet &p, U64 &x);
+void packet_rd_compact(packet &p, S64 &x);
+void packet_rd_compact(packet &p, string &x);
+void packet_rd_compact(packet &p, vector< U32 > &x);
+void packet_rd_compact(packet &p, vector< S32 > &x);
+void packet_rd_compact(packet &p, vector< U64 > &x);
+void packet_rd_compact(packet &p, vector< S64 > &x);
+
+template<typename T1, typename T2> void packet_wr_compact(packet &p, map<T1, T2> const &x);
+template<typename T1, typename T2> void packet_rd_compact(packet &p, map<T1, T2> &x);
+
+// Types without a compact form are written normally
+template<typename T>
+void packet_wr_compact(packet &p, T const &x) {
+  packet_wr_value(p, x);
+}
+
+template<typename T>
+void packet_rd_compact(packet &p, T &x) {
+  packet_rd_value(p, x);
+}
+
+/*
+  Vectors of things whose compact form is the same as the normal one (like float or U8) are
+  copied in bulk after the size.
+*/
+template<typename T>
+struct packet_compact_same : integral_constant< bool,
+  packet_bulk_copyable< T >::value && !(is_integral< T >::value && sizeof(T) > 1) > {};
+
+template<typename T>
+void packet_wr_compact_elems(packet &p, T const *x, size_t n, true_type) {
+  packet_wr_elems(p, x, n, true_type());
+}
+
+template<typename T>
+void packet_wr_compact_elems(packet &p, T const *x, size_t n, false_type) {
+  for (size_t i=0; i<n; i++) {
+    packet_wr_compact(p, x[i]);
+  }
+}
+
+template<typename T>
+void packet_rd_compact_elems(packet &p, T *x, size_t n, true_type) {
+  packet_rd_elems(p, x, n, true_type());
+}
+
+template<typename T>
+void packet_rd_compact_elems(packet &p, T *x, size_t n, false_type) {
+  for (size_t i=0; i<n; i++) {
+    packet_rd_compact(p, x[i]);
+  }
+}
+
+template<typename T>
+void packet_wr_compact(packet &p, vector< T > const &x) {
+  if (!(x.size() < 0x3fffffff)) throw fmt_runtime_error("Unreasonable size %zu", x.size());
+  packet_wr_varint(p, x.size());
+  packet_wr_compact_elems(p, x.data(), x.size(), typename packet_compact_same< T >::type());
+}
+
+template<typename T>
+void packet_rd_compact(packet &p, vector< T > &x) {
+  U64 size = packet_rd_varint(p);
+  if (!(size < 0x3fffffff)) throw fmt_runtime_error("Unreasonable size %lu", (u_long)size);
+  // Every item takes at least a byte
+  if (size > (U64)p.remaining()) throw packet_rd_overrun_err(size - p.remaining());
+  x.resize(size);
+  packet_rd_compact_elems(p, x.data(), x.size(), typename packet_compact_same< T >::type());
+}
+
+inline void packet_wr_compact(packet &p, vector< bool > const &x) {
+  if (!(x.size() < 0x3fffffff)) throw fmt_runtime_error("Unreasonable size %zu", x.size());
+  packet_wr_varint(p, x.size());
+  for (size_t i=0; i<x.size(); i++) {
+    p.add((bool)x[i]);
+  }
+}
+
+inline void packet_rd_compact(packet &p, vector< bool > &x) {
+  U64 size = packet_rd_varint(p);
+  if (!(size < 0x3fffffff)) throw fmt_runtime_error("Unreasonable size %lu", (u_long)size);
+  if (size > (U64)p.remaining()) throw packet_rd_overrun_err(size - p.remaining());
+  x.resize(size);
+  for (size_t i=0; i<x.size(); i++) {
+    x[i] = p.fget< bool >();
+  }
+}
+
+template<typename T1, typename T2>
+void packet_wr_compact(packet &p, map<T1, T2> const &x)
+{
+  packet_wr_varint(p, x.size());
+  for (auto it = x.begin(); it != x.end(); it++) {
+    packet_wr_compact(p, it->first);
+    packet_wr_compact(p, it->second);
+  }
+}
+
+template<typename T1, typename T2>
+void packet_rd_compact(packet &p, map<T1, T2> &x)
+{
+  U64 x_size = packet_rd_varint(p);
+  for (size_t xi=0; xi < x_size; xi++) {
+    T1 first;
+    T2 second;
+    packet_rd_compact(p, first);
+    packet_rd_compact(p, second);
+    x[first] = second;
+  }
+}
@@ -1,4 +1,4 @@
-
+#pragma once
 #include "./packetbuf.h"
 #include <armadillo>
 
@@ -103,6 +103,118 @@ void packet_rd_typetag(packet &p, string const &x);
 void packet_rd_typetag(packet &p, jsonstr const &x);
 void packet_rd_typetag(packet &p, arma::cx_double const &x);
 
+/*
+  packet_bulk_copyable<T> is true when T's wire format is exactly its bytes in memory, so a
+  container of T can be written or read with one memcpy instead of a call per element. That's
+  true for the primitive types above and cx_double. If you have a POD struct whose
+  packet_wr_value/packet_rd_value just copy the raw struct (so padding is on the wire too),
+  you can specialize it to true_type for faster vectors of them.
+*/
+template<typename T>
+struct packet_bulk_copyable : integral_constant< bool, is_arithmetic< T >::value > {};
+template<>
+struct packet_bulk_copyable< arma::cx_double > : true_type {};
+#if !defined(WIN32)
+template<>
+struct packet_bulk_copyable< timeval > : true_type {};
+#endif
+
+/*
+  packet_fixed_size<T>::value is the exact number of bytes T takes on the wire, or 0 if it varies.
+  For a struct whose fields all have fixed sizes, specialize it to the total and write
+  packet_rd_fixed / packet_wr_fixed functions that get / add each field through the unchecked
+  cursor. Then packet_rd_value can just call p.get_fixed(x), which checks the size once instead
+  of once per field, and vectors of it get checked once for the whole vector.
+  Example: {
+    template<>
+    struct packet_fixed_size< Telemetry > : integral_constant< size_t, 8 + 4 + 2 > {};
+    inline void packet_rd_fixed(packet_rd_unchecked &r, Telemetry &x) {
+      r.get(x.ts);
+      r.get(x.temp);
+      r.get(x.flags);
+    }
+  }
+  Debug builds assert that the functions moved the cursor by exactly the declared size.
+  Anything variable-length (strings, vectors) must keep using the checked get.
+*/
+template<typename T>
+struct packet_fixed_size : integral_constant< size_t, packet_bulk_copyable< T >::value ? sizeof(T) : 0 > {};
+
+/*
+  packet_min_wire_size<T>::value is a lower bound on the bytes T takes on the wire: the fixed
+  size if it has one, the length words of containers, and 1 byte otherwise (a short string).
+  Vector readers use it to reject counts that can't possibly fit in what's left of the packet.
+*/
+template<typename T>
+struct packet_min_wire_size : integral_constant< size_t, (packet_fixed_size< T >::value > 0) ? packet_fixed_size< T >::value : 1 > {};
+template<typename T>
+struct packet_min_wire_size< vector< T > > : integral_constant< size_t, 4 > {};
+template<typename T>
+struct packet_min_wire_size< arma::Col< T > > : integral_constant< size_t, 4 > {};
+template<typename T>
+struct packet_min_wire_size< arma::Row< T > > : integral_constant< size_t, 4 > {};
+template<typename T>
+struct packet_min_wire_size< arma::Mat< T > > : integral_constant< size_t, 8 > {};
+template<typename T1, typename T2>
+struct packet_min_wire_size< map< T1, T2 > > : integral_constant< size_t, 4 > {};
+template<typename T1, typename T2>
+struct packet_min_wire_size< pair< T1, T2 > > : integral_constant< size_t, packet_min_wire_size< T1 >::value + packet_min_wire_size< T2 >::value > {};
+
+template<typename T>
+typename enable_if< packet_bulk_copyable< T >::value >::type
+packet_rd_fixed(packet_rd_unchecked &r, T &x) {
+  memcpy(&x, r.ptr, sizeof(T));
+  r.ptr += sizeof(T);
+}
+
+template<typename T>
+typename enable_if< packet_bulk_copyable< T >::value >::type
+packet_wr_fixed(packet_wr_unchecked &w, T const &x) {
+  memcpy(w.ptr, &x, sizeof(T));
+  w.ptr += sizeof(T);
+}
+
+template<typename T>
+void packet_wr_elems(packet &p, T const *x, size_t n, true_type) {
+  if (n > 0) p.add_bytes(reinterpret_cast< u_char const * >(x), n * sizeof(T));
+}
+
+template<typename T>
+void packet_wr_elems(packet &p, T const *x, size_t n, false_type) {
+  for (size_t i=0; i<n; i++) {
+    p.add(x[i]);
+  }
+}
+
+template<typename T>
+void packet_rd_elems(packet &p, T *x, size_t n, true_type) {
+  if (n > 0) p.get_bytes(reinterpret_cast< u_char * >(x), n * sizeof(T));
+}
+
+template<typename T>
+void packet_rd_elems_var(packet &p, T *x, size_t n, true_type) {
+  const size_t elsize = packet_fixed_size< T >::value;
+  if (n > (size_t)p.remaining() / elsize) throw packet_rd_overrun_err(n * elsize - p.remaining());
+  packet_rd_unchecked r { p.rd_ptr() };
+  for (size_t i=0; i<n; i++) {
+    packet_rd_fixed(r, x[i]);
+  }
+  assert(r.ptr == p.rd_ptr() + n * elsize);
+  p.rd_pos += n * elsize;
+}
+
+template<typename T>
+void packet_rd_elems_var(packet &p, T *x, size_t n, false_type) {
+  for (size_t i=0; i<n; i++) {
+    p.get(x[i]);
+  }
+}
+
+template<typename T>
+void packet_rd_elems(packet &p, T *x, size_t n, false_type) {
+  packet_rd_elems_var(p, x, n, integral_constant< bool, (packet_fixed_size< T >::value > 0) >());
+}
+
 /*
   Any vector is handled by writing a size followed by the items. Watch
   out for heap overflows. stl_vector seems to protect against this by
@@ -120,10 +232,17 @@ void packet_wr_typetag(packet &p, vector< T > const &x) {
 
 template<typename T>
 void packet_wr_value(packet &p, vector< T > const &x) {
+  if (!(x.size() < 0x3fffffff)) throw fmt_runtime_error("Unreasonable size %zu", x.size());
+  p.add((uint32_t)x.size());
+  packet_wr_elems(p, x.data(), x.size(), typename packet_bulk_copyable< T >::type());
+}
+
+// vector<bool> is packed, so it can't use packet_wr_elems
+inline void packet_wr_value(packet &p, vector< bool > const &x) {
   if (!(x.size() < 0x3fffffff)) throw fmt_runtime_error("Unreasonable size %zu", x.size());
   p.add((uint32_t)x.size());
   for (size_t i=0; i<x.size(); i++) {
-    p.add(x[i]);
+    p.add((bool)x[i]);
   }
 }
 
@@ -133,15 +252,45 @@ void packet_rd_typetag(packet &p, vector< T > const &x) {
   packet_rd_typetag(p, T());
 }
 
+/*
+  With a fixed wire size, the count check above bounds the allocation, so resize up front.
+  Otherwise an element can take much less on the wire than in memory (1 byte for a 32-byte
+  string), so grow as elements actually decode rather than trusting the count.
+*/
+template<typename T>
+void packet_rd_vector_elems(packet &p, vector< T > &x, size_t size, true_type) {
+  x.resize(size);
+  packet_rd_elems(p, x.data(), x.size(), typename packet_bulk_copyable< T >::type());
+}
+
+template<typename T>
+void packet_rd_vector_elems(packet &p, vector< T > &x, size_t size, false_type) {
+  x.clear();
+  for (size_t i=0; i<size; i++) {
+    x.emplace_back();
+    p.get(x.back());
+  }
+}
+
 template<typename T>
 void packet_rd_value(packet &p, vector< T > &x) {
   uint32_t size;
   p.get(size);
   if (!(size < 0x3fffffff)) throw fmt_runtime_error("Unreasonable size %lu", (u_long)size);
-  if (size > p.remaining() / sizeof(T)) throw packet_rd_overrun_err(size*sizeof(T) - p.remaining());
+  // sizeof(T) can be more than the wire size (padding, or short strings), so check against the wire size
+  const size_t elsize = packet_min_wire_size< T >::value;
+  if (size > p.remaining() / elsize) throw packet_rd_overrun_err(size*elsize - p.remaining());
+  packet_rd_vector_elems(p, x, size, integral_constant< bool, (packet_fixed_size< T >::value > 0) >());
+}
+
+inline void packet_rd_value(packet &p, vector< bool > &x) {
+  uint32_t size;
+  p.get(size);
+  if (!(size < 0x3fffffff)) throw fmt_runtime_error("Unreasonable size %lu", (u_long)size);
+  if (size > p.remaining() / sizeof(bool)) throw packet_rd_overrun_err(size*sizeof(bool) - p.remaining());
   x.resize(size);
   for (size_t i=0; i<x.size(); i++) {
-    p.get(x[i]);
+    x[i] = p.fget< bool >();
   }
 }
 
@@ -158,9 +307,7 @@ template<typename T>
 void packet_wr_value(packet &p, arma::Col< T > const &x) {
   assert(x.n_elem < 0x3fffffff);
   p.add((uint32_t)x.n_elem);
-  for (size_t i=0; i<x.n_elem; i++) {
-    p.add(x[i]);
-  }
+  packet_wr_elems(p, x.memptr(), x.n_elem, typename packet_bulk_copyable< T >::type());
 }
 
 template<typename T>
@@ -177,9 +324,7 @@ void packet_rd_value(packet &p, arma::Col< T > &x) {
   // SECURITY: hmmm
   if (size > p.remaining() / sizeof(T)) throw packet_rd_overrun_err(size*sizeof(T) - p.remaining());
   x.set_size(size);
-  for (size_t i=0; i<x.n_elem; i++) {
-    p.get(x(i));
-  }
+  packet_rd_elems(p, x.memptr(), x.n_elem, typename packet_bulk_copyable< T >::type());
 }
 
 template<typename T>
@@ -194,9 +339,7 @@ void packet_wr_value(packet &p, arma::Mat< T > const &x) {
   assert(x.n_elem < 0x3fffffff);
   p.add((uint32_t)x.n_rows);
   p.add((uint32_t)x.n_cols);
-  for (size_t i=0; i<x.n_elem; i++) {
-    p.add(x[i]);
-  }
+  packet_wr_elems(p, x.memptr(), x.n_elem, typename packet_bulk_copyable< T >::type());
 }
 
 template<typename T>
@@ -215,9 +358,7 @@ void packet_rd_value(packet &p, arma::Mat< T > &x) {
   // SECURITY: hmmm
   if ((size_t)n_rows * (size_t)n_cols > (size_t)p.remaining() / sizeof(T)) throw packet_rd_overrun_err((size_t)n_rows * (size_t)n_cols * sizeof(T) - (size_t)p.remaining());
   x.set_size(n_rows, n_cols);
-  for (size_t i=0; i<x.n_elem; i++) {
-    p.get(x(i));
-  }
+  packet_rd_elems(p, x.memptr(), x.n_elem, typename packet_bulk_copyable< T >::type());
 }
 
 // ----------------------------------------------------------------------
@@ -3,23 +3,319 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
 
 
+// ----------------------------------------------------------------------
+
+#if defined(__linux__)
+// The CPUs the calling thread may run on
+static vector< int > getThreadCpus()
+{
+  vector< int > ret;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) ret.push_back(cpu);
+    }
+  }
+  return ret;
+}
+
+static void setThreadCpus(vector< int > const &cpus)
+{
+  if (cpus.empty()) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+  }
+  if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+    eprintf("ParEngine: sched_setaffinity: %s\n", strerror(errno));
+  }
+}
+#else
+static vector< int > getThreadCpus()
+{
+  return vector< int >();
+}
+
+static void setThreadCpus(vector< int > const &cpus)
+{
+}
+#endif
+
+static string readSysFile(string const &fn)
+{
+  FILE *fp = fopen(fn.c_str(), "r");
+  if (!fp) return string();
+  string ret;
+  char buf[4096];
+  size_t nr;
+  while ((nr = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    ret.append(buf, nr);
+  }
+  fclose(fp);
+  return ret;
+}
+
+// Parse a kernel cpu list, like "0-3,8-11"
+static vector< int > parseCpuList(string const &s)
+{
+  vector< int > ret;
+  char const *p = s.c_str();
+  while (*p) {
+    char *end;
+    long lo = strtol(p, &end, 10);
+    if (end == p) break;
+    long hi = lo;
+    p = end;
+    if (*p == '-') {
+      hi = strtol(p + 1, &end, 10);
+      p = end;
+    }
+    for (long cpu = lo; cpu <= hi; cpu++) {
+      ret.push_back((int)cpu);
+    }
+    if (*p != ',') break;
+    p++;
+  }
+  return ret;
+}
+
+// The inverse of parseCpuList
+static string fmtCpuList(vector< int > const &cpus)
+{
+  string ret;
+  for (size_t i = 0; i < cpus.size(); ) {
+    size_t j = i + 1;
+    while (j < cpus.size() && cpus[j] == cpus[j - 1] + 1) j++;
+    if (!ret.empty()) ret += ",";
+    ret += to_string(cpus[i]);
+    if (j - i > 1) ret += "-" + to_string(cpus[j - 1]);
+    i = j;
+  }
+  return ret;
+}
+
+// The number after key in a file like /proc/meminfo or memory.stat, or 0
+static size_t findStatField(string const &text, string const &key)
+{
+  size_t pos = 0;
+  while ((pos = text.find(key, pos)) != string::npos) {
+    if ((pos == 0 || text[pos - 1] == '\n') && pos + key.size() < text.size() &&
+        (text[pos + key.size()] == ' ' || text[pos + key.size()] == ':')) {
+      char const *p = text.c_str() + pos + key.size();
+      if (*p == ':') p++;
+      return (size_t)strtoull(p, nullptr, 10);
+    }
+    pos += key.size();
+  }
+  return 0;
+}
+
+static size_t procRss()
+{
+#if defined(__linux__)
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (!fp) return 0;
+  unsigned long size = 0, resident = 0;
+  if (fscanf(fp, "%lu %lu", &size, &resident) != 2) resident = 0;
+  fclose(fp);
+  return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+#else
+  return 0;
+#endif
+}
+
+/*
+  Where this process's cgroup keeps its memory numbers, from /proc/self/cgroup. Handles v2 (a
+  "0::/path" line) and v1 (a line with a memory controller). Empty if there's no cgroup limit.
+ */
+struct ParCgroupMem {
+  string currentFn, limitFn, statFn, inactiveKey;
+
+  ParCgroupMem()
+  {
+#if defined(__linux__)
+    string cgroups = readSysFile("/proc/self/cgroup");
+    string v1Path, v2Path;
+    bool haveV2 = false;
+    size_t pos = 0;
+    while (pos < cgroups.size()) {
+      size_t eol = cgroups.find('\n', pos);
+      if (eol == string::npos) eol = cgroups.size();
+      string line = cgroups.substr(pos, eol - pos);
+      pos = eol + 1;
+      auto c1 = line.find(':');
+      auto c2 = c1 == string::npos ? string::npos : line.find(':', c1 + 1);
+      if (c2 == string::npos) continue;
+      string controllers = line.substr(c1 + 1, c2 - c1 - 1);
+      string path = line.substr(c2 + 1);
+      if (line.compare(0, 3, "0::") == 0) {
+        haveV2 = true;
+        v2Path = path;
+      }
+      else if (("," + controllers + ",").find(",memory,") != string::npos) {
+        v1Path = path;
+      }
+    }
+    // Inside a container the path is often relative to a cgroup mounted at the root
+    if (!v1Path.empty()) {
+      for (auto dir : {"/sys/fs/cgroup/memory" + v1Path, string("/sys/fs/cgroup/memory")}) {
+        if (useDir(dir, "/memory.limit_in_bytes", "/memory.usage_in_bytes", "total_inactive_file")) return;
+      }
+    }
+    if (haveV2) {
+      for (auto dir : {"/sys/fs/cgroup" + v2Path, string("/sys/fs/cgroup")}) {
+        if (useDir(dir, "/memory.max", "/memory.current", "inactive_file")) return;
+      }
+    }
+#endif
+  }
+
+  bool useDir(string const &dir, char const *limitName, char const *currentName, char const *inactiveName)
+  {
+    string limit = readSysFile(dir + limitName);
+    if (limit.empty()) return false;
+    // "max" in v2, or close to 2^63 in v1, means no limit
+    if (limit.compare(0, 3, "max") == 0 || strtoull(limit.c_str(), nullptr, 10) >= (1ULL << 60)) return true;
+    limitFn = dir + limitName;
+    currentFn = dir + currentName;
+    statFn = dir + "/memory.stat";
+    inactiveKey = inactiveName;
+    return true;
+  }
+};
+
+/*
+  limit is the smaller of physical memory and our cgroup's limit. inUse is how much of that is
+  taken and not easily reclaimed.
+ */
+static void readMemUsage(size_t &limit, size_t &inUse)
+{
+  static ParCgroupMem cg;
+  string meminfo = readSysFile("/proc/meminfo");
+  size_t memTotal = findStatField(meminfo, "MemTotal") * 1024;
+  size_t memAvailable = findStatField(meminfo, "MemAvailable") * 1024;
+  limit = memTotal;
+  inUse = memTotal > memAvailable ? memTotal - memAvailable : 0;
+  if (!cg.limitFn.empty()) {
+    size_t cgLimit = (size_t)strtoull(readSysFile(cg.limitFn).c_str(), nullptr, 10);
+    size_t cgCurrent = (size_t)strtoull(readSysFile(cg.currentFn).c_str(), nullptr, 10);
+    size_t inactive = findStatField(readSysFile(cg.statFn), cg.inactiveKey);
+    if (cgLimit > 0 && (limit == 0 || cgLimit < limit)) {
+      limit = cgLimit;
+      inUse = cgCurrent > inactive ? cgCurrent - inactive : 0;
+    }
+  }
+}
+
+size_t ParTopology::nCpus() const
+{
+  size_t ret = 0;
+  for (auto &it : nodes) {
+    ret += it.cpus.size();
+  }
+  return ret;
+}
+
+string ParTopology::desc() const
+{
+  string ret;
+  for (auto &it : nodes) {
+    if (!ret.empty()) ret += " ";
+    ret += "node" + to_string(it.id) + "=" + fmtCpuList(it.cpus);
+  }
+  return ret;
+}
+
+ParTopology ParTopology::discover()
+{
+  ParTopology ret;
+  auto allowed = getThreadCpus();
+  set< int > allowedSet(allowed.begin(), allowed.end());
+
+#if defined(__linux__)
+  string base = "/sys/devices/system/node";
+  DIR *dir = opendir(base.c_str());
+  if (dir) {
+    while (struct dirent *ent = readdir(dir)) {
+      int id;
+      char extra;
+      if (sscanf(ent->d_name, "node%d%c", &id, &extra) != 1) continue;
+      ParNumaNode node;
+      node.id = id;
+      for (auto cpu : parseCpuList(readSysFile(base + "/" + ent->d_name + "/cpulist"))) {
+        if (allowedSet.empty() || allowedSet.count(cpu)) node.cpus.push_back(cpu);
+      }
+      if (node.cpus.empty()) continue; // memory-only, or none of its CPUs are ours
+
+      string meminfo = readSysFile(base + "/" + ent->d_name + "/meminfo");
+      auto memTotalPos = meminfo.find("MemTotal:");
+      if (memTotalPos != string::npos) {
+        node.memTotal = (size_t)strtoull(meminfo.c_str() + memTotalPos + 9, nullptr, 10) * 1024;
+      }
+      ret.nodes.push_back(node);
+    }
+    closedir(dir);
+  }
+#endif
+
+  if (ret.nodes.empty()) {
+    ParNumaNode node;
+    node.cpus = allowed;
+    if (node.cpus.empty()) {
+      for (int cpu = 0; cpu < (int)max(1U, thread::hardware_concurrency()); cpu++) {
+        node.cpus.push_back(cpu);
+      }
+    }
+    ret.nodes.push_back(node);
+  }
+  sort(ret.nodes.begin(), ret.nodes.end(), [](ParNumaNode const &a, ParNumaNode const &b) { return a.id < b.id; });
+  return ret;
+}
+
+
+// ----------------------------------------------------------------------
+
 ParEngine::ParEngine(size_t _threadsAvail, size_t _memAvail)
   :threadsAvail(_threadsAvail),
-   memAvail(_memAvail)
+   memAvail(_memAvail),
+   topo(ParTopology::discover())
 {
   if (!threadsAvail) {
-    threadsAvail = thread::hardware_concurrency();
+    threadsAvail = topo.nCpus();
   }
+  size_t inUse = 0;
+  readMemUsage(memLimit, inUse);
+  memInUse = inUse;
   if (!memAvail) {
-    memAvail = 4000000000; // 4 GB default
+    memAvail = memLimit ? memLimit / 4 * 3 : 4000000000; // 4 GB if we can't tell
   }
-}
-ParEngine::~ParEngine() {
-  finish();
-}
 
+  // Split memAvail between nodes by their memory, or by CPUs if we don't know that
+  size_t nNodes = topo.nodes.size();
+  double totWeight = 0.0;
+  bool knowMem = true;
+  for (auto &it : topo.nodes) {
+    if (!it.memTotal) knowMem = false;
+  }
+  for (auto &it : topo.nodes) {
+    totWeight += knowMem ? (double)it.memTotal : (double)it.cpus.size();
+  }
+  nodeMemUsed.assign(nNodes, 0);
+  nodeMemAvail.assign(nNodes, 0);
+  for (size_t ni = 0; ni < nNodes; ni++) {
+    auto &it = topo.nodes[ni];
+    double weight = knowMem ? (double)it.memTotal : (double)it.cpus.size();
+    nodeMemAvail[ni] = nNodes == 1 ? memAvail : (size_t)((double)memAvail * weight / totWeight);
+  }
+  nodeInjectQ.resize(nNodes);
+}
 void ParEngine::push(thread &&it) {
   if (verbose) eprintf("ParEngine: start\n");
   pending.emplace_back(std::move(it));
@@ -30,33 +326,785 @@ void ParEngine::finish() {
     pending.front().join();
     pending.pop_front();
   }
+  while (outstanding.load() > 0) {
+    if (runOne()) continue;
+    unique_lock< mutex > lock(mtx);
+    // Poll now and then, in case a job we could help with gets submitted
+    doneCv.wait_for(lock, std::chrono::milliseconds(1), [this]() { return outstanding.load() == 0; });
+  }
+}
+
+
+// ----------------------------------------------------------------------
+
+struct ParTask {
+  std::function< void() > fn;
+  size_t memNeeded;
+  int node;
+};
+
+/*
+  Chase-Lev deque. Only the owning worker calls push and pop, at the bottom. Anyone can steal
+  from the top. When it fills up, push copies it into one twice the size. Old arrays are kept
+  until the worker is destroyed, since a thief may still be reading one.
+ */
+struct ParTaskDeque {
+  struct Array {
+    explicit Array(int64_t _size) : size(_size), buf(new std::atomic< ParTask * >[_size]) {}
+    ~Array() { delete[] buf; }
+    ParTask *get(int64_t i) { return buf[i & (size - 1)].load(std::memory_order_relaxed); }
+    void put(int64_t i, ParTask *x) { buf[i & (size - 1)].store(x, std::memory_order_relaxed); }
+
+    int64_t size;
+    std::atomic< ParTask * > *buf;
+  };
+
+  ParTaskDeque()
+  {
+    old.emplace_back(new Array(256));
+    array.store(old.back().get(), std::memory_order_relaxed);
+  }
+
+  void push(ParTask *x)
+  {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    Array *a = array.load(std::memory_order_relaxed);
+    if (b - t > a->size - 1) {
+      auto bigger = new Array(a->size * 2);
+      for (int64_t i = t; i < b; i++) bigger->put(i, a->get(i));
+      old.emplace_back(bigger);
+      array.store(bigger, std::memory_order_release);
+      a = bigger;
+    }
+    a->put(b, x);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+  }
+
+  ParTask *pop()
+  {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Array *a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    ParTask *x = a->get(b);
+    if (t == b) {
+      // Last one: race thieves for it
+      if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) x = nullptr;
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return x;
+  }
+
+  ParTask *steal()
+  {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) return nullptr;
+    Array *a = array.load(std::memory_order_acquire);
+    ParTask *x = a->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) return nullptr;
+    return x;
+  }
+
+  // Thieves write top and the owner writes bottom, so keep them on separate cache lines. (Padding
+  // rather than alignas, since C++14 new doesn't honor extended alignment.)
+  char pad0[64];
+  std::atomic< int64_t > top { 0 };
+  char pad1[64];
+  std::atomic< int64_t > bottom { 0 };
+  char pad2[64];
+  std::atomic< Array * > array;
+  vector< unique_ptr< Array > > old;
+};
+
+struct ParWorker {
+  ParEngine *owner;
+  size_t index;
+  int node; // index into owner->topo.nodes
+  ParTaskDeque dq;
+  thread thr;
+
+  // For nodeReport
+  std::atomic< size_t > jobsRun { 0 };
+  std::atomic< double > busyTime { 0.0 };
+};
+
+static thread_local ParWorker *curWorker;
+
+ParEngine::~ParEngine() {
+  finish();
+  if (poolStarted.load()) {
+    {
+      unique_lock< mutex > lock(workMtx);
+      stopping = true;
+      workCv.notify_all();
+    }
+    // Other workers may still be trying to steal from w until they've all exited
+    for (auto w : workers) {
+      w->thr.join();
+    }
+    for (auto w : workers) {
+      delete w;
+    }
+    workers.clear();
+  }
+  {
+    unique_lock< mutex > lock(memTrackMtx);
+    stopping = true;
+    memSamplerCv.notify_all();
+  }
+  if (memSampler.joinable()) memSampler.join();
+}
+
+void ParEngine::startPool()
+{
+  unique_lock< mutex > lock(injectMtx);
+  if (poolStarted.load()) return;
+  /*
+    Spread workers over the nodes in proportion to their CPUs. Worker i goes where CPU number
+    i*nCpus/threadsAvail would be if we numbered them node by node.
+   */
+  size_t nCpus = topo.nCpus();
+  for (size_t i = 0; i < threadsAvail; i++) {
+    auto w = new ParWorker();
+    w->owner = this;
+    w->index = i;
+    w->node = 0;
+    size_t pos = i * nCpus / threadsAvail;
+    while (pos >= topo.nodes[w->node].cpus.size()) {
+      pos -= topo.nodes[w->node].cpus.size();
+      w->node++;
+    }
+    workers.push_back(w);
+  }
+  poolStartTime = realtime();
+  for (auto w : workers) {
+    w->thr = thread([this, w]() {
+      if (pinThreads) setThreadCpus(topo.nodes[w->node].cpus);
+      workerMain(w);
+    });
+  }
+  poolStarted.store(true);
+}
+
+void ParEngine::submitFn(size_t memNeeded, std::function< void() > const &fn, int node)
+{
+  if (!poolStarted.load()) startPool();
+  if (node >= (int)topo.nodes.size()) node = -1;
+  auto t = new ParTask { fn, memNeeded, node };
+  outstanding.fetch_add(1);
+  if (memNeeded > 0) {
+    unique_lock< mutex > lock(mtx);
+    if (!admitQ.empty() || !memFits(memNeeded)) {
+      if (verbose) eprintf("ParEngine: queue (%zu + %zu > %zu, in use %zu/%zu)\n",
+                           memUsed, memNeeded, memAvail, memInUse.load(), memLimit);
+      admitQ.push_back(t);
+      return;
+    }
+    takeMem(memNeeded);
+  }
+  makeRunnable(t);
+}
+
+void ParEngine::makeRunnable(ParTask *t)
+{
+  if (curWorker && curWorker->owner == this && (t->node < 0 || t->node == curWorker->node)) {
+    curWorker->dq.push(t);
+  }
+  else if (t->node >= 0) {
+    unique_lock< mutex > lock(injectMtx);
+    nodeInjectQ[t->node].push_back(t);
+  }
+  else {
+    unique_lock< mutex > lock(injectMtx);
+    injectQ.push_back(t);
+  }
+  runnable.fetch_add(1);
+  if (sleepers.load() > 0) {
+    unique_lock< mutex > lock(workMtx);
+    workCv.notify_one();
+  }
+}
+
+/*
+  From the queue for node (if >= 0), else the general queue. With node < -1, from any of them,
+  for when there's nothing closer to do.
+ */
+ParTask *ParEngine::takeInjected(int node)
+{
+  unique_lock< mutex > lock(injectMtx);
+  deque< ParTask * > *q = nullptr;
+  if (node >= 0) {
+    q = &nodeInjectQ[node];
+  }
+  else if (node == -1) {
+    q = &injectQ;
+  }
+  else {
+    for (auto &it : nodeInjectQ) {
+      if (!it.empty()) {
+        q = &it;
+        break;
+      }
+    }
+  }
+  if (!q || q->empty()) return nullptr;
+  auto t = q->front();
+  q->pop_front();
+  return t;
+}
+
+/*
+  In order: our own deque, jobs sent to our node, the general queue, stealing from workers on
+  our node, stealing from anyone, and jobs sent to other nodes.
+ */
+ParTask *ParEngine::takeTask(ParWorker *self)
+{
+  ParTask *t = nullptr;
+  if (self) t = self->dq.pop();
+  if (!t && self) t = takeInjected(self->node);
+  if (!t) t = takeInjected(-1);
+  if (!t && poolStarted.load()) {
+    size_t start = self ? self->index + 1 : 0;
+    for (int pass = self ? 0 : 1; pass < 2 && !t; pass++) {
+      for (size_t i = 0; i < workers.size() && !t; i++) {
+        auto victim = workers[(start + i) % workers.size()];
+        if (victim == self) continue;
+        if (pass == 0 && victim->node != self->node) continue;
+        t = victim->dq.steal();
+      }
+    }
+  }
+  if (!t) t = takeInjected(-2);
+  if (t) runnable.fetch_sub(1);
+  return t;
+}
+
+/*
+  Whether memNeeded fits in the budget, and in real memory as of the last sample. When none of
+  our jobs hold memory, we let it go anyway: waiting wouldn't free anything.
+ */
+bool ParEngine::memFits(size_t memNeeded)
+{
+  if (memUsed + min(memNeeded, memAvail) > memAvail) return false;
+  if (memUsed == 0 || memLimit == 0) return true;
+  return memInUse.load() + memAdmittedSinceSample + memNeeded <= (size_t)(memHighWater * (double)memLimit);
+}
+
+void ParEngine::takeMem(size_t memNeeded)
+{
+  if (verbose) eprintf("ParEngine: Allocate %zu\n", memNeeded);
+  memUsed += memNeeded;
+  memAdmittedSinceSample += memNeeded;
+}
+
+bool ParEngine::tryAllocMem(size_t memNeeded)
+{
+  unique_lock< mutex > lock(mtx);
+  // Jobs already waiting in admitQ go first
+  if (!admitQ.empty() || !memFits(memNeeded)) return false;
+  takeMem(memNeeded);
+  return true;
+}
+
+void ParEngine::releaseMem(size_t memNeeded)
+{
+  if (memNeeded == 0) return;
+  admitWaiting(memNeeded);
+}
+
+// Give back released, then start whatever's waiting for memory that fits now
+void ParEngine::admitWaiting(size_t released)
+{
+  vector< ParTask * > admitted;
+  {
+    unique_lock< mutex > lock(mtx);
+    if (released) {
+      if (verbose) eprintf("ParEngine: Release %zu\n", released);
+      memUsed -= released;
+    }
+    while (!admitQ.empty() && memFits(admitQ.front()->memNeeded)) {
+      takeMem(admitQ.front()->memNeeded);
+      admitted.push_back(admitQ.front());
+      admitQ.pop_front();
+    }
+    readyCv.notify_all(); // for ParEngineRsvs, which may be waiting on different nodes
+  }
+  for (auto it : admitted) makeRunnable(it);
 }
 
-ParEngineRsv::ParEngineRsv(ParEngine *_owner, size_t _memNeeded)
+void ParEngine::runTask(ParTask *t)
+{
+  // Tracking costs a few syscalls, so only for jobs big enough to declare memory
+  ParMemTrack *track = t->memNeeded > 0 ? memTrackBegin("job", t->memNeeded) : nullptr;
+  try {
+    t->fn();
+  }
+  catch (exception &ex) {
+    eprintf("ParEngine: job threw: %s\n", ex.what());
+  }
+  catch (...) {
+    eprintf("ParEngine: job threw a non-exception\n");
+  }
+  if (track) memTrackEnd(track);
+  releaseMem(t->memNeeded);
+  delete t;
+  if (outstanding.fetch_sub(1) == 1) {
+    unique_lock< mutex > lock(mtx);
+    doneCv.notify_all();
+  }
+}
+
+bool ParEngine::runOne()
+{
+  ParWorker *self = (curWorker && curWorker->owner == this) ? curWorker : nullptr;
+  ParTask *t = takeTask(self);
+  if (!t) return false;
+  if (self) {
+    double t0 = realtime();
+    runTask(t);
+    // Only this worker writes its counters
+    self->jobsRun.store(self->jobsRun.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    self->busyTime.store(self->busyTime.load(std::memory_order_relaxed) + realtime() - t0, std::memory_order_relaxed);
+  }
+  else {
+    runTask(t);
+  }
+  return true;
+}
+
+void ParEngine::workerMain(ParWorker *self)
+{
+  curWorker = self;
+  while (true) {
+    if (runOne()) continue;
+    unique_lock< mutex > lock(workMtx);
+    sleepers.fetch_add(1);
+    workCv.wait(lock, [this]() { return runnable.load() > 0 || stopping.load(); });
+    sleepers.fetch_sub(1);
+    if (stopping.load() && runnable.load() == 0) break;
+  }
+  curWorker = nullptr;
+}
+
+// ----------------------------------------------------------------------
+
+ParMemTrack *ParEngine::memTrackBegin(string const &name, size_t estimated)
+{
+  auto t = new ParMemTrack();
+  t->name = name;
+  t->estimated = estimated;
+  t->rssBefore = t->rssPeak = procRss();
+  t->startTime = realtime();
+  unique_lock< mutex > lock(memTrackMtx);
+  if (!memSamplerStarted) {
+    memSamplerStarted = true;
+    memSampler = thread([this]() { memSamplerMain(); });
+  }
+  memTracking.insert(t);
+  if (memTracking.size() == 1) memSamplerCv.notify_all();
+  return t;
+}
+
+ParMemTrack ParEngine::memTrackEnd(ParMemTrack *t)
+{
+  t->rssAfter = procRss();
+  t->endTime = realtime();
+  unique_lock< mutex > lock(memTrackMtx);
+  memTracking.erase(t);
+  t->rssPeak = max(t->rssPeak, t->rssAfter);
+  if (verbose) eprintf("ParEngine: %s estimated %zu, used %zu\n", t->name.c_str(), t->estimated, t->actualPeak());
+  ParMemTrack ret = *t;
+  delete t;
+  memRecords.push_back(ret);
+  while (memRecords.size() > maxMemRecords) memRecords.pop_front();
+  return ret;
+}
+
+void ParEngine::sampleMem()
+{
+  size_t rss = procRss();
+  size_t limit = 0, inUse = 0;
+  readMemUsage(limit, inUse);
+  {
+    unique_lock< mutex > lock(memTrackMtx);
+    for (auto t : memTracking) {
+      t->rssPeak = max(t->rssPeak, rss);
+    }
+  }
+  {
+    unique_lock< mutex > lock(mtx);
+    if (limit) memLimit = limit;
+    memInUse = inUse;
+    memAdmittedSinceSample = 0;
+  }
+  // Things may fit now, if memory was freed or what we'd admitted turned out smaller
+  admitWaiting(0);
+}
+
+// Sample while anything's being tracked. Anything waiting for memory implies something holds it
+void ParEngine::memSamplerMain()
+{
+  unique_lock< mutex > lock(memTrackMtx);
+  while (!stopping.load()) {
+    if (memTracking.empty()) {
+      memSamplerCv.wait(lock, [this]() { return stopping.load() || !memTracking.empty(); });
+      continue;
+    }
+    lock.unlock();
+    sampleMem();
+    lock.lock();
+    memSamplerCv.wait_for(lock, std::chrono::microseconds((long)(memSampleInterval * 1e6)));
+  }
+}
+
+/*
+  Each tracked job's estimate against what it used, and a summary of how far off the estimates
+  tend to be.
+ */
+string ParEngine::memReport()
+{
+  unique_lock< mutex > lock(memTrackMtx);
+  ostringstream s;
+  size_t nOver = 0;
+  double totEstimated = 0.0, totActual = 0.0, worstRatio = 0.0;
+  for (auto &t : memRecords) {
+    double ratio = t.estimated ? (double)t.actualPeak() / (double)t.estimated : 0.0;
+    if (t.actualPeak() > t.estimated) nOver++;
+    totEstimated += (double)t.estimated;
+    totActual += (double)t.actualPeak();
+    worstRatio = max(worstRatio, ratio);
+    s << stringprintf("%s estimated=%0.1fM peak=%0.1fM (%0.0f%%) wall=%0.3f\n",
+                      t.name.c_str(), (double)t.estimated / 1e6, (double)t.actualPeak() / 1e6, ratio * 100.0,
+                      t.endTime - t.startTime);
+  }
+  s << stringprintf("%zu jobs, %zu over estimate, worst %0.0f%%, total estimated=%0.1fM peak=%0.1fM; in use %0.1fM of %0.1fM\n",
+                    memRecords.size(), nOver, worstRatio * 100.0, totEstimated / 1e6, totActual / 1e6,
+                    (double)memInUse.load() / 1e6, (double)memLimit / 1e6);
+  return s.str();
+}
+
+/*
+  State for parallelChunks, shared with helper jobs that might not start until after the caller
+  has returned. They only look at fn after claiming a chunk, and the caller doesn't return until
+  every chunk is accounted for, so fn can live on the caller's stack.
+ */
+struct ParChunkState {
+  std::function< void(size_t) > const *fn;
+  size_t nChunks;
+  std::atomic< size_t > next { 0 };
+  std::atomic< size_t > done { 0 };
+  std::atomic< bool > failed { false };
+  std::exception_ptr err;
+  mutex mtx;
+  condition_variable doneCv;
+
+  // Run chunks until there are none left to claim
+  void work()
+  {
+    while (true) {
+      size_t ci = next.fetch_add(1);
+      if (ci >= nChunks) return;
+      if (!failed.load(std::memory_order_relaxed)) {
+        try {
+          (*fn)(ci);
+        }
+        catch (...) {
+          unique_lock< mutex > lock(mtx);
+          if (!err) err = std::current_exception();
+          failed = true;
+        }
+      }
+      if (done.fetch_add(1) + 1 == nChunks) {
+        unique_lock< mutex > lock(mtx);
+        doneCv.notify_all();
+      }
+    }
+  }
+};
+
+void ParEngine::parallelChunks(size_t nChunks, std::function< void(size_t) > const &fn)
+{
+  if (nChunks == 0) return;
+  if (nChunks == 1 || threadsAvail <= 1) {
+    for (size_t ci = 0; ci < nChunks; ci++) fn(ci);
+    return;
+  }
+  auto st = make_shared< ParChunkState >();
+  st->fn = &fn;
+  st->nChunks = nChunks;
+  size_t nHelpers = min(nChunks, threadsAvail) - 1;
+  for (size_t i = 0; i < nHelpers; i++) {
+    submitFn(0, [st]() { st->work(); });
+  }
+  st->work();
+
+  // Wait for chunks other threads are still working on, helping with other jobs meanwhile
+  while (st->done.load() < nChunks) {
+    if (runOne()) continue;
+    unique_lock< mutex > lock(st->mtx);
+    st->doneCv.wait_for(lock, std::chrono::microseconds(100), [&st, nChunks]() { return st->done.load() == nChunks; });
+  }
+  if (st->err) std::rethrow_exception(st->err);
+}
+
+ParEngine &defaultParEngine()
+{
+  static ParEngine *ret = new ParEngine(); // never destroyed, so it's safe to use from static destructors
+  return *ret;
+}
+
+ParEngineRsv::ParEngineRsv(ParEngine *_owner, size_t _memNeeded, int _node)
   :owner(_owner),
-   memNeeded(_memNeeded)
+   memNeeded(_memNeeded),
+   node(_node)
 {
   if (owner) {
+    if (node >= (int)owner->topo.nodes.size()) node = -1;
     unique_lock< mutex > lock(owner->mtx);
+    auto nodeFull = [this]() {
+      return node >= 0 &&
+        owner->nodeMemUsed[node] + min(memNeeded, owner->nodeMemAvail[node]) > owner->nodeMemAvail[node];
+    };
     while (owner->threadsUsed + 1 > owner->threadsAvail ||
-           owner->memUsed + min(memNeeded, owner->memAvail) > owner->memAvail) {
-      if (owner->verbose) eprintf("ParEngine: wait (%zu + 1 > %zu || %zu + %zu > %zu)\n",
+           !owner->memFits(memNeeded) ||
+           nodeFull()) {
+      if (owner->verbose) eprintf("ParEngine: wait (%zu + 1 > %zu || %zu + %zu > %zu || in use %zu/%zu || node %d full)\n",
                                   owner->threadsUsed, owner->threadsAvail,
-                                  owner->memUsed, memNeeded, owner->memAvail);
-      owner->readyCv.wait(lock);
+                                  owner->memUsed, memNeeded, owner->memAvail,
+                                  owner->memInUse.load(), owner->memLimit, node);
+      // Poll too, since memory can be freed by things that don't tell us
+      owner->readyCv.wait_for(lock, std::chrono::milliseconds(100));
     }
-    if (owner->verbose) eprintf("ParEngine: Allocate %zu\n", memNeeded);
     owner->threadsUsed += 1;
-    owner->memUsed += memNeeded;
+    owner->takeMem(memNeeded);
+    if (node >= 0) owner->nodeMemUsed[node] += memNeeded;
+    lock.unlock();
+
+    if (node >= 0) {
+      oldCpus = getThreadCpus();
+      setThreadCpus(owner->topo.nodes[node].cpus);
+    }
+    track = owner->memTrackBegin(node >= 0 ? "rsv node" + to_string(node) : "rsv", memNeeded);
   }
 }
 
 ParEngineRsv::~ParEngineRsv() {
   if (owner) {
-    unique_lock< mutex > lock(owner->mtx);
-    if (owner->verbose) eprintf("ParEngine: Release %zu\n", memNeeded);
-    owner->threadsUsed -= 1;
-    owner->memUsed -= memNeeded;
-    owner->readyCv.notify_one();
+    owner->memTrackEnd(track);
+    if (node >= 0) setThreadCpus(oldCpus);
+    {
+      unique_lock< mutex > lock(owner->mtx);
+      owner->threadsUsed -= 1;
+      if (node >= 0) owner->nodeMemUsed[node] -= memNeeded;
+    }
+    // Also wakes the others waiting, which may be waiting on different nodes
+    owner->admitWaiting(memNeeded);
+  }
+}
+
+string ParEngine::nodeReport()
+{
+  double elapsed = poolStarted.load() ? realtime() - poolStartTime : 0.0;
+  vector< size_t > nodeWorkers(topo.nodes.size()), nodeJobs(topo.nodes.size());
+  vector< double > nodeBusy(topo.nodes.size());
+  if (poolStarted.load()) {
+    for (auto w : workers) {
+      nodeWorkers[w->node]++;
+      nodeJobs[w->node] += w->jobsRun.load();
+      nodeBusy[w->node] += w->busyTime.load();
+    }
+  }
+  unique_lock< mutex > lock(mtx);
+  string ret;
+  for (size_t ni = 0; ni < topo.nodes.size(); ni++) {
+    auto &node = topo.nodes[ni];
+    double busyFrac = (elapsed > 0.0 && nodeWorkers[ni] > 0) ? nodeBusy[ni] / (elapsed * (double)nodeWorkers[ni]) : 0.0;
+    ret += stringprintf("node%d: cpus %s, %zu workers, %zu jobs, %0.1f%% busy, reserved %0.3f/%0.3f GB\n",
+                        node.id, fmtCpuList(node.cpus).c_str(), nodeWorkers[ni], nodeJobs[ni], busyFrac * 100.0,
+                        (double)nodeMemUsed[ni] / 1e9, (double)nodeMemAvail[ni] / 1e9);
+  }
+  return ret;
+}
+
+
+// ----------------------------------------------------------------------
+
+ParTaskGraph::ParTaskGraph(ParEngine *_engine)
+  :engine(_engine)
+{
+}
+
+size_t ParTaskGraph::add(string const &name, size_t memNeeded, std::function< void() > const &fn,
+                         vector< size_t > const &deps, double cost)
+{
+  size_t id = tasks.size();
+  for (auto dep : deps) {
+    if (dep >= id) throw runtime_error("ParTaskGraph::add: " + name + " depends on a job not added yet");
+  }
+  tasks.emplace_back();
+  auto &t = tasks.back();
+  t.name = name;
+  t.fn = fn;
+  t.memNeeded = memNeeded;
+  t.cost = cost;
+  t.deps = deps;
+  for (auto dep : deps) {
+    tasks[dep].dependents.push_back(id);
+  }
+  return id;
+}
+
+bool ParTaskGraph::readyBefore(size_t a, size_t b) const
+{
+  auto &ta = tasks[a];
+  auto &tb = tasks[b];
+  if (ta.rank != tb.rank) return ta.rank > tb.rank;
+  if (ta.memNeeded != tb.memNeeded) return ta.memNeeded > tb.memNeeded;
+  return a < b;
+}
+
+void ParTaskGraph::pushReady(size_t ti)
+{
+  ready.push_back(ti);
+  push_heap(ready.begin(), ready.end(), [this](size_t a, size_t b) { return readyBefore(b, a); });
+}
+
+/*
+  Start whatever we can, best first. Once a job that needs memory doesn't fit, hold back all the
+  other jobs that need memory until it does.
+ */
+void ParTaskGraph::dispatch(unique_lock< mutex > &lock)
+{
+  auto after = [this](size_t a, size_t b) { return readyBefore(b, a); };
+  vector< size_t > starting, held;
+  bool blocked = false;
+  while (!ready.empty()) {
+    pop_heap(ready.begin(), ready.end(), after);
+    size_t ti = ready.back();
+    ready.pop_back();
+    auto &t = tasks[ti];
+    if (t.memNeeded > 0) {
+      if (blocked || !engine->tryAllocMem(t.memNeeded)) {
+        blocked = true;
+        held.push_back(ti);
+        continue;
+      }
+      memHeld += t.memNeeded;
+    }
+    t.started = true;
+    starting.push_back(ti);
+  }
+  for (auto ti : held) pushReady(ti);
+  if (starting.empty()) return;
+
+  lock.unlock();
+  for (auto ti : starting) {
+    engine->submitFn(0, [this, ti]() {
+      auto &t = tasks[ti];
+      auto track = engine->memTrackBegin(t.name, t.memNeeded);
+      std::exception_ptr err;
+      try {
+        t.fn();
+      }
+      catch (...) {
+        err = std::current_exception();
+      }
+      auto used = engine->memTrackEnd(track);
+      t.startTime = used.startTime;
+      t.endTime = used.endTime;
+      t.rssBefore = used.rssBefore;
+      t.rssPeak = used.rssPeak;
+      t.rssAfter = used.rssAfter;
+      finished(ti, err);
+    });
+  }
+  lock.lock();
+}
+
+void ParTaskGraph::skip(size_t ti)
+{
+  auto &t = tasks[ti];
+  if (t.skipped) return;
+  t.skipped = true;
+  nDone++;
+  for (auto dep : t.dependents) skip(dep);
+}
+
+void ParTaskGraph::finished(size_t ti, std::exception_ptr err)
+{
+  auto &t = tasks[ti];
+  engine->releaseMem(t.memNeeded);
+
+  unique_lock< mutex > lock(mtx);
+  memHeld -= t.memNeeded;
+  nDone++;
+  if (err) {
+    if (engine->verbose) eprintf("ParTaskGraph: %s failed\n", t.name.c_str());
+    if (!firstError) firstError = err;
+    for (auto dep : t.dependents) skip(dep);
+  }
+  else {
+    for (auto dep : t.dependents) {
+      if (--tasks[dep].depsLeft == 0) pushReady(dep);
+    }
+  }
+  dispatch(lock);
+  doneCv.notify_all();
+}
+
+void ParTaskGraph::run()
+{
+  unique_lock< mutex > lock(mtx);
+  nDone = 0;
+  memHeld = 0;
+  firstError = nullptr;
+  ready.clear();
+  // Dependencies always come earlier, so going backwards sees every dependent first
+  for (size_t ti = tasks.size(); ti-- > 0; ) {
+    auto &t = tasks[ti];
+    t.depsLeft = t.deps.size();
+    t.started = t.skipped = false;
+    t.rank = 0.0;
+    for (auto dep : t.dependents) t.rank = max(t.rank, tasks[dep].rank);
+    t.rank += t.cost;
+  }
+  for (size_t ti = 0; ti < tasks.size(); ti++) {
+    if (tasks[ti].depsLeft == 0) pushReady(ti);
+  }
+
+  dispatch(lock);
+  while (nDone < tasks.size()) {
+    lock.unlock();
+    bool ran = engine->runOne();
+    lock.lock();
+    if (!ran && nDone < tasks.size()) {
+      // Wake up now and then in case memory was freed by someone else's jobs
+      doneCv.wait_for(lock, std::chrono::milliseconds(2));
+    }
+    dispatch(lock);
+  }
+  if (firstError) std::rethrow_exception(firstError);
+}
+
+string ParTaskGraph::report() const
+{
+  ostringstream s;
+  for (auto &t : tasks) {
+    s << t.name;
+    if (t.skipped) {
+      s << " skipped\n";
+      continue;
+    }
+    s << stringprintf(" wall=%0.3f mem=%zu rss=%zu->%zu peak=%zu\n", t.wallTime(), t.memNeeded, t.rssBefore, t.rssAfter, t.rssPeak);
   }
+  return s.str();
 }
@@ -2,7 +2,88 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
+#include <future>
 
+struct ParTask;
+struct ParWorker;
+
+/*
+  Which CPUs belong to which NUMA node, read from /sys/devices/system/node. Only the CPUs this
+  process may run on (its affinity mask, which includes any cpuset) are counted, and nodes with
+  none of them are left out. Without sysfs it's one node with all the allowed CPUs.
+*/
+struct ParNumaNode {
+  int id { 0 }; // the kernel's node number
+  vector< int > cpus;
+  size_t memTotal { 0 }; // bytes, 0 if unknown
+};
+
+struct ParTopology {
+  vector< ParNumaNode > nodes;
+
+  size_t nCpus() const;
+  string desc() const;
+
+  static ParTopology discover();
+};
+
+/*
+  What a job actually used, to compare with the memNeeded it claimed. The process's resident
+  memory is sampled while it runs, so with other jobs running at the same time actualPeak is only
+  an upper bound.
+*/
+struct ParMemTrack {
+  string name;
+  size_t estimated { 0 };
+  size_t rssBefore { 0 };
+  size_t rssPeak { 0 };
+  size_t rssAfter { 0 };
+  double startTime { 0.0 };
+  double endTime { 0.0 };
+
+  size_t actualPeak() const { return rssPeak > rssBefore ? rssPeak - rssBefore : 0; }
+};
+
+/*
+  Runs jobs in parallel, subject to a budget of threads and memory.
+
+  The old way is to push(std::thread(...)) and have the thread body take a ParEngineRsv, which
+  blocks until there's a thread slot and enough memory. That makes an OS thread per job.
+
+  The better way is submit(memNeeded, f), which runs f on a persistent pool of threadsAvail
+  workers and returns a future for its result (or exception). A job isn't started until
+  memNeeded fits in the memory budget; jobs waiting for memory are started in the order they
+  were submitted, and don't hold a worker while they wait. Don't take a ParEngineRsv inside a
+  submitted job, since it would block the worker.
+
+  Each worker has a Chase-Lev deque (Chase & Lev, "Dynamic Circular Work-Stealing Deque", SPAA
+  2005, with the C11 memory orderings from Le et al, PPoPP 2013). Jobs submitted from inside a
+  job go on the bottom of the current worker's deque and it pops them LIFO, while idle workers
+  steal FIFO from the top. Jobs submitted from other threads go on a shared queue.
+
+  finish() (and wait(future)) runs queued jobs on the calling thread while it waits, so it's
+  safe to call wait from inside a job. Don't call finish from inside a job, since it waits for
+  that job too.
+
+  On a NUMA machine the workers are split between nodes in proportion to their CPUs, and steal
+  from workers on their own node before going further afield. With pinThreads set (before the
+  first submit) each worker is confined to its node's CPUs, so memory it touches first gets
+  allocated there. A job can be submitted with a node (an index into topo.nodes), and then a
+  worker on that node will run it unless they're all busy and someone else is idle.
+
+  The memory budget is also split between nodes, in proportion to their memory. A ParEngineRsv
+  taken with a node waits for room on that node as well as overall, and keeps the calling thread
+  on that node's CPUs until it's released.
+
+  Since memNeeded is only a guess, we also watch real memory. memLimit is the smaller of physical
+  memory and the cgroup's limit, and memInUse is the cgroup's usage less inactive page cache (or,
+  without a cgroup limit, physical memory less what the kernel says is available). It's sampled
+  every memSampleInterval while jobs that need memory are running. A job that would take
+  memInUse (plus anything admitted since the last sample) over memHighWater * memLimit waits,
+  even if it fits in the budget, unless none of our jobs are holding memory. memAvail defaults
+  to 3/4 of memLimit. memReport() compares each job's estimate with what it used.
+*/
 struct ParEngine {
 
   explicit ParEngine(size_t _threadsAvail = 0, size_t _memAvail = 0);
@@ -15,6 +96,60 @@ struct ParEngine {
   void push(thread &&it);
   void finish();
 
+  template<typename F>
+  auto submit(size_t memNeeded, F &&f, int node = -1) -> std::future< decltype(f()) >
+  {
+    using R = decltype(f());
+    auto job = make_shared< std::packaged_task< R() > >(std::forward< F >(f));
+    auto ret = job->get_future();
+    submitFn(memNeeded, [job]() { (*job)(); }, node);
+    return ret;
+  }
+
+  template<typename F>
+  auto submit(F &&f) -> std::future< decltype(f()) >
+  {
+    return submit(0, std::forward< F >(f));
+  }
+
+  // Run other jobs until fut is ready
+  template<typename T>
+  void wait(std::future< T > &fut)
+  {
+    while (fut.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      if (!runOne()) fut.wait_for(std::chrono::microseconds(100));
+    }
+  }
+
+  /*
+    Queue fn without a future. If it throws, the exception is reported with eprintf and
+    swallowed, so the job still counts as finished and its memory is released. Use submit if
+    the caller needs to see it.
+  */
+  void submitFn(size_t memNeeded, std::function< void() > const &fn, int node = -1);
+  bool runOne(); // Run one queued job on this thread, if there is one
+
+  /*
+    Run fn(0) .. fn(nChunks-1) across the pool and the calling thread, and return when they're
+    all done. Rather than a job per chunk, it starts up to threadsAvail-1 helper jobs which, like
+    the caller, take the next chunk index until there are none left. If fn throws, chunks not
+    yet started are skipped and the first exception is rethrown here. See parallel_for.
+  */
+  void parallelChunks(size_t nChunks, std::function< void(size_t) > const &fn);
+
+  // Take memNeeded from the budget without waiting, or return false. For other schedulers
+  bool tryAllocMem(size_t memNeeded);
+  void releaseMem(size_t memNeeded);
+
+  // Measure a job between these. memTrackEnd returns the final numbers
+  ParMemTrack *memTrackBegin(string const &name, size_t estimated);
+  ParMemTrack memTrackEnd(ParMemTrack *t);
+  void sampleMem();
+  string memReport();
+
+  // Per node: CPUs, workers, jobs run, how busy the workers were, reserved memory
+  string nodeReport();
+
   mutex mtx;
   condition_variable readyCv;
   size_t threadsUsed { 0 };
@@ -22,13 +157,149 @@ struct ParEngine {
   size_t memUsed { 0 };
   size_t memAvail { 0 };
   bool verbose { false };
+  bool pinThreads { false };
+
+  ParTopology topo;
+  vector< size_t > nodeMemUsed; // protected by mtx
+  vector< size_t > nodeMemAvail;
+
+  size_t memLimit { 0 }; // 0 if unknown
+  std::atomic< size_t > memInUse { 0 };
+  size_t memAdmittedSinceSample { 0 }; // protected by mtx
+  double memHighWater { 0.9 };
+  double memSampleInterval { 0.01 };
+
+  mutex memTrackMtx;
+  condition_variable memSamplerCv; // with memTrackMtx
+  set< ParMemTrack * > memTracking; // running
+  deque< ParMemTrack > memRecords; // finished, the last maxMemRecords of them
+  size_t maxMemRecords { 10000 };
+  bool memSamplerStarted { false };
+  thread memSampler;
 
   deque< thread > pending;
 
+  // The pool, started by the first submit
+  vector< ParWorker * > workers; // Don't look at it until poolStarted
+  std::atomic< bool > poolStarted { false };
+  mutex injectMtx;
+  deque< ParTask * > injectQ; // from threads outside the pool
+  vector< deque< ParTask * > > nodeInjectQ; // for a particular node, from anywhere else
+  deque< ParTask * > admitQ; // waiting for memory, protected by mtx
+  condition_variable doneCv; // with mtx, when outstanding drops to 0
+  std::atomic< size_t > outstanding { 0 }; // submitted and not finished
+  std::atomic< size_t > runnable { 0 }; // in a deque or injectQ
+  mutex workMtx;
+  condition_variable workCv;
+  std::atomic< int > sleepers { 0 };
+  std::atomic< bool > stopping { false };
+  double poolStartTime { 0.0 };
+
+private:
+  friend struct ParEngineRsv;
+  void startPool();
+  bool memFits(size_t memNeeded); // with mtx held
+  void takeMem(size_t memNeeded); // with mtx held
+  void admitWaiting(size_t released);
+  void memSamplerMain();
+  void makeRunnable(ParTask *t);
+  void runTask(ParTask *t);
+  ParTask *takeTask(ParWorker *self);
+  ParTask *takeInjected(int node);
+  void workerMain(ParWorker *self);
 };
 
+// Shared by everything that doesn't bring its own engine. One thread per core, default memory
+ParEngine &defaultParEngine();
+
+/*
+  Run fn(lo, hi) over [begin, end) split into chunks of grain (the last may be shorter), in
+  parallel on pe (or defaultParEngine()). A range of one chunk or less runs inline. Choose grain
+  so a chunk is at least some tens of microseconds of work.
+
+  Example: {
+    parallel_for(0, xs.size(), 10000, [&](size_t lo, size_t hi) {
+      for (size_t i = lo; i < hi; i++) ys[i] = f(xs[i]);
+    });
+  }
+*/
+template<typename F>
+void parallel_for(size_t begin, size_t end, size_t grain, F const &fn, ParEngine *pe = nullptr)
+{
+  if (end <= begin) return;
+  if (grain < 1) grain = 1;
+  size_t nChunks = (end - begin + grain - 1) / grain;
+  if (nChunks <= 1) {
+    fn(begin, end);
+    return;
+  }
+  if (!pe) pe = &defaultParEngine();
+  pe->parallelChunks(nChunks, [&](size_t ci) {
+    size_t lo = begin + ci * grain;
+    fn(lo, min(end, lo + grain));
+  });
+}
+
+/*
+  Compute map(lo, hi) for each chunk of [begin, end), as with parallel_for, and fold the results
+  together with combine, starting from identity.
+
+  With ordered, the results are combined left to right in chunk order once they're all done.
+  Since the chunks depend only on grain, the answer is bitwise the same however many threads
+  there are, which matters for floating-point sums. Otherwise each result is combined in as soon
+  as its chunk is done, in whatever order that happens, so combine had better be commutative.
+*/
+template<typename T, typename Map, typename Combine>
+T parallel_reduce(size_t begin, size_t end, size_t grain, T const &identity, Map const &map, Combine const &combine,
+                  bool ordered = true, ParEngine *pe = nullptr)
+{
+  if (end <= begin) return identity;
+  if (grain < 1) grain = 1;
+  size_t nChunks = (end - begin + grain - 1) / grain;
+  if (nChunks <= 1) return combine(identity, map(begin, end));
+  if (!pe) pe = &defaultParEngine();
+
+  if (ordered) {
+    deque< T > partials(nChunks, identity); // not vector, which packs bools into shared words
+    pe->parallelChunks(nChunks, [&](size_t ci) {
+      size_t lo = begin + ci * grain;
+      partials[ci] = map(lo, min(end, lo + grain));
+    });
+    T ret = identity;
+    for (auto &it : partials) {
+      ret = combine(ret, it);
+    }
+    return ret;
+  }
+  else {
+    mutex retMtx;
+    T ret = identity;
+    pe->parallelChunks(nChunks, [&](size_t ci) {
+      size_t lo = begin + ci * grain;
+      T part = map(lo, min(end, lo + grain));
+      unique_lock< mutex > lock(retMtx);
+      ret = combine(ret, part);
+    });
+    return ret;
+  }
+}
+
+template<typename T, typename F>
+void parallel_for(vector< T > const &a, size_t grain, F const &fn, ParEngine *pe = nullptr)
+{
+  parallel_for(0, a.size(), grain, fn, pe);
+}
+
+template<typename T, typename R, typename Map, typename Combine>
+R parallel_reduce(vector< T > const &a, size_t grain, R const &identity, Map const &map, Combine const &combine,
+                  bool ordered = true, ParEngine *pe = nullptr)
+{
+  return parallel_reduce(0, a.size(), grain, identity, map, combine, ordered, pe);
+}
+
 struct ParEngineRsv {
-  explicit ParEngineRsv(ParEngine *_owner, size_t _memNeeded);
+  // With a node (an index into owner->topo.nodes) the memory comes from that node's share
+  explicit ParEngineRsv(ParEngine *_owner, size_t _memNeeded, int _node = -1);
   ~ParEngineRsv();
   ParEngineRsv(ParEngineRsv const &) = delete;
   ParEngineRsv(ParEngineRsv &&) = delete;
@@ -37,5 +308,88 @@ struct ParEngineRsv {
 
   ParEngine *owner;
   size_t memNeeded;
+  int node;
+  vector< int > oldCpus; // to put back when we're done
+  ParMemTrack *track { nullptr };
+
+};
+
+/*
+  A graph of jobs with dependencies, run on a ParEngine's pool. A job starts once everything it
+  depends on has finished and its memNeeded fits in the engine's memory budget.
+
+  Among the jobs that are ready, the one with the longest chain of work still hanging off it
+  (by the cost estimates given to add, default 1) goes first, then the one needing the most
+  memory. If that job doesn't fit in memory yet, nothing else that needs memory is started ahead
+  of it, so big jobs can't be starved by a stream of small ones. Jobs needing no memory still run.
+
+  If a job throws, the jobs depending on it (directly or not) are skipped, the rest carry on, and
+  run() rethrows the first exception at the end.
+
+  For each job we record when it started and finished, and the process's resident memory before,
+  after, and at its peak (sampled by the engine). That's process-wide, so with jobs running
+  concurrently it's only an upper bound. report() prints it all.
+
+  Example: {
+    ParTaskGraph g(&pe);
+    auto fit = g.add("fit", 2e9, [&]() { ... });
+    auto ser = g.add("serialize", 1e8, [&]() { ... }, {fit});
+    g.add("compress", 5e8, [&]() { ... }, {ser});
+    g.run();
+  }
+*/
+struct ParGraphTask {
+  string name;
+  std::function< void() > fn;
+  size_t memNeeded { 0 };
+  double cost { 1.0 };
+  vector< size_t > deps;
+  vector< size_t > dependents;
+
+  // Filled in by run
+  size_t depsLeft { 0 };
+  double rank { 0.0 }; // cost plus the biggest rank of anything depending on this
+  bool started { false };
+  bool skipped { false };
+  double startTime { 0.0 };
+  double endTime { 0.0 };
+  size_t rssBefore { 0 };
+  size_t rssPeak { 0 };
+  size_t rssAfter { 0 };
+
+  double wallTime() const { return endTime - startTime; }
+};
+
+struct ParTaskGraph {
+  explicit ParTaskGraph(ParEngine *_engine);
+  ParTaskGraph(ParTaskGraph const &) = delete;
+  ParTaskGraph(ParTaskGraph &&) = delete;
+  ParTaskGraph operator = (ParTaskGraph const &) = delete;
+  ParTaskGraph operator = (ParTaskGraph &&) = delete;
+
+  // Returns an id to use in other jobs' deps, which must already have been added
+  size_t add(string const &name, size_t memNeeded, std::function< void() > const &fn,
+             vector< size_t > const &deps = vector< size_t >(), double cost = 1.0);
+
+  // Run everything and wait for it. Throws the first exception any job threw
+  void run();
+
+  string report() const;
+
+  ParEngine *engine;
+  vector< ParGraphTask > tasks;
+
+  mutex mtx;
+  condition_variable doneCv;
+  vector< size_t > ready; // heap, ordered by readyBefore
+  size_t nDone { 0 };
+  size_t memHeld { 0 }; // of the engine's budget, by our running jobs
+  std::exception_ptr firstError;
 
+private:
+  bool readyBefore(size_t a, size_t b) const;
+  void pushReady(size_t ti);
+  void dispatch(unique_lock< mutex > &lock);
+  void finished(size_t ti, std::exception_ptr err);
+  void skip(size_t ti);
 };
@@ -95,6 +95,189 @@ void uvWork(uv_loop_t *loop,
 
 
 
+// ----------------------------------------------------------------------
+
+struct UvWorkPoolItem {
+  U64 id;
+  int priority;
+  std::function< void(string &error, shared_ptr< void > &result) > body;
+  std::function< void(string const &error, shared_ptr< void > const &result) > done;
+  string error;
+  shared_ptr< void > result;
+};
+
+/*
+  Shared with the jobs on the engine, which can outlive the UvWorkPool if the engine isn't ours.
+  Each work() submits one job, which runs whichever item is best when it gets to run.
+ */
+struct UvWorkPoolState {
+  std::mutex mtx;
+  bool closed {false};
+  U64 nextId {1};
+  map< pair< int, U64 >, UvWorkPoolItem * > pending; // by (-priority, id)
+  map< U64, int > pendingPriority; // id to priority, for cancel
+  vector< UvWorkPoolItem * > completed;
+  uv_async_t *async {nullptr};
+
+  ~UvWorkPoolState()
+  {
+    for (auto &it : pending) delete it.second;
+    for (auto it : completed) delete it;
+  }
+
+  // With mtx held. Wake the loop only if it hasn't already been woken for this batch
+  void complete(UvWorkPoolItem *item)
+  {
+    if (closed) {
+      delete item;
+      return;
+    }
+    completed.push_back(item);
+    if (completed.size() == 1) {
+      int rc = uv_async_send(async);
+      if (rc < 0) eprintf("UvWorkPool: uv_async_send: %s\n", uv_strerror(rc));
+    }
+  }
+
+  void runNext()
+  {
+    std::unique_lock< std::mutex > lock(mtx);
+    if (closed || pending.empty()) return;
+    auto item = pending.begin()->second;
+    pending.erase(pending.begin());
+    pendingPriority.erase(item->id);
+    lock.unlock();
+
+    try {
+      item->body(item->error, item->result);
+    } catch(exception const &ex) {
+      eprintf("UvWorkPool: caught exception %s\n", ex.what());
+      item->error = ex.what();
+    } catch(...) {
+      eprintf("UvWorkPool: caught non-exception\n");
+      item->error = "UvWorkPool: body threw a non-exception";
+    };
+
+    lock.lock();
+    complete(item);
+  }
+};
+
+UvWorkPool::UvWorkPool(uv_loop_t *_loop, size_t threadsAvail)
+  :loop(_loop),
+   ownEngine(new ParEngine(threadsAvail)),
+   state(make_shared< UvWorkPoolState >())
+{
+  engine = ownEngine.get();
+  async_init();
+}
+
+UvWorkPool::UvWorkPool(uv_loop_t *_loop, ParEngine *_engine)
+  :loop(_loop),
+   engine(_engine),
+   state(make_shared< UvWorkPoolState >())
+{
+  async_init();
+}
+
+UvWorkPool::~UvWorkPool()
+{
+  {
+    std::unique_lock< std::mutex > lock(state->mtx);
+    for (auto &it : state->pending) delete it.second;
+    state->pending.clear();
+    state->pendingPriority.clear();
+  }
+  ownEngine = nullptr; // waits for running bodies
+  {
+    std::unique_lock< std::mutex > lock(state->mtx);
+    state->closed = true;
+  }
+  uv_close(reinterpret_cast<uv_handle_t *>(async), [](uv_handle_t *async1) {
+    delete reinterpret_cast<uv_async_t *>(async1);
+  });
+}
+
+void UvWorkPool::async_init()
+{
+  async = new uv_async_t {};
+  async->data = this;
+  int rc = uv_async_init(loop, async, [](uv_async_t *req) {
+    auto self = reinterpret_cast<UvWorkPool *>(req->data);
+    // A done callback may destroy the pool. Then state (which we keep alive here) is closed,
+    // and we mustn't touch self again.
+    auto st = self->state;
+    vector< UvWorkPoolItem * > batch;
+    {
+      std::unique_lock< std::mutex > lock(st->mtx);
+      batch.swap(st->completed);
+    }
+    for (size_t bi = 0; bi < batch.size(); bi++) {
+      auto item = batch[bi];
+      self->outstanding--;
+      if (self->outstanding == 0) uv_unref(reinterpret_cast<uv_handle_t *>(self->async));
+      auto done = std::move(item->done);
+      auto error = std::move(item->error);
+      auto result = std::move(item->result);
+      delete item;
+      done(error, result);
+
+      std::unique_lock< std::mutex > lock(st->mtx);
+      if (st->closed) {
+        // Like the rest of the unfinished work, these get dropped without calling done
+        for (size_t bj = bi + 1; bj < batch.size(); bj++) delete batch[bj];
+        return;
+      }
+    }
+  });
+  if (rc < 0) throw uv_error("uv_async_init", rc);
+  state->async = async;
+  // Only keep the loop alive while there's work outstanding
+  uv_unref(reinterpret_cast<uv_handle_t *>(async));
+}
+
+U64 UvWorkPool::work(std::function< void(string &error, shared_ptr< void > &result) > const &body,
+                     std::function< void(string const &error, shared_ptr< void > const &result) > const &done,
+                     int priority)
+{
+  auto item = new UvWorkPoolItem { 0, priority, body, done, string(), nullptr };
+  U64 id;
+  {
+    std::unique_lock< std::mutex > lock(state->mtx);
+    id = item->id = state->nextId++;
+    state->pending[make_pair(-priority, id)] = item;
+    state->pendingPriority[id] = priority;
+  }
+  if (outstanding++ == 0) uv_ref(reinterpret_cast<uv_handle_t *>(async));
+  auto st = state;
+  engine->submitFn(0, [st]() { st->runNext(); });
+  return id;
+}
+
+bool UvWorkPool::cancel(U64 id)
+{
+  std::unique_lock< std::mutex > lock(state->mtx);
+  auto prioIt = state->pendingPriority.find(id);
+  if (prioIt == state->pendingPriority.end()) return false;
+  auto pendingIt = state->pending.find(make_pair(-prioIt->second, id));
+  auto item = pendingIt->second;
+  state->pending.erase(pendingIt);
+  state->pendingPriority.erase(prioIt);
+  item->error = string("UvWorkPool: ") + uv_strerror(UV_ECANCELED);
+  // The engine job that would have run it will find nothing to do, or someone else's item
+  state->complete(item);
+  return true;
+}
+
+U64 uvWork(UvWorkPool &pool,
+    std::function< void(string &error, shared_ptr< void > &result) > const &body,
+    std::function< void(string const &error, shared_ptr< void > const &result) > const &done,
+    int priority)
+{
+  return pool.work(body, done, priority);
+}
+
+
 UvAsyncQueue::UvAsyncQueue(uv_loop_t *_loop)
   :loop(_loop)
 {
@@ -106,6 +289,13 @@ UvAsyncQueue::~UvAsyncQueue()
   uv_close(reinterpret_cast<uv_handle_t *>(async), [](uv_handle_t *async1) {
     delete reinterpret_cast<uv_async_t *>(async1);
   });
+  drain(false);
+  auto item = freeItems.exchange(nullptr);
+  while (item) {
+    auto next = item->next;
+    delete item;
+    item = next;
+  }
 }
 
 void UvAsyncQueue::async_init()
@@ -114,24 +304,96 @@ void UvAsyncQueue::async_init()
   async->data = this;
   int rc = uv_async_init(loop, async, [](uv_async_t *req) {
     auto self = reinterpret_cast<UvAsyncQueue *>(req->data);
-    while (true) {
-      std::unique_lock< std::mutex > lock(self->workQueueMutex);
-      if (self->workQueue.empty()) break;
-      auto f = self->workQueue.front();
-      self->workQueue.pop_front();
-      lock.unlock();
-      f();
-    }
+    // Anything pushed while this runs sends another wakeup, so it gets the next time around
+    self->drain(true);
   });
   if (rc < 0) throw uv_error("uv_async_init", rc);
 }
 
-void UvAsyncQueue::push(std::function< void() > const &f)
+/*
+  Items cached by this thread, from any queue's free list. Only the loop thread pushes onto a
+  free list and pushers only ever take the whole thing, so there's no ABA problem.
+ */
+struct UvAsyncQueueItemCache {
+  UvAsyncQueueItem *items {nullptr};
+
+  ~UvAsyncQueueItemCache()
+  {
+    while (items) {
+      auto next = items->next;
+      delete items;
+      items = next;
+    }
+  }
+};
+static thread_local UvAsyncQueueItemCache uvAsyncQueueItemCache;
+
+UvAsyncQueueItem *UvAsyncQueue::allocItem()
+{
+  auto &cache = uvAsyncQueueItemCache;
+  if (!cache.items && freeItems.load(std::memory_order_relaxed)) {
+    cache.items = freeItems.exchange(nullptr, std::memory_order_acquire);
+  }
+  if (!cache.items) return new UvAsyncQueueItem();
+  auto item = cache.items;
+  cache.items = item->next;
+  item->next = nullptr;
+  return item;
+}
+
+void UvAsyncQueue::pushItem(UvAsyncQueueItem *item)
+{
+  auto old = head.load(std::memory_order_relaxed);
+  do {
+    item->next = old;
+  } while (!head.compare_exchange_weak(old, item, std::memory_order_release, std::memory_order_relaxed));
+  /*
+    If it was empty, the loop has taken (or will take) everything before us, and needs waking
+    for this. Otherwise whoever made it non-empty has woken it, and it hasn't taken the list yet.
+   */
+  if (!old) {
+    int rc = uv_async_send(async);
+    if (rc < 0) throw uv_error("uv_async_send", rc);
+  }
+}
+
+size_t UvAsyncQueue::drain(bool call)
 {
-  std::unique_lock< std::mutex > lock(workQueueMutex);
-  workQueue.push_back(f);
-  int rc = uv_async_send(async);
-  if (rc < 0) throw uv_error("uv_async_send", rc);
+  auto batch = head.exchange(nullptr, std::memory_order_acquire);
+  // It's newest first, so reverse it
+  UvAsyncQueueItem *todo = nullptr;
+  while (batch) {
+    auto next = batch->next;
+    batch->next = todo;
+    todo = batch;
+    batch = next;
+  }
+  size_t n = 0;
+  UvAsyncQueueItem *used = nullptr, *usedLast = nullptr;
+  std::exception_ptr err;
+  while (todo) {
+    auto item = todo;
+    todo = todo->next;
+    try {
+      item->run(item, call);
+    }
+    catch (...) {
+      if (!err) err = std::current_exception();
+    }
+    item->run = nullptr;
+    item->next = used;
+    used = item;
+    if (!usedLast) usedLast = item;
+    n++;
+  }
+  if (used) {
+    auto old = freeItems.load(std::memory_order_relaxed);
+    do {
+      usedLast->next = old;
+    } while (!freeItems.compare_exchange_weak(old, used, std::memory_order_release, std::memory_order_relaxed));
+  }
+  if (err) std::rethrow_exception(err);
+  return n;
 }
 
 
@@ -142,9 +404,12 @@ struct UvWriteActive {
   ~UvWriteActive();
   void push(string const &it);
   void push(char const *data, size_t len);
+  void push(packet_chain const &it);
 
   std::function< void(int) > cb;
   vector< uv_buf_t > bufs;
+  vector< char * > owned; // The bufs we malloced
+  packet_chain chain; // Keeps the segments alive until the write completes
 };
 
 UvWriteActive::UvWriteActive(std::function< void(int) > const &_cb)
@@ -156,8 +421,8 @@ UvWriteActive::UvWriteActive(std::function< void(int) > const &_cb)
 UvWriteActive::~UvWriteActive()
 {
   if (0) eprintf("UvWriteActive delete %p\n", this);
-  for (auto &bufit: bufs) {
-    free(bufit.base);
+  for (auto it: owned) {
+    free(it);
   }
 }
 
@@ -168,6 +433,7 @@ void UvWriteActive::push(string const &it)
   buf.base = reinterpret_cast<char *>(malloc(it.size()));
   memcpy(buf.base, it.data(), it.size());
   bufs.push_back(buf);
+  owned.push_back(buf.base);
 }
 
 void UvWriteActive::push(char const *data, size_t len)
@@ -177,6 +443,21 @@ void UvWriteActive::push(char const *data, size_t len)
   buf.base = reinterpret_cast<char *>(malloc(len));
   memcpy(buf.base, data, len);
   bufs.push_back(buf);
+  owned.push_back(buf.base);
+}
+
+void UvWriteActive::push(packet_chain const &it)
+{
+  size_t firstNew = chain.segs.size();
+  chain.add_chain(it);
+  for (size_t segi = firstNew; segi < chain.segs.size(); segi++) {
+    auto &seg = chain.segs[segi];
+    if (seg.remaining() <= 0) continue;
+    uv_buf_t buf {};
+    buf.len = seg.remaining();
+    buf.base = const_cast< char * >(reinterpret_cast< char const * >(seg.rd_ptr()));
+    bufs.push_back(buf);
+  }
 }
 
 
@@ -342,6 +623,169 @@ void UvStream::write(vector< string > const &data, std::function< void(int) > co
   if (rc < 0) throw uv_error("uv_write", rc);
 }
 
+/*
+  Writes the segments straight from the packets, without copying. If the chain has an open
+  tail, it gets shared too, so appending more to it afterwards will copy it instead.
+*/
+void UvStream::write(packet_chain const &data, std::function< void(int) > const &_write_cb)
+{
+  int rc;
+  assert(stream && (stream->type == UV_TCP || stream->type == UV_NAMED_PIPE || stream->type == UV_TTY));
+  auto act = new UvWriteActive(_write_cb);
+  act->push(data);
+  auto req = new uv_write_t {};
+  req->data = act;
+
+  rc = uv_write(req, stream, act->bufs.data(), act->bufs.size(), [](uv_write_t* req1, int status) {
+    auto act1 = reinterpret_cast<UvWriteActive *>(req1->data);
+    act1->cb(status);
+    delete act1;
+    delete req1;
+  });
+  if (rc < 0) {
+    // The callback never runs, so nothing else will free these (or drop the segment refs)
+    delete act;
+    delete req;
+    throw uv_error("uv_write", rc);
+  }
+}
+
+
+// ----------------------------------------------------------------------
+
+PacketStream::PacketStream(UvStream *_stream)
+  :stream(_stream)
+{
+}
+
+PacketStream::~PacketStream()
+{
+}
+
+void PacketStream::read_start(std::function< void(packet &rx) > const &_packet_cb,
+                              std::function< void(int status) > const &_error_cb)
+{
+  packet_cb = _packet_cb;
+  error_cb = _error_cb;
+  reading = true;
+  stream->read_start(
+    [this](size_t suggested_size, uv_buf_t *buf) {
+      alloc_rx(buf);
+    },
+    [this](ssize_t nread, uv_buf_t const *buf) {
+      got_rx(nread);
+    });
+}
+
+void PacketStream::read_stop()
+{
+  if (!reading) return;
+  reading = false;
+  stream->read_stop();
+}
+
+/*
+  Point libuv at the free space after rx_buf's wr_pos. If there's a partial frame left over and
+  we can't append to the same buffer (because a packet we delivered still shares it, or it's
+  full), copy just the partial frame into a new one.
+
+  For a frame bigger than read_size, ask for no more than we already have of it, so the buffer
+  doubles as data actually arrives. A peer that sends just a length word costs us read_size.
+ */
+void PacketStream::alloc_rx(uv_buf_t *buf)
+{
+  size_t leftover = (size_t)rx_buf.remaining();
+  size_t missing = rx_need > leftover ? rx_need - leftover : size_t(0);
+  size_t want = max(read_size, min(missing, leftover));
+  bool shared = rx_buf.contents && rx_buf.contents->refcnt.load(std::memory_order_acquire) > 1;
+
+  if (leftover == 0) {
+    if (shared) {
+      rx_buf = packet(want);
+    } else {
+      rx_buf.clear();
+    }
+  }
+  else if (shared || !rx_buf.contents || rx_buf.wr_pos + want > rx_buf.contents->alloc) {
+    packet fresh(leftover + want);
+    fresh.add_bytes(rx_buf.rd_ptr(), leftover);
+    rx_buf = std::move(fresh);
+  }
+  rx_buf.reserve(rx_buf.wr_pos + want);
+  buf->base = reinterpret_cast< char * >(rx_buf.wr_ptr());
+  buf->len = want;
+}
+
+void PacketStream::got_rx(ssize_t nread)
+{
+  if (nread < 0) {
+    read_stop();
+    if (error_cb) error_cb((int)nread);
+    return;
+  }
+  rx_buf.wr_pos += (size_t)nread;
+
+  while (reading && rx_buf.remaining() >= (ssize_t)sizeof(u_int)) {
+    u_int len;
+    memcpy(&len, rx_buf.rd_ptr(), sizeof(len));
+    if (len > max_frame) {
+      read_stop();
+      if (error_cb) error_cb(UV_EPROTO);
+      return;
+    }
+    if (rx_buf.remaining() < (ssize_t)(sizeof(len) + len)) {
+      rx_need = sizeof(len) + len;
+      return;
+    }
+    packet rx = rx_buf.get_pkt();
+    packet_cb(rx);
+  }
+  rx_need = 0;
+}
+
+void PacketStream::write(packet const &tx)
+{
+  packet_chain frames;
+  frames.add_pkt(tx);
+  send(frames);
+}
+
+void PacketStream::write_batch(vector< packet > const &txs)
+{
+  if (txs.empty()) return;
+  packet_chain frames;
+  for (auto &it : txs) {
+    frames.add_pkt(it);
+  }
+  send(frames);
+}
+
+void PacketStream::send(packet_chain const &frames)
+{
+  size_t n = frames.size();
+  // The write callback never runs synchronously, so it's safe to count after a successful write
+  stream->write(frames, [this, n](int status) {
+    queued -= n;
+    if (status < 0 && error_cb) error_cb(status);
+    if (over_water && queued <= low_water) {
+      over_water = false;
+      if (backpressure_cb) backpressure_cb(false);
+    }
+  });
+  queued += n;
+  if (!over_water && queued > high_water) {
+    over_water = true;
+    if (backpressure_cb) backpressure_cb(true);
+  }
+}
+
+void PacketStream::set_watermarks(size_t _low_water, size_t _high_water, std::function< void(bool over) > const &_backpressure_cb)
+{
+  low_water = _low_water;
+  high_water = _high_water;
+  backpressure_cb = _backpressure_cb;
+}
+
 void UvStream::tcp_connect(struct sockaddr const *addr, std::function< void(int) > const &_connect_cb)
 {
   int rc;
@@ -571,7 +1015,8 @@ UvProcess::UvProcess(uv_loop_t *_loop,
   UvStream *stdin_pipe,
   UvStream *stdout_pipe,
   UvStream *stderr_pipe,
-  std::function<void(int64_t exit_status, int term_signal)> _exit_cb)
+  std::function<void(int64_t exit_status, int term_signal)> _exit_cb,
+  vector< int > const &extra_fds)
  :loop(_loop),
  exit_cb(_exit_cb)
 {
@@ -623,7 +1068,7 @@ UvProcess::UvProcess(uv_loop_t *_loop,
   assert(envi == fullEnv.size()+1);
   opt.flags = 0;
 
-  uv_stdio_container_t stdio[3];
+  vector< uv_stdio_container_t > stdio(3 + extra_fds.size());
   if (stdin_pipe) {
     stdin_pipe->pipe_init();
     stdio[0].flags = static_cast< uv_stdio_flags >(UV_CREATE_PIPE|UV_READABLE_PIPE);
@@ -651,8 +1096,12 @@ UvProcess::UvProcess(uv_loop_t *_loop,
     stdio[2].flags = static_cast< uv_stdio_flags >(UV_INHERIT_FD);
     stdio[2].data.fd = 2;
   }
-  opt.stdio_count = 3;
-  opt.stdio = stdio;
+  for (size_t fdi = 0; fdi < extra_fds.size(); fdi++) {
+    stdio[3 + fdi].flags = static_cast< uv_stdio_flags >(UV_INHERIT_FD);
+    stdio[3 + fdi].data.fd = extra_fds[fdi];
+  }
+  opt.stdio_count = (int)stdio.size();
+  opt.stdio = stdio.data();
 
   proc.data = this;
   rc = uv_spawn(loop, &proc, &opt);
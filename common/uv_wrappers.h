@@ -1,5 +1,6 @@
 #pragma once
 #include <uv.h>
+#include "./parengine.h"
 
 runtime_error uv_error(string const &context, int rc);
 
@@ -21,10 +22,88 @@ void uvWork(uv_loop_t *loop,
     std::function< void(string &error, shared_ptr< void > &result) > const &body,
     std::function< void(string const &error, shared_ptr< void > const &result) > const &done);
 
+/*
+  Like uvWork, but the bodies run on a pool of our own instead of libuv's threadpool. That one
+  has 4 threads by default and is shared with DNS lookups and fs calls, so long computations
+  starve them.
+
+  Pending bodies start highest priority first, then in the order they were added. Finished
+  ones' done callbacks are delivered on the loop in batches, with one uv_async_t wakeup for as
+  many as finished since the last one. cancel(id) stops a body that hasn't started yet. Its done
+  gets called (later, on the loop) with an error. A body that's already running can't be stopped.
+
+  The pool has its own ParEngine with threadsAvail threads (one per CPU if 0), or it can share
+  one. Call work and cancel from the loop's thread. The loop stays alive while work is
+  outstanding. Destroying the pool drops work that hasn't started or finished, without calling
+  done. (With its own ParEngine, it first waits for running bodies.) It's fine to destroy it
+  from inside a done callback.
+
+  Example: {
+    UvWorkPool pool(loop, 8);
+    auto id = uvWork(pool, [](string &error, shared_ptr< void > &result) {
+      result = make_shared< BigResult >(crunch());
+    }, [](string const &error, shared_ptr< void > const &result) {
+      if (!error.empty()) return;
+      auto r = static_pointer_cast< BigResult >(result);
+    }, 10);
+    pool.cancel(id);
+  }
+*/
+struct UvWorkPoolState;
+
+struct UvWorkPool {
+  explicit UvWorkPool(uv_loop_t *_loop, size_t threadsAvail = 0);
+  UvWorkPool(uv_loop_t *_loop, ParEngine *_engine);
+  ~UvWorkPool();
+  UvWorkPool(UvWorkPool const &) = delete;
+  UvWorkPool(UvWorkPool &&) = delete;
+  UvWorkPool & operator = (UvWorkPool const &) = delete;
+  UvWorkPool & operator = (UvWorkPool &&) = delete;
+
+  // Returns an id for cancel
+  U64 work(std::function< void(string &error, shared_ptr< void > &result) > const &body,
+           std::function< void(string const &error, shared_ptr< void > const &result) > const &done,
+           int priority = 0);
+  // True if it hadn't started
+  bool cancel(U64 id);
+
+  void async_init();
+
+  uv_loop_t *loop {nullptr};
+  unique_ptr< ParEngine > ownEngine;
+  ParEngine *engine {nullptr};
+  shared_ptr< UvWorkPoolState > state;
+  uv_async_t *async {nullptr};
+  size_t outstanding {0}; // added and done not called yet. Only touched on the loop's thread
+};
+
+U64 uvWork(UvWorkPool &pool,
+    std::function< void(string &error, shared_ptr< void > &result) > const &body,
+    std::function< void(string const &error, shared_ptr< void > const &result) > const &done,
+    int priority = 0);
+
 /*
   Allow any thread to schedule things to be run on the main loop. Construct one of these and call .push(f) (from
   any thread) to arrange for f to be executed next time around the main loop.
+
+  f can be any callable, including move-only ones. It's moved into the queue item, which has
+  room for small ones (up to 48 bytes of captures) so they don't need a separate allocation.
+
+  Pushing is lock-free: a CAS onto a list, and a uv_async_send only when the list was empty.
+  The loop takes the whole list with one exchange, and runs the items in the order they were pushed.
+  It hands the used items back in one CAS to a free list, which a pushing thread takes all of
+  (again with one exchange) into a thread-local cache when it runs out. Otherwise every item
+  would be allocated on one thread and freed on another, which malloc is bad at.
 */
+struct UvAsyncQueueItem {
+  UvAsyncQueueItem *next {nullptr};
+  void (*run)(UvAsyncQueueItem *self, bool call) {nullptr}; // Call the callable (if call), then destroy it even if it throws
+  union {
+    void *heap;
+    alignas(16) unsigned char small[48];
+  };
+};
+
 struct UvAsyncQueue {
   UvAsyncQueue(uv_loop_t *_loop);
   ~UvAsyncQueue();
@@ -34,13 +113,55 @@ struct UvAsyncQueue {
   UvAsyncQueue & operator = (UvAsyncQueue &&) = delete;
 
   void async_init();
-  void push(std::function< void() > const &f);
 
-  std::mutex workQueueMutex;
-  deque< std::function< void() > > workQueue;
+  template<typename F>
+  void push(F &&f)
+  {
+    using Fn = typename std::decay< F >::type;
+    auto item = allocItem();
+    setItem< Fn >(item, std::forward< F >(f), std::integral_constant< bool,
+                  sizeof(Fn) <= sizeof(item->small) && alignof(Fn) <= 16 && std::is_nothrow_move_constructible< Fn >::value >());
+    pushItem(item);
+  }
+
+  UvAsyncQueueItem *allocItem();
+  void pushItem(UvAsyncQueueItem *item);
+  // Returns how many items it ran. If any throw, the rest still run and the first exception is rethrown
+  size_t drain(bool call);
+
+  std::atomic< UvAsyncQueueItem * > head {nullptr}; // most recently pushed first
+  std::atomic< UvAsyncQueueItem * > freeItems {nullptr};
 
   uv_loop_t *loop {nullptr};
   uv_async_t *async {nullptr};
+
+private:
+  template<typename Fn, typename F>
+  static void setItem(UvAsyncQueueItem *item, F &&f, std::true_type /* small */)
+  {
+    new (item->small) Fn(std::forward< F >(f));
+    item->run = [](UvAsyncQueueItem *self, bool call) {
+      auto fn = reinterpret_cast< Fn * >(self->small);
+      try {
+        if (call) (*fn)();
+      }
+      catch (...) {
+        fn->~Fn();
+        throw;
+      }
+      fn->~Fn();
+    };
+  }
+
+  template<typename Fn, typename F>
+  static void setItem(UvAsyncQueueItem *item, F &&f, std::false_type /* small */)
+  {
+    item->heap = new Fn(std::forward< F >(f));
+    item->run = [](UvAsyncQueueItem *self, bool call) {
+      unique_ptr< Fn > fn(reinterpret_cast< Fn * >(self->heap));
+      if (call) (*fn)();
+    };
+  }
 };
 
 struct UvStream {
@@ -62,6 +183,7 @@ struct UvStream {
 
   void write(string const &data, std::function< void(int) > const &_write_cb);
   void write(vector< string > const &data, std::function< void(int) > const &_write_cb);
+  void write(packet_chain const &data, std::function< void(int) > const &_write_cb);
 
   void tcp_connect(struct sockaddr const *addr, std::function< void(int) > const &_connect_cb);
   void tcp_bind(struct sockaddr const* addr, unsigned int flags);
@@ -102,12 +224,76 @@ struct UvStream {
 
 };
 
+/*
+  Sends and receives packets over a UvStream, each framed with its length in front like
+  packet::to_file_boxed (and packet::add_pkt, so a frame is what get_pkt reads).
+
+  Reads go straight into a packet buffer, and each complete frame is delivered as a packet that
+  shares that buffer, so nothing is copied except the start of a frame that straddles two reads.
+  A big frame's buffer grows as its data arrives, doubling each time, rather than all at once
+  from the length the peer claims. Keeping rx
+  packets around is fine: the next read goes into a new buffer if anyone still holds the old one.
+
+  Writes pass the packets' own bytes to uv_write (see UvStream::write(packet_chain)), so they
+  mustn't be changed through ptr() until the write completes. write_batch sends several
+  frames with one uv_write.
+
+  queued counts bytes handed to write that libuv hasn't finished with. backpressure_cb(true) is
+  called when it goes above high_water, and backpressure_cb(false) when it drops back to
+  low_water, so producers can pause.
+
+  The UvStream must already be connected, and both it and the PacketStream must outlive any
+  reads or writes in progress. error_cb gets read errors (including UV_EOF), write errors, and
+  UV_EPROTO for a frame longer than max_frame, after which reading stops.
+*/
+struct PacketStream {
+  PacketStream(UvStream *_stream);
+  ~PacketStream();
+  PacketStream(PacketStream const &) = delete;
+  PacketStream(PacketStream &&) = delete;
+  PacketStream & operator = (PacketStream const &) = delete;
+  PacketStream & operator = (PacketStream &&) = delete;
+
+  void read_start(std::function< void(packet &rx) > const &_packet_cb,
+                  std::function< void(int status) > const &_error_cb);
+  void read_stop();
+
+  void write(packet const &tx);
+  void write_batch(vector< packet > const &txs);
+  void set_watermarks(size_t _low_water, size_t _high_water, std::function< void(bool over) > const &_backpressure_cb);
+
+  UvStream *stream {nullptr};
+  std::function< void(packet &rx) > packet_cb;
+  std::function< void(int status) > error_cb;
+  std::function< void(bool over) > backpressure_cb;
+
+  size_t low_water {256*1024};
+  size_t high_water {1024*1024};
+  size_t queued {0};
+  bool over_water {false};
+
+  size_t read_size {32768};
+  size_t max_frame {64*1024*1024};
+  packet rx_buf;
+  size_t rx_need {0}; // bytes needed in rx_buf to complete the current frame, when known
+  bool reading {false};
+
+private:
+  void alloc_rx(uv_buf_t *buf);
+  void got_rx(ssize_t nread);
+  void send(packet_chain const &frames);
+};
+
 /*
   Resolve a DNS name asynchronously. Supply hostname, portname, hints and it'll call cb with a status code and
   an addrinfo * (nullptr if it failed). The addrinfo is freed after the callback returns.
 */
 void UvGetAddrInfo(uv_loop_t *loop, string const &hostname, string const &portname, struct addrinfo const &hints, std::function<void(int, struct addrinfo *)> const &_cb);
 
+/*
+  Spawn a child process. The fds in extra_fds are passed to the child as fds 3, 4, ..., for
+  example a packet_ring's fd.
+*/
 struct UvProcess {
 
   UvProcess(uv_loop_t *_loop,
@@ -115,7 +301,8 @@ struct UvProcess {
     UvStream *stdin_pipe,
     UvStream *stdout_pipe,
     UvStream *stderr_pipe,
-    std::function< void(int64_t exit_status, int term_signal) > _exit_cb);
+    std::function< void(int64_t exit_status, int term_signal) > _exit_cb,
+    vector< int > const &extra_fds = vector< int >());
 
   uv_loop_t *loop;
   std::function< void(int64_t exit_status, int term_signal) > exit_cb;
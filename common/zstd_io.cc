@@ -0,0 +1,320 @@
+#include "tlbcore/common/std_headers.h"
+#include "./zstd_io.h"
+#include "./gzip_par.h"
+#include <thread>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <zstd.h>
+#include <zdict.h>
+
+
+struct ZstdDict {
+  ZstdDict(string const &_data)
+    :data(_data)
+  {
+    id = (U32)ZDICT_getDictID(data.data(), data.size());
+    ddict = ZSTD_createDDict(data.data(), data.size());
+    if (!ddict) throw runtime_error("zstd: bad dictionary");
+  }
+  ~ZstdDict()
+  {
+    for (auto &it : cdicts) ZSTD_freeCDict(it.second);
+    ZSTD_freeDDict(ddict);
+  }
+  ZstdDict(ZstdDict const &) = delete;
+  ZstdDict & operator= (ZstdDict const &) = delete;
+
+  string data;
+  U32 id {0};
+  ZSTD_DDict *ddict {nullptr};
+  map< int, ZSTD_CDict * > cdicts; // by level, created on demand under zstdDictMutex
+};
+
+static mutex zstdDictMutex;
+static map< U32, shared_ptr< ZstdDict > > zstdDicts;
+
+static shared_ptr< ZstdDict > zstdFindDict(U32 dictId)
+{
+  unique_lock< mutex > lock(zstdDictMutex);
+  auto it = zstdDicts.find(dictId);
+  if (it == zstdDicts.end()) {
+    throw runtime_error("zstd: dictionary " + to_string(dictId) + " not registered (see zstdAddDict)");
+  }
+  return it->second;
+}
+
+static ZSTD_CDict *zstdFindCDict(ZstdDict *dict, int level)
+{
+  unique_lock< mutex > lock(zstdDictMutex);
+  auto &slot = dict->cdicts[level];
+  if (!slot) {
+    slot = ZSTD_createCDict(dict->data.data(), dict->data.size(), level);
+    if (!slot) throw runtime_error("zstd: ZSTD_createCDict failed");
+  }
+  return slot;
+}
+
+U32 zstdAddDict(string const &dict)
+{
+  auto d = make_shared< ZstdDict >(dict);
+  if (d->id == 0) throw runtime_error("zstd: dictionary has no id (raw content dictionaries aren't supported)");
+  unique_lock< mutex > lock(zstdDictMutex);
+  zstdDicts[d->id] = d;
+  return d->id;
+}
+
+U32 zstdLoadDictFile(string const &fn)
+{
+  string dict;
+  if (!readFileDecompress(fn, dict)) {
+    throw runtime_error(fn + string(": ") + string(strerror(errno)));
+  }
+  return zstdAddDict(dict);
+}
+
+void zstdSaveDictFile(string const &fn, string const &dict)
+{
+  FILE *fp = fopen(fn.c_str(), "wb");
+  if (!fp) {
+    throw runtime_error(fn + string(": ") + string(strerror(errno)));
+  }
+  if (fwrite(dict.data(), 1, dict.size(), fp) != dict.size()) {
+    int err = errno;
+    fclose(fp);
+    throw runtime_error(fn + string(": write failed: ") + string(strerror(err)));
+  }
+  if (fclose(fp) < 0) {
+    throw runtime_error(fn + string(": ") + string(strerror(errno)));
+  }
+}
+
+string zstdTrainDict(vector< jsonstr > const &samples, size_t maxDictSize)
+{
+  string samplesBuf;
+  vector< size_t > sampleSizes;
+  size_t total = 0;
+  for (auto &it : samples) total += it.it.size();
+  samplesBuf.reserve(total);
+  for (auto &it : samples) {
+    samplesBuf += it.it;
+    sampleSizes.push_back(it.it.size());
+  }
+
+  string dict(maxDictSize, '\0');
+  size_t rc = ZDICT_trainFromBuffer(&dict[0], dict.size(), samplesBuf.data(), sampleSizes.data(), (unsigned)sampleSizes.size());
+  if (ZDICT_isError(rc)) {
+    throw runtime_error("zstdTrainDict: " + string(ZDICT_getErrorName(rc)) + " (" + to_string(samples.size()) + " samples)");
+  }
+  dict.resize(rc);
+  return dict;
+}
+
+/*
+  Contexts are expensive to create compared to compressing a small message, so keep one
+  per thread.
+*/
+static ZSTD_CCtx *zstdThreadCCtx()
+{
+  static thread_local unique_ptr< ZSTD_CCtx, size_t (*)(ZSTD_CCtx *) > cctx(nullptr, ZSTD_freeCCtx);
+  if (!cctx) cctx.reset(ZSTD_createCCtx());
+  return cctx.get();
+}
+
+static ZSTD_DCtx *zstdThreadDCtx()
+{
+  static thread_local unique_ptr< ZSTD_DCtx, size_t (*)(ZSTD_DCtx *) > dctx(nullptr, ZSTD_freeDCtx);
+  if (!dctx) dctx.reset(ZSTD_createDCtx());
+  return dctx.get();
+}
+
+static void zstdCheck(size_t rc, char const *what)
+{
+  if (ZSTD_isError(rc)) {
+    throw runtime_error(string("zstd: ") + what + ": " + ZSTD_getErrorName(rc));
+  }
+}
+
+void zstdCompress(char const *data, size_t size, string &out, int level, U32 dictId)
+{
+  auto cctx = zstdThreadCCtx();
+  ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+  zstdCheck(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level), "set level");
+  if (dictId) {
+    auto dict = zstdFindDict(dictId);
+    zstdCheck(ZSTD_CCtx_refCDict(cctx, zstdFindCDict(dict.get(), level)), "refCDict");
+  }
+  if (size > 4*1024*1024) {
+    // Fails harmlessly if libzstd was built without threads
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, (int)thread::hardware_concurrency());
+  }
+
+  out.resize(ZSTD_compressBound(size));
+  size_t rc = ZSTD_compress2(cctx, &out[0], out.size(), data, size);
+  zstdCheck(rc, "compress");
+  out.resize(rc);
+}
+
+/*
+  Frames written by zstdCompress record their size, so we can decompress straight into place.
+  Frames from streaming writers (like ChunkFileZstd) may not, and get decompressed incrementally.
+
+  The recorded sizes come from the file, so don't believe one that the frame couldn't possibly
+  decode to: every block of up to ZSTD_BLOCKSIZE_MAX bytes takes at least 4 bytes (a 3-byte
+  header and 1 byte of RLE). Otherwise a 20-byte file could claim an exabyte.
+*/
+void zstdDecompress(u_char const *src, size_t srcSize, string &out, size_t maxSize)
+{
+  auto dctx = zstdThreadDCtx();
+
+  struct Frame {
+    size_t srcOff, srcSize, dstSize;
+    U32 dictId;
+  };
+  vector< Frame > frames;
+  size_t total = 0;
+  bool sized = true;
+  for (size_t pos = 0; pos < srcSize; ) {
+    size_t frameSize = ZSTD_findFrameCompressedSize(src + pos, srcSize - pos);
+    zstdCheck(frameSize, "corrupt frame");
+    unsigned long long contentSize = ZSTD_getFrameContentSize(src + pos, frameSize);
+    if (contentSize == ZSTD_CONTENTSIZE_ERROR) {
+      throw runtime_error("zstd: corrupt frame at " + to_string(pos));
+    }
+    if (contentSize == ZSTD_CONTENTSIZE_UNKNOWN) {
+      sized = false;
+      contentSize = 0;
+    }
+    else if (contentSize > (unsigned long long)(frameSize / 4 + 1) * ZSTD_BLOCKSIZE_MAX) {
+      throw runtime_error("zstd: frame at " + to_string(pos) + " claims an impossible size");
+    }
+    frames.push_back(Frame{pos, frameSize, (size_t)contentSize, ZSTD_getDictID_fromFrame(src + pos, frameSize)});
+    total += (size_t)contentSize;
+    pos += frameSize;
+  }
+
+  if (total > maxSize) {
+    throw runtime_error("zstd: content of " + to_string(total) + " bytes is over the limit of " + to_string(maxSize));
+  }
+
+  if (sized) {
+    out.resize(total);
+    size_t dstOff = 0;
+    for (auto &f : frames) {
+      ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+      shared_ptr< ZstdDict > dict;
+      if (f.dictId) {
+        dict = zstdFindDict(f.dictId);
+        zstdCheck(ZSTD_DCtx_refDDict(dctx, dict->ddict), "refDDict");
+      }
+      size_t rc = ZSTD_decompressDCtx(dctx, &out[dstOff], f.dstSize, src + f.srcOff, f.srcSize);
+      zstdCheck(rc, "decompress");
+      if (rc != f.dstSize) throw runtime_error("zstd: frame size mismatch");
+      dstOff += f.dstSize;
+    }
+    return;
+  }
+
+  // Start small and double, rather than zero-filling a guess before decoding anything
+  out.resize(min(max(total, size_t(65536)), maxSize));
+  size_t outPos = 0;
+  for (auto &f : frames) {
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+    shared_ptr< ZstdDict > dict;
+    if (f.dictId) {
+      dict = zstdFindDict(f.dictId);
+      zstdCheck(ZSTD_DCtx_refDDict(dctx, dict->ddict), "refDDict");
+    }
+    ZSTD_inBuffer inb {src + f.srcOff, f.srcSize, 0};
+    while (true) {
+      if (outPos == out.size()) {
+        if (out.size() >= maxSize) {
+          throw runtime_error("zstd: content is over the limit of " + to_string(maxSize) + " bytes");
+        }
+        out.resize(min(out.size() * 2, maxSize));
+      }
+      ZSTD_outBuffer outb {&out[0], out.size(), outPos};
+      size_t rc = ZSTD_decompressStream(dctx, &outb, &inb);
+      zstdCheck(rc, "decompress");
+      outPos = outb.pos;
+      if (rc == 0) break;
+      if (inb.pos == inb.size && outb.pos < outb.size) throw runtime_error("zstd: truncated frame");
+    }
+  }
+  out.resize(outPos);
+}
+
+void zstdWriteFile(string const &fn, char const *data, size_t size, int level, U32 dictId)
+{
+  string comp;
+  zstdCompress(data, size, comp, level, dictId);
+
+  FILE *fp = fopen(fn.c_str(), "wb");
+  if (!fp) {
+    throw runtime_error(fn + string(": ") + string(strerror(errno)));
+  }
+  if (fwrite(comp.data(), 1, comp.size(), fp) != comp.size()) {
+    int err = errno;
+    fclose(fp);
+    throw runtime_error(fn + string(": write failed: ") + string(strerror(err)));
+  }
+  if (fclose(fp) < 0) {
+    throw runtime_error(fn + string(": ") + string(strerror(errno)));
+  }
+}
+
+
+string detectCompression(u_char const *data, size_t size)
+{
+  if (size >= 2 && data[0] == 0x1f && data[1] == 0x8b) return "gz";
+  if (size >= 4 && data[0] == 0x28 && data[1] == 0xb5 && data[2] == 0x2f && data[3] == 0xfd) return "zst";
+  return "";
+}
+
+bool readFileDecompress(string const &fn, string &out)
+{
+  int fd = open(fn.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int err = errno;
+    close(fd);
+    throw runtime_error(fn + string(": ") + string(strerror(err)));
+  }
+  size_t fileSize = (size_t)st.st_size;
+#if defined(POSIX_FADV_SEQUENTIAL)
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  string raw;
+  raw.resize(fileSize);
+  size_t got = 0;
+  while (got < fileSize) {
+    ssize_t nr = read(fd, &raw[got], min(fileSize - got, size_t(1) << 30));
+    if (nr < 0 && errno == EINTR) continue;
+    if (nr <= 0) {
+      int err = errno;
+      close(fd);
+      throw runtime_error(fn + string(": read failed: ") + (nr < 0 ? string(strerror(err)) : string("short file")));
+    }
+    got += (size_t)nr;
+  }
+  close(fd);
+
+  auto rawp = reinterpret_cast< u_char const * >(raw.data());
+  string compression = detectCompression(rawp, raw.size());
+  try {
+    if (compression == "gz") {
+      gzipDecompress(rawp, raw.size(), out);
+    }
+    else if (compression == "zst") {
+      zstdDecompress(rawp, raw.size(), out);
+    }
+    else {
+      out.swap(raw);
+    }
+  }
+  catch (runtime_error const &ex) {
+    throw runtime_error(fn + string(": ") + string(ex.what()));
+  }
+  return true;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+struct jsonstr;
+
+/*
+  zstd compression for jsonstr files and blob chunks, plus trained dictionaries.
+
+  zstd is several times faster than zlib at a better ratio. For lots of small JSON messages with
+  the same schema, most of the gain comes from a dictionary: train one from sample messages with
+  zstdTrainDict, save it with zstdSaveDictFile, and register it with zstdAddDict (or
+  zstdLoadDictFile) in every process that compresses or decompresses. Frames record the id
+  of the dictionary they used, so zstdDecompress finds it automatically. Decompressing a frame
+  whose dictionary isn't registered throws.
+
+  Needs libzstd (libzstd-dev on Ubuntu, zstd on brew).
+*/
+
+static const int ZSTD_IO_DEFAULT_LEVEL = 3;
+// zstdDecompress throws rather than produce more than this
+static const size_t ZSTD_IO_MAX_DECOMPRESSED = size_t(1) << 34;
+
+void zstdCompress(char const *data, size_t size, string &out, int level = ZSTD_IO_DEFAULT_LEVEL, U32 dictId = 0);
+void zstdDecompress(u_char const *src, size_t srcSize, string &out, size_t maxSize = ZSTD_IO_MAX_DECOMPRESSED);
+void zstdWriteFile(string const &fn, char const *data, size_t size, int level = ZSTD_IO_DEFAULT_LEVEL, U32 dictId = 0);
+
+// Dictionaries
+string zstdTrainDict(vector< jsonstr > const &samples, size_t maxDictSize = 112640);
+U32 zstdAddDict(string const &dict); // Returns the dictionary's id
+U32 zstdLoadDictFile(string const &fn);
+void zstdSaveDictFile(string const &fn, string const &dict);
+
+/*
+  Detect the compression from the magic number at the start of data: "gz", "zst", or "" for none.
+  readFileDecompress reads a whole file and decompresses it according to its contents, whatever
+  it's called. Returns false if the file can't be opened, throws runtime_error if it's corrupt.
+*/
+string detectCompression(u_char const *data, size_t size);
+bool readFileDecompress(string const &fn, string &out);
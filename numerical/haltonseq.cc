@@ -31,7 +31,7 @@ arma::vec unipolarHaltonRow(u_int i, size_t nCols)
   assert (nCols <= haltonAxes.size());
   arma::vec ret(nCols);
   for (size_t ci = 0; ci < nCols; ci++) {
-    ret[ci] = unipolarHaltonAxis(i, haltonAxes[i]);
+    ret[ci] = unipolarHaltonAxis(i, haltonAxes[ci]);
   }
   return ret;
 }
@@ -56,7 +56,7 @@ arma::vec bipolarHaltonRow(u_int i, size_t nCols)
   assert (nCols <= haltonAxes.size());
   arma::vec ret(nCols);
   for (size_t ci = 0; ci < nCols; ci++) {
-    ret[ci] = bipolarHaltonAxis(i, haltonAxes[i]);
+    ret[ci] = bipolarHaltonAxis(i, haltonAxes[ci]);
   }
   return ret;
 }
@@ -85,3 +85,37 @@ arma::vec gaussianHaltonRow(u_int i, size_t nCols)
   }
   return ret;
 }
+
+
+/*
+  Rows i0 .. i0+nRows-1 of the above, as the rows of a matrix. Big ones are generated in
+  parallel, a block of rows per chunk.
+*/
+static arma::mat haltonMatrix(u_int i0, size_t nRows, size_t nCols, arma::vec (*rowFn)(u_int, size_t))
+{
+  arma::mat ret(nRows, nCols);
+  parallel_for(0, nRows, 4096, [&](size_t lo, size_t hi) {
+    for (size_t ri = lo; ri < hi; ri++) {
+      arma::vec row = rowFn(i0 + (u_int)ri, nCols);
+      for (size_t ci = 0; ci < nCols; ci++) {
+        ret(ri, ci) = row[ci];
+      }
+    }
+  });
+  return ret;
+}
+
+arma::mat unipolarHaltonMatrix(u_int i0, size_t nRows, size_t nCols)
+{
+  return haltonMatrix(i0, nRows, nCols, unipolarHaltonRow);
+}
+
+arma::mat bipolarHaltonMatrix(u_int i0, size_t nRows, size_t nCols)
+{
+  return haltonMatrix(i0, nRows, nCols, bipolarHaltonRow);
+}
+
+arma::mat gaussianHaltonMatrix(u_int i0, size_t nRows, size_t nCols)
+{
+  return haltonMatrix(i0, nRows, nCols, gaussianHaltonRow);
+}
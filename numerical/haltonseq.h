@@ -9,3 +9,8 @@ arma::vec unipolarHaltonRow(u_int i, size_t nCols);
 double bipolarHaltonAxis(u_int i, u_int radix);
 arma::vec bipolarHaltonRow(u_int i, size_t nCols);
 arma::vec gaussianHaltonRow(u_int i, size_t nCols);
+
+// Rows i0 .. i0+nRows-1 of a sequence, one per row. Generated in parallel
+arma::mat unipolarHaltonMatrix(u_int i0, size_t nRows, size_t nCols);
+arma::mat bipolarHaltonMatrix(u_int i0, size_t nRows, size_t nCols);
+arma::mat gaussianHaltonMatrix(u_int i0, size_t nRows, size_t nCols);
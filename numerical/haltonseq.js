@@ -36,7 +36,7 @@ function unipolarHaltonRow(i, nCols)
   if (nCols > haltonAxes.length) throw new Error("nCols too large");
   let ret = [];
   for (let ci = 0; ci < nCols; ci++) {
-    ret.push(unipolarHaltonAxis(i, haltonAxes[i]));
+    ret.push(unipolarHaltonAxis(i, haltonAxes[ci]));
   }
   return ret;
 }
@@ -61,7 +61,7 @@ function bipolarHaltonRow(i, nCols)
   if (nCols > haltonAxes.length) throw new Error("nCols too large");
   let ret = [];
   for (let ci = 0; ci < nCols; ci++) {
-    ret.push(bipolarHaltonAxis(i, haltonAxes[i]));
+    ret.push(bipolarHaltonAxis(i, haltonAxes[ci]));
   }
   return ret;
 }
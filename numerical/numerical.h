@@ -1,6 +1,62 @@
 #pragma once
 
 #include <armadillo>
+#include "../common/parengine.h"
+
+/*
+  parallel_for and parallel_reduce (from parengine.h) over arma data. For a Col or Row the range
+  is elements, for a Mat it's columns, so fn(lo, hi) can work on a.cols(lo, hi-1).
+*/
+template<typename T, typename F>
+void parallel_for(arma::Col< T > const &a, size_t grain, F const &fn, ParEngine *pe = nullptr)
+{
+  parallel_for(0, a.n_elem, grain, fn, pe);
+}
+template<typename T, typename F>
+void parallel_for(arma::Row< T > const &a, size_t grain, F const &fn, ParEngine *pe = nullptr)
+{
+  parallel_for(0, a.n_elem, grain, fn, pe);
+}
+template<typename T, typename F>
+void parallel_for(arma::Mat< T > const &a, size_t grain, F const &fn, ParEngine *pe = nullptr)
+{
+  parallel_for(0, a.n_cols, grain, fn, pe);
+}
+
+template<typename T, typename R, typename Map, typename Combine>
+R parallel_reduce(arma::Col< T > const &a, size_t grain, R const &identity, Map const &map, Combine const &combine,
+                  bool ordered = true, ParEngine *pe = nullptr)
+{
+  return parallel_reduce(0, a.n_elem, grain, identity, map, combine, ordered, pe);
+}
+template<typename T, typename R, typename Map, typename Combine>
+R parallel_reduce(arma::Row< T > const &a, size_t grain, R const &identity, Map const &map, Combine const &combine,
+                  bool ordered = true, ParEngine *pe = nullptr)
+{
+  return parallel_reduce(0, a.n_elem, grain, identity, map, combine, ordered, pe);
+}
+template<typename T, typename R, typename Map, typename Combine>
+R parallel_reduce(arma::Mat< T > const &a, size_t grain, R const &identity, Map const &map, Combine const &combine,
+                  bool ordered = true, ParEngine *pe = nullptr)
+{
+  return parallel_reduce(0, a.n_cols, grain, identity, map, combine, ordered, pe);
+}
+
+/*
+  Grains for the parallel versions of linearMetric and hasNaN below. Scanning 64k doubles takes
+  a few tens of microseconds, enough to be worth handing to another thread. Elements of other
+  types (vectors, maps, ...) are assumed to be a lot more work each.
+
+  Arma arrays and vectors of at least 2 grains go to defaultParEngine(), so the first big one
+  starts its threads and memory sampler. Anything smaller runs serially on the calling thread.
+*/
+static const size_t parallelElemGrain = 65536;
+
+template<typename T>
+size_t parallelGrainFor()
+{
+  return std::is_arithmetic< T >::value ? parallelElemGrain : 256;
+}
 
 static inline double normangle(double x) {
   if (x > M_PI) {
@@ -133,19 +189,35 @@ static inline double linearMetric(string const &a, string const &b)
   return 0.0;
 }
 
+/*
+  Dot product of big arrays in chunks, summed in a fixed order so the result doesn't depend on
+  the number of threads.
+*/
+template<typename T>
+double linearMetricPar(T const *a, T const *b, size_t n)
+{
+  return parallel_reduce(0, n, parallelElemGrain, 0.0, [a, b](size_t lo, size_t hi) {
+    return (double)dot(arma::Col< T >(const_cast< T * >(a) + lo, hi - lo, false, true),
+                       arma::Col< T >(const_cast< T * >(b) + lo, hi - lo, false, true));
+  }, [](double x, double y) { return x + y; });
+}
+
 template<typename T>
 double linearMetric(arma::Col< T > const &a, arma::Col< T > const &b)
 {
+  if (a.n_elem >= 2 * parallelElemGrain && a.n_elem == b.n_elem) return linearMetricPar(a.memptr(), b.memptr(), a.n_elem);
   return dot(a, b);
 }
 template<typename T>
 double linearMetric(arma::Mat< T > const &a, arma::Mat< T > const &b)
 {
+  if (a.n_elem >= 2 * parallelElemGrain && a.n_rows == b.n_rows && a.n_cols == b.n_cols) return linearMetricPar(a.memptr(), b.memptr(), a.n_elem);
   return dot(a, b);
 }
 template<typename T>
 double linearMetric(arma::Row< T > const &a, arma::Row< T > const &b)
 {
+  if (a.n_elem >= 2 * parallelElemGrain && a.n_elem == b.n_elem) return linearMetricPar(a.memptr(), b.memptr(), a.n_elem);
   return dot(a, b);
 }
 
@@ -167,18 +239,27 @@ double linearMetric(map< string, T > const &a, map< string, T > const &b)
     auto bit = b.find(it);
     ret += linearMetric((ait == a.end() ? T() : ait->second), (bit == b.end() ? T() : bit->second));
   }
-  return 0.0;
+  return ret;
 }
 
 template<typename T>
 double linearMetric(vector< T > const &a, vector< T > const &b)
 {
   auto size = max(a.size(), b.size());
-  double ret = 0.0;
-  for (size_t i = 0; i < size; i++) {
-    ret += linearMetric(i < a.size() ? a[i]: T(), i < b.size() ? b[i] : T());
+  if (size < 2 * parallelGrainFor< T >()) {
+    double ret = 0.0;
+    for (size_t i = 0; i < size; i++) {
+      ret += linearMetric(i < a.size() ? a[i]: T(), i < b.size() ? b[i] : T());
+    }
+    return ret;
   }
-  return ret;
+  return parallel_reduce(0, size, parallelGrainFor< T >(), 0.0, [&a, &b](size_t lo, size_t hi) {
+    double ret = 0.0;
+    for (size_t i = lo; i < hi; i++) {
+      ret += linearMetric(i < a.size() ? a[i]: T(), i < b.size() ? b[i] : T());
+    }
+    return ret;
+  }, [](double x, double y) { return x + y; });
 }
 
 
@@ -218,19 +299,34 @@ static inline bool hasNaN(string const &a)
   return false;
 }
 
+// Stops early (give or take the chunks already started) once a NaN turns up
+template<typename T>
+bool hasNaNPar(T const *a, size_t n)
+{
+  std::atomic< bool > found { false };
+  parallel_for(0, n, parallelElemGrain, [a, &found](size_t lo, size_t hi) {
+    if (found.load(std::memory_order_relaxed)) return;
+    if (arma::Col< T >(const_cast< T * >(a) + lo, hi - lo, false, true).has_nan()) found = true;
+  });
+  return found.load();
+}
+
 template<typename T>
 bool hasNaN(arma::Col< T > const &a)
 {
+  if (a.n_elem >= 2 * parallelElemGrain) return hasNaNPar(a.memptr(), a.n_elem);
   return a.has_nan();
 }
 template<typename T>
 bool hasNaN(arma::Mat< T > const &a)
 {
+  if (a.n_elem >= 2 * parallelElemGrain) return hasNaNPar(a.memptr(), a.n_elem);
   return a.has_nan();
 }
 template<typename T>
 bool hasNaN(arma::Row< T > const &a)
 {
+  if (a.n_elem >= 2 * parallelElemGrain) return hasNaNPar(a.memptr(), a.n_elem);
   return a.has_nan();
 }
 
@@ -255,9 +351,21 @@ bool hasNaN(map< string, T > const &a)
 template<typename T>
 bool hasNaN(vector< T > const &a)
 {
-  bool out = false;
-  for (size_t i = 0; i < a.size(); i++) {
-    out = out || hasNaN(a[i]);
+  if (a.size() < 2 * parallelGrainFor< T >()) {
+    for (auto const &it : a) {
+      if (hasNaN(it)) return true;
+    }
+    return false;
   }
-  return out;
+  std::atomic< bool > found { false };
+  parallel_for(0, a.size(), parallelGrainFor< T >(), [&a, &found](size_t lo, size_t hi) {
+    if (found.load(std::memory_order_relaxed)) return;
+    for (size_t i = lo; i < hi; i++) {
+      if (hasNaN(a[i])) {
+        found = true;
+        return;
+      }
+    }
+  });
+  return found.load();
 }
@@ -38,72 +38,95 @@ double getDerivative(Polyfit5 const &u, double t)
   Fit a polynomial to some X and Y data. That is, return a Polyfit{1,3,5} p so that getValue(p, X) approximates Y.
  */
 
-Polyfit1 mkPolyfit1(arma::Col< double > xs, arma::Col< double > ys)
+// The least-squares system for a polynomial of the given degree: a row [1 x x^2 ...] per x
+static arma::mat polyfitDesign(arma::Col< double > const &xs, size_t degree)
 {
-  if (xs.n_elem != ys.n_elem) throw runtime_error("incompatible arrays");
-  if (xs.n_elem < 2) throw runtime_error ("not enough data");
-
-  arma::mat xsm = arma::mat(xs.n_elem, 2);
-  arma::mat ysm = arma::mat(ys.n_elem, 1);
-
+  if (xs.n_elem < degree + 1) throw runtime_error("not enough data");
+  arma::mat xsm = arma::mat(xs.n_elem, degree + 1);
   for (size_t ri=0; ri<xs.n_elem; ri++) {
     double x = xs(ri);
-    double y = ys(ri);
-    xsm(ri, 0) = 1;
-    xsm(ri, 1) = x;
-    ysm(ri, 0) = y;
+    double xp = 1.0;
+    for (size_t ci=0; ci<=degree; ci++) {
+      xsm(ri, ci) = xp;
+      xp *= x;
+    }
   }
-
-  // Throws runtime_error if no solution
-  arma::mat coeffs = arma::solve(xsm, ysm);
-  return Polyfit1(coeffs(0,0), coeffs(1,0));
+  return xsm;
 }
 
-
-Polyfit3 mkPolyfit3(arma::Col< double > xs, arma::Col< double > ys)
+static arma::mat polyfitCoeffs(arma::Col< double > const &xs, arma::Col< double > const &ys, size_t degree)
 {
   if (xs.n_elem != ys.n_elem) throw runtime_error("incompatible arrays");
-  if (xs.n_elem < 4) throw runtime_error ("not enough data");
-
-  arma::mat xsm = arma::mat(xs.n_elem, 4);
+  arma::mat xsm = polyfitDesign(xs, degree);
   arma::mat ysm = arma::mat(ys.n_elem, 1);
-
-  for (size_t ri=0; ri<xs.n_elem; ri++) {
-    double x = xs(ri);
-    double y = ys(ri);
-    xsm(ri, 0) = 1;
-    xsm(ri, 1) = x;
-    xsm(ri, 2) = x*x;
-    xsm(ri, 3) = x*x*x;
-    ysm(ri, 0) = y;
+  for (size_t ri=0; ri<ys.n_elem; ri++) {
+    ysm(ri, 0) = ys(ri);
   }
 
   // Throws runtime_error if no solution
-  arma::mat coeffs = arma::solve(xsm, ysm);
+  return arma::solve(xsm, ysm);
+}
+
+/*
+  A column of coefficients for each column of ys. The design matrix is the same for every column,
+  so each block of columns is one solve with many right-hand sides, and blocks run in parallel.
+ */
+static arma::mat polyfitCoeffsCols(arma::Col< double > const &xs, arma::Mat< double > const &ys, size_t degree)
+{
+  if (xs.n_elem != ys.n_rows) throw runtime_error("incompatible arrays");
+  arma::mat xsm = polyfitDesign(xs, degree);
+  arma::mat coeffs = arma::mat(degree + 1, ys.n_cols);
+  parallel_for(ys, 64, [&](size_t lo, size_t hi) {
+    // Throws runtime_error if no solution
+    coeffs.cols(lo, hi-1) = arma::solve(xsm, ys.cols(lo, hi-1));
+  });
+  return coeffs;
+}
+
+Polyfit1 mkPolyfit1(arma::Col< double > xs, arma::Col< double > ys)
+{
+  arma::mat coeffs = polyfitCoeffs(xs, ys, 1);
+  return Polyfit1(coeffs(0,0), coeffs(1,0));
+}
+
+Polyfit3 mkPolyfit3(arma::Col< double > xs, arma::Col< double > ys)
+{
+  arma::mat coeffs = polyfitCoeffs(xs, ys, 3);
   return Polyfit3(coeffs(0,0), coeffs(1,0), coeffs(2,0), coeffs(3,0));
 }
 
 Polyfit5 mkPolyfit5(arma::Col< double > xs, arma::Col< double > ys)
 {
-  if (xs.n_elem != ys.n_elem) throw runtime_error("incompatible arrays");
-  if (xs.n_elem < 6) throw runtime_error("not enough data");
+  arma::mat coeffs = polyfitCoeffs(xs, ys, 5);
+  return Polyfit5(coeffs(0,0), coeffs(1,0), coeffs(2,0), coeffs(3,0), coeffs(4,0), coeffs(5,0));
+}
 
-  arma::mat xsm = arma::mat(xs.n_elem, 6);
-  arma::mat ysm = arma::mat(ys.n_elem, 1);
+vector< Polyfit1 > mkPolyfit1Cols(arma::Col< double > xs, arma::Mat< double > ys)
+{
+  arma::mat coeffs = polyfitCoeffsCols(xs, ys, 1);
+  vector< Polyfit1 > ret;
+  for (size_t ci=0; ci<coeffs.n_cols; ci++) {
+    ret.emplace_back(coeffs(0,ci), coeffs(1,ci));
+  }
+  return ret;
+}
 
-  for (size_t ri=0; ri<xs.n_elem; ri++) {
-    double x = xs(ri);
-    double y = ys(ri);
-    xsm(ri, 0) = 1;
-    xsm(ri, 1) = x;
-    xsm(ri, 2) = x*x;
-    xsm(ri, 3) = x*x*x;
-    xsm(ri, 4) = x*x*x*x;
-    xsm(ri, 5) = x*x*x*x*x;
-    ysm(ri, 0) = y;
+vector< Polyfit3 > mkPolyfit3Cols(arma::Col< double > xs, arma::Mat< double > ys)
+{
+  arma::mat coeffs = polyfitCoeffsCols(xs, ys, 3);
+  vector< Polyfit3 > ret;
+  for (size_t ci=0; ci<coeffs.n_cols; ci++) {
+    ret.emplace_back(coeffs(0,ci), coeffs(1,ci), coeffs(2,ci), coeffs(3,ci));
   }
+  return ret;
+}
 
-  // Throws runtime_error if no solution
-  arma::mat coeffs = arma::solve(xsm, ysm);
-  return Polyfit5(coeffs(0,0), coeffs(1,0), coeffs(2,0), coeffs(3,0), coeffs(4,0), coeffs(5,0));
+vector< Polyfit5 > mkPolyfit5Cols(arma::Col< double > xs, arma::Mat< double > ys)
+{
+  arma::mat coeffs = polyfitCoeffsCols(xs, ys, 5);
+  vector< Polyfit5 > ret;
+  for (size_t ci=0; ci<coeffs.n_cols; ci++) {
+    ret.emplace_back(coeffs(0,ci), coeffs(1,ci), coeffs(2,ci), coeffs(3,ci), coeffs(4,ci), coeffs(5,ci));
+  }
+  return ret;
 }
@@ -19,3 +19,8 @@ double getDerivative(Polyfit5 const &u, double t);
 Polyfit1 mkPolyfit1(arma::Col< double > xs, arma::Col< double > ys);
 Polyfit3 mkPolyfit3(arma::Col< double > xs, arma::Col< double > ys);
 Polyfit5 mkPolyfit5(arma::Col< double > xs, arma::Col< double > ys);
+
+// A fit for each column of ys, all against the same xs. Columns are fitted in parallel
+vector< Polyfit1 > mkPolyfit1Cols(arma::Col< double > xs, arma::Mat< double > ys);
+vector< Polyfit3 > mkPolyfit3Cols(arma::Col< double > xs, arma::Mat< double > ys);
+vector< Polyfit5 > mkPolyfit5Cols(arma::Col< double > xs, arma::Mat< double > ys);
@@ -0,0 +1,19 @@
+'use strict';
+
+const assert = require('assert');
+const haltonseq = require('./haltonseq');
+
+describe('haltonseq', function() {
+  it('should use a different radix for each column', function() {
+    // Columns 0, 1, 2 use radix 3, 5, 7, so point 1 is (1/3, 1/5, 1/7)
+    let row = haltonseq.unipolarHaltonRow(1, 3);
+    assert.deepEqual(row, [1/3, 1/5, 1/7]);
+    let brow = haltonseq.bipolarHaltonRow(1, 3);
+    assert.deepEqual(brow, [3, 5, 7].map((radix) => haltonseq.bipolarHaltonAxis(1, radix)));
+  });
+  it('should work for points past the number of axes', function() {
+    let row = haltonseq.unipolarHaltonRow(100, 2);
+    assert.ok(row[0] >= 0 && row[0] < 1 && row[1] >= 0 && row[1] < 1);
+    assert.notEqual(row[0], row[1]);
+  });
+});
@@ -0,0 +1,75 @@
+/*
+  Checks for numerical: Halton rows use a different radix per column, linearMetric sums over the
+  keys of maps, and linearMetric and hasNaN agree on small and big vectors. Prints one line per
+  check and exits non-zero if any failed.
+
+  Compile and run from tests/, with the same include path (the directory containing tlbcore)
+  and libraries as the node module:
+  $ g++ -std=c++14 -O2 -I../.. -o t_numerical t_numerical.cc ../numerical/haltonseq.cc ../common/parengine.cc ../common/hacks.cc -larmadillo -luv -lpthread && ./t_numerical
+*/
+#include "tlbcore/common/std_headers.h"
+#include "tlbcore/numerical/numerical.h"
+#include "tlbcore/numerical/haltonseq.h"
+
+static int failures = 0;
+
+static void check(bool ok, string const &what)
+{
+  printf("%s: %s\n", ok ? "ok" : "FAIL", what.c_str());
+  if (!ok) failures++;
+}
+
+/*
+  Column ci of a row is the point along axis ci, with radix 3, 5, 7, ... Rows past the 45th must
+  work too: they used to index the table of radixes by row.
+*/
+static void t_halton()
+{
+  arma::vec u = unipolarHaltonRow(1, 3);
+  check(u[0] == unipolarHaltonAxis(1, 3) && u[1] == unipolarHaltonAxis(1, 5) && u[2] == unipolarHaltonAxis(1, 7),
+        "unipolarHaltonRow uses radix 3, 5, 7 for columns 0, 1, 2");
+  arma::vec b = bipolarHaltonRow(1, 3);
+  check(b[0] == bipolarHaltonAxis(1, 3) && b[1] == bipolarHaltonAxis(1, 5) && b[2] == bipolarHaltonAxis(1, 7),
+        "bipolarHaltonRow uses radix 3, 5, 7 for columns 0, 1, 2");
+
+  arma::vec far = unipolarHaltonRow(100, 46);
+  check(far[0] == unipolarHaltonAxis(100, 3) && far[45] == unipolarHaltonAxis(100, 199), "rows past the number of axes");
+
+  arma::mat m = unipolarHaltonMatrix(10, 3, 2);
+  check(m(2, 1) == unipolarHaltonAxis(12, 5), "unipolarHaltonMatrix matches the rows");
+}
+
+/*
+  A key missing from one side counts as T(), so it contributes nothing.
+*/
+static void t_linear_metric_map()
+{
+  map< string, double > a {{"x", 2.0}, {"y", 3.0}};
+  map< string, double > b {{"x", 5.0}, {"z", 7.0}};
+  check(linearMetric(a, b) == 10.0, "linearMetric of maps sums over the keys");
+  check(linearMetric(a, a) == 13.0, "linearMetric of a map with itself");
+}
+
+/*
+  Small vectors run serially, big ones in chunks on defaultParEngine(). Both must give the same
+  answers. The shorter vector is padded with zeros.
+*/
+static void t_vector()
+{
+  for (size_t n : {10, 300000}) {
+    vector< double > a(n, 2.0), b(n + 5, 3.0);
+    check(linearMetric(a, b) == 6.0 * n, "linearMetric of vectors, n=" + to_string(n));
+    check(!hasNaN(a), "hasNaN of a clean vector, n=" + to_string(n));
+    a[n - 1] = NAN;
+    check(hasNaN(a), "hasNaN finds a NaN at the end, n=" + to_string(n));
+  }
+}
+
+int main()
+{
+  t_halton();
+  t_linear_metric_map();
+  t_vector();
+  printf("%s\n", failures ? "FAILED" : "all ok");
+  return failures ? 1 : 0;
+}
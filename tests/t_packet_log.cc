@@ -0,0 +1,362 @@
+/*
+  Checks for packet_log: round trips, recovering and appending after a crash, falling back when
+  the index or footer is bad, seek and seek_time around block boundaries, and scan_parallel over
+  ranges. Prints one line per check and exits non-zero if any failed.
+
+  Compile and run from tests/, with the same include path (the directory containing tlbcore)
+  and libraries as the node module:
+  $ g++ -std=c++14 -O2 -I../.. -o t_packet_log t_packet_log.cc ../common/packet_log.cc ../common/packetbuf.cc ../common/packetbuf_compact.cc ../common/zstd_io.cc ../common/gzip_par.cc ../common/crc32c.cc ../common/hacks.cc -lzstd -lz -lpthread && ./t_packet_log
+*/
+#include "tlbcore/common/std_headers.h"
+#include "tlbcore/common/packetbuf_types.h"
+#include "tlbcore/common/packet_log.h"
+
+static int failures = 0;
+
+static void check(bool ok, string const &what)
+{
+  printf("%s: %s\n", ok ? "ok" : "FAIL", what.c_str());
+  if (!ok) failures++;
+}
+
+static string log_fn()
+{
+  return "/tmp/t_packet_log_" + to_string(getpid()) + ".log";
+}
+
+/*
+  Packet seq holds seq and (seq % 50) bytes of filler, and gets timestamp seq / 4, so several
+  packets in a row share a timestamp and some of those runs straddle a block boundary.
+*/
+static packet mk_pkt(U64 seq)
+{
+  packet ret;
+  ret.add(seq);
+  ret.add_bytes(string(seq % 50, 'a' + seq % 26).data(), seq % 50);
+  return ret;
+}
+
+static double mk_ts(U64 seq)
+{
+  return (double)(seq / 4);
+}
+
+static bool pkt_ok(U64 seq, double ts, packet &it)
+{
+  return ts == mk_ts(seq) && it.remaining() == (ssize_t)(8 + seq % 50) && it.fget< U64 >() == seq;
+}
+
+static void write_log(string const &fn, U64 begin, U64 end, int level, bool append = false)
+{
+  packet_log_writer w(fn, append, level, 256);
+  for (U64 seq = begin; seq < end; seq++) w.add(mk_pkt(seq), mk_ts(seq));
+}
+
+// Read everything from seq 0, checking each packet
+static bool read_all_ok(packet_log_reader const &r, U64 expected)
+{
+  auto c = r.seek(0);
+  packet it;
+  double ts;
+  U64 n = 0;
+  while (c.next(it, ts)) {
+    if (!pkt_ok(n, ts, it)) return false;
+    n++;
+  }
+  return n == expected && r.size() == expected;
+}
+
+static void file_write_at(string const &fn, off_t pos, void const *data, size_t size)
+{
+  int fd = open(fn.c_str(), O_WRONLY, 0);
+  if (fd < 0 || pwrite(fd, data, size, pos) != (ssize_t)size) throw runtime_error(fn + ": pwrite failed");
+  close(fd);
+}
+
+static off_t file_size(string const &fn)
+{
+  struct stat st;
+  if (stat(fn.c_str(), &st) < 0) return -1;
+  return st.st_size;
+}
+
+static void t_round_trip()
+{
+  auto fn = log_fn();
+  for (int level : {0, 3}) {
+    write_log(fn, 0, 1000, level);
+    packet_log_reader r(fn);
+    check(!r.recovered && r.n_blocks() > 10, "level " + to_string(level) + ": index read from the footer, " + to_string(r.n_blocks()) + " blocks");
+    check(read_all_ok(r, 1000), "level " + to_string(level) + ": 1000 packets read back in order");
+  }
+
+  { packet_log_writer w(fn); }
+  packet_log_reader empty(fn);
+  packet it;
+  double ts;
+  check(empty.size() == 0 && !empty.recovered && !empty.seek(0).next(it, ts), "an empty log");
+  unlink(fn.c_str());
+}
+
+/*
+  Cut the file partway into block k, as if the writer died while writing it. The reader finds
+  the blocks before it, and a writer opened with append drops the partial block and carries on
+  with the next sequence number.
+*/
+static void t_recover()
+{
+  auto fn = log_fn();
+  write_log(fn, 0, 1000, 3);
+  vector< packet_log_block_info > index;
+  size_t data_end;
+  {
+    packet_log_reader r(fn);
+    index = r.index;
+    data_end = r.data_end;
+  }
+
+  if (truncate(fn.c_str(), (off_t)data_end) < 0) throw runtime_error("truncate failed");
+  {
+    packet_log_reader r(fn);
+    check(r.recovered && read_all_ok(r, 1000), "no footer: every block recovered");
+  }
+
+  size_t k = index.size() / 2;
+  if (truncate(fn.c_str(), (off_t)(index[k].offset + sizeof(packet_log_block_hdr) + 10)) < 0) throw runtime_error("truncate failed");
+  U64 kept = index[k].first_seq;
+  {
+    packet_log_reader r(fn);
+    check(r.recovered && r.n_blocks() == k && read_all_ok(r, kept), "partial block: the blocks before it recovered");
+  }
+
+  write_log(fn, kept, kept + 500, 3, true);
+  {
+    packet_log_reader r(fn);
+    check(!r.recovered && read_all_ok(r, kept + 500), "append after a crash continues the sequence, with a good footer");
+    check(file_size(fn) == (off_t)(r.data_end + r.n_blocks() * sizeof(packet_log_block_info) + 24),
+          "the partial block and the old footer are gone");
+  }
+
+  write_log(fn, kept + 500, kept + 600, 0, true);
+  {
+    packet_log_reader r(fn);
+    check(!r.recovered && read_all_ok(r, kept + 600), "append to a closed log, mixing compressed and uncompressed blocks");
+  }
+  unlink(fn.c_str());
+}
+
+/*
+  A footer or index that doesn't agree with the blocks is ignored in favour of walking them. A
+  corrupt block is only noticed when it's read.
+*/
+static void t_bad_index()
+{
+  auto fn = log_fn();
+  write_log(fn, 0, 1000, 3);
+  vector< packet_log_block_info > index;
+  size_t data_end;
+  {
+    packet_log_reader r(fn);
+    index = r.index;
+    data_end = r.data_end;
+  }
+  off_t total = file_size(fn);
+
+  packet_log_block_info bad = index[3];
+  bad.first_seq += 1;
+  file_write_at(fn, (off_t)(data_end + 3 * sizeof(bad)), &bad, sizeof(bad));
+  {
+    packet_log_reader r(fn);
+    check(r.recovered && read_all_ok(r, 1000), "an index entry with the wrong first_seq");
+  }
+  file_write_at(fn, (off_t)(data_end + 3 * sizeof(bad)), &index[3], sizeof(bad));
+
+  bad = index[5];
+  bad.offset += 8;
+  file_write_at(fn, (off_t)(data_end + 5 * sizeof(bad)), &bad, sizeof(bad));
+  {
+    packet_log_reader r(fn);
+    check(r.recovered && read_all_ok(r, 1000), "an index entry pointing at the wrong place");
+  }
+  file_write_at(fn, (off_t)(data_end + 5 * sizeof(bad)), &index[5], sizeof(bad));
+
+  U64 n_blocks = index.size() + 1;
+  file_write_at(fn, total - 16, &n_blocks, sizeof(n_blocks));
+  {
+    packet_log_reader r(fn);
+    check(r.recovered && read_all_ok(r, 1000), "a footer with the wrong block count");
+  }
+  n_blocks = 1ULL << 60;
+  file_write_at(fn, total - 16, &n_blocks, sizeof(n_blocks));
+  {
+    packet_log_reader r(fn);
+    check(r.recovered && read_all_ok(r, 1000), "a footer with an absurd block count");
+  }
+  n_blocks = index.size();
+  file_write_at(fn, total - 16, &n_blocks, sizeof(n_blocks));
+  U64 bad_offset = 3;
+  file_write_at(fn, total - 24, &bad_offset, sizeof(bad_offset));
+  {
+    packet_log_reader r(fn);
+    check(r.recovered && read_all_ok(r, 1000), "a footer with an index_offset inside the header");
+  }
+  file_write_at(fn, total - 24, &data_end, sizeof(data_end));
+  {
+    packet_log_reader r(fn);
+    check(!r.recovered && read_all_ok(r, 1000), "all put back");
+  }
+
+  u_char junk = 0x5a;
+  file_write_at(fn, (off_t)(index[2].offset + sizeof(packet_log_block_hdr) + 5), &junk, 1);
+  {
+    packet_log_reader r(fn);
+    string err;
+    try {
+      r.read_block(2);
+    }
+    catch (runtime_error const &ex) {
+      err = ex.what();
+    }
+    check(err.find("checksum") != string::npos, "a corrupt block throws when read");
+    err.clear();
+    try {
+      read_all_ok(r, 1000);
+    }
+    catch (runtime_error const &ex) {
+      err = ex.what();
+    }
+    check(err.find("checksum") != string::npos, "so does a cursor reading through it");
+  }
+
+  file_write_at(fn, 0, "XXXX", 4);
+  string err;
+  try {
+    packet_log_reader r(fn);
+  }
+  catch (runtime_error const &ex) {
+    err = ex.what();
+  }
+  check(!err.empty(), "a bad file header throws");
+
+  if (truncate(fn.c_str(), 5) < 0) throw runtime_error("truncate failed");
+  err.clear();
+  try {
+    packet_log_reader r(fn);
+  }
+  catch (runtime_error const &ex) {
+    err = ex.what();
+  }
+  check(!err.empty(), "a file shorter than the header throws");
+  unlink(fn.c_str());
+}
+
+static bool next_is(packet_log_cursor c, U64 seq)
+{
+  packet it;
+  double ts;
+  return c.next(it, ts) && c.seq == seq + 1 && pkt_ok(seq, ts, it);
+}
+
+static bool at_end(packet_log_cursor c)
+{
+  packet it;
+  double ts;
+  return !c.next(it, ts);
+}
+
+static void t_seek()
+{
+  auto fn = log_fn();
+  write_log(fn, 0, 1000, 3);
+  packet_log_reader r(fn);
+
+  bool seqOk = true, timeOk = true;
+  for (size_t bi = 0; bi < r.n_blocks(); bi++) {
+    auto &info = r.index[bi];
+    U64 first = info.first_seq, last = first + info.n_packets - 1;
+    seqOk = seqOk && r.find_seq(first) == bi && r.find_seq(last) == bi;
+    seqOk = seqOk && next_is(r.seek(first), first) && next_is(r.seek(last), last);
+    if (first > 0) seqOk = seqOk && next_is(r.seek(first - 1), first - 1);
+
+    // The first packet at or after each time, whichever block it's in
+    for (double t : {info.first_ts, info.last_ts, info.first_ts - 0.5, info.last_ts + 0.5}) {
+      if (t < 0) continue;
+      U64 want = (U64)ceil(t) * 4;
+      timeOk = timeOk && (want >= 1000 ? at_end(r.seek_time(t)) : next_is(r.seek_time(t), want));
+    }
+  }
+  check(seqOk, "seek to the first and last packet of every block, and the one before");
+  check(timeOk, "seek_time to the start and end of every block, and between blocks");
+  check(at_end(r.seek(1000)) && at_end(r.seek(5000)) && r.find_seq(1000) == r.n_blocks(), "seek past the end");
+  check(at_end(r.seek_time(1e9)) && r.find_time(1e9) == r.n_blocks(), "seek_time past the end");
+  check(next_is(r.seek_time(-1e9), 0), "seek_time before the start");
+
+  // A cursor carries on across block boundaries
+  auto c = r.seek(r.index[1].first_seq - 2);
+  packet it;
+  double ts;
+  bool runOk = true;
+  for (U64 seq = r.index[1].first_seq - 2; seq < r.index[3].first_seq + 2; seq++) {
+    runOk = runOk && c.next(it, ts) && pkt_ok(seq, ts, it);
+  }
+  check(runOk, "a cursor runs across several block boundaries");
+  unlink(fn.c_str());
+}
+
+static bool scan_ok(packet_log_reader const &r, U64 begin, U64 end, size_t n_threads)
+{
+  U64 lim = min(end, r.size());
+  vector< std::atomic< int > > seen(r.size());
+  std::atomic< bool > bad {false};
+  r.scan_parallel(begin, end, n_threads, [&](U64 seq, double ts, packet &it) {
+    if (seq >= seen.size() || !pkt_ok(seq, ts, it)) {
+      bad = true;
+      return;
+    }
+    seen[seq]++;
+  });
+  for (U64 seq = 0; seq < r.size(); seq++) {
+    if (seen[seq] != (seq >= begin && seq < lim ? 1 : 0)) return false;
+  }
+  return !bad;
+}
+
+static void t_scan_parallel()
+{
+  auto fn = log_fn();
+  write_log(fn, 0, 1000, 3);
+  packet_log_reader r(fn);
+  U64 b1 = r.index[1].first_seq, b2 = r.index[2].first_seq, b5 = r.index[5].first_seq;
+
+  check(scan_ok(r, 0, 1000, 4) && scan_ok(r, 0, 1000, 1), "scan everything, with 4 threads and with 1");
+  check(scan_ok(r, b1, b2, 4), "scan exactly one block");
+  check(scan_ok(r, b2 - 1, b2 + 1, 4), "scan 2 packets across a block boundary");
+  check(scan_ok(r, b1 + 1, b5 - 1, 3), "scan from inside one block to inside another");
+  check(scan_ok(r, 990, 5000, 4), "scan a range running past the end");
+  check(scan_ok(r, 500, 500, 4) && scan_ok(r, 2000, 3000, 4), "empty ranges call nothing");
+
+  string err;
+  std::atomic< int > calls {0};
+  try {
+    r.scan_parallel(0, 1000, 4, [&](U64 seq, double ts, packet &it) {
+      calls++;
+      if (seq == b5) throw runtime_error("stop");
+    });
+  }
+  catch (runtime_error const &ex) {
+    err = ex.what();
+  }
+  check(err == "stop" && calls < 1000, "an exception from f stops the scan and is rethrown");
+  unlink(fn.c_str());
+}
+
+int main()
+{
+  t_round_trip();
+  t_recover();
+  t_bad_index();
+  t_seek();
+  t_scan_parallel();
+  printf("%s\n", failures ? "FAILED" : "all ok");
+  return failures ? 1 : 0;
+}
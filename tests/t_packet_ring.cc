@@ -0,0 +1,170 @@
+/*
+  Checks for packet_ring: round trips, batches, forwarding slices, and rejecting corrupt records.
+  Prints one line per check and exits non-zero if any failed.
+
+  Compile and run from tests/, with the same include path (the directory containing tlbcore)
+  and libraries as the node module:
+  $ g++ -std=c++14 -O2 -I../.. -o t_packet_ring t_packet_ring.cc ../common/packet_ring.cc ../common/packetbuf.cc ../common/packetbuf_compact.cc ../common/hacks.cc -lpthread && ./t_packet_ring
+*/
+#include "tlbcore/common/std_headers.h"
+#include "tlbcore/common/packetbuf_types.h"
+#include "tlbcore/common/packet_ring.h"
+
+static int failures = 0;
+
+static void check(bool ok, string const &what)
+{
+  printf("%s: %s\n", ok ? "ok" : "FAIL", what.c_str());
+  if (!ok) failures++;
+}
+
+static void t_round_trip()
+{
+  packet_ring ring;
+  ring.create(4096);
+  check(ring.capacity == 4096 && ring.max_size() == 4096 - 8, "capacity and max_size");
+
+  // Enough to wrap around the ring several times
+  bool allOk = true;
+  packet rx;
+  for (U32 i = 0; i < 1000; i++) {
+    packet tx;
+    tx.add(i);
+    tx.add_bytes(string(i % 97, 'z').data(), i % 97);
+    ring.write(tx);
+    if (!ring.try_read(rx) || rx.size() != 4 + i % 97 || rx.fget< U32 >() != i) allOk = false;
+  }
+  check(allOk, "1000 packets of varying size round trip through a small ring");
+  check(!ring.try_read(rx) && ring.used() == 0, "empty afterwards");
+
+  packet batch[3];
+  for (U32 k = 0; k < 3; k++) batch[k].add(k);
+  ring.write_batch(batch, 3);
+  vector< packet > got;
+  check(ring.read_batch(got, 10) == 3 && got[2].fget< U32 >() == 2, "write_batch then read_batch");
+
+  packet big(string(ring.max_size() + 1, 'x'));
+  string err;
+  try {
+    ring.write(big);
+  }
+  catch (runtime_error const &ex) {
+    err = ex.what();
+  }
+  check(!err.empty(), "a packet bigger than max_size throws");
+}
+
+/*
+  Packets from get_pkt (as PacketStream and packet_log_cursor deliver them) start partway into
+  a bigger buffer. The ring must send just the slice.
+*/
+static void t_slice()
+{
+  packet_ring ring;
+  ring.create(4096);
+  packet outer;
+  outer.add((U64)0xdeadbeefdeadbeefULL);
+  packet inner;
+  inner.add((U32)42);
+  outer.add_pkt(inner);
+  outer.add((U32)99);
+
+  outer.get_skip(8);
+  packet slice = outer.get_pkt();
+  ring.write(slice);
+  packet rx;
+  check(ring.try_read(rx) && rx.size() == 4 && rx.fget< U32 >() == 42, "a get_pkt slice arrives as just its 4 bytes");
+
+  packet partly;
+  partly.add((U32)1);
+  partly.add((U32)2);
+  partly.fget< U32 >();
+  ring.write(partly);
+  check(ring.try_read(rx) && rx.size() == 4 && rx.fget< U32 >() == 2, "already-read bytes aren't sent");
+}
+
+static void t_corrupt()
+{
+  packet_ring ring;
+  ring.create(4096);
+  packet tx;
+  tx.add((U32)5);
+  ring.write(tx);
+  ring.write(tx);
+  U32 bad = 100000;
+  memcpy(ring.data, &bad, sizeof(bad));
+  string err;
+  packet rx;
+  try {
+    ring.try_read(rx);
+  }
+  catch (runtime_error const &ex) {
+    err = ex.what();
+  }
+  check(!err.empty(), "a record size beyond commit_pos throws");
+
+  bad = 25; // fits in the ring, but runs past the end of the second record
+  memcpy(ring.data, &bad, sizeof(bad));
+  err.clear();
+  vector< packet > got;
+  try {
+    ring.read_batch(got, 10);
+  }
+  catch (runtime_error const &ex) {
+    err = ex.what();
+  }
+  check(!err.empty() && got.empty(), "read_batch throws on a record running past commit_pos");
+}
+
+/*
+  Not a check: round trip latency for small packets, then throughput for 1 MB ones.
+*/
+static void t_speed()
+{
+  packet_ring ping, pong;
+  ping.create(65536);
+  pong.create(65536);
+  const int n_pings = 100000;
+  thread echo([&ping, &pong, n_pings]() {
+    packet rx;
+    for (int i = 0; i < n_pings; i++) {
+      ping.read(rx);
+      pong.write(rx);
+    }
+  });
+  packet tx, rx;
+  tx.add((U64)0);
+  double t0 = realtime();
+  for (int i = 0; i < n_pings; i++) {
+    ping.write(tx);
+    pong.read(rx);
+  }
+  double t1 = realtime();
+  echo.join();
+
+  packet_ring bulk;
+  bulk.create(16*1024*1024);
+  string big_data(1024*1024, 'x');
+  packet big(big_data);
+  const int n_big = 2000;
+  thread consumer([&bulk, n_big]() {
+    packet rx;
+    for (int i = 0; i < n_big; i++) bulk.read(rx);
+  });
+  double t2 = realtime();
+  for (int i = 0; i < n_big; i++) bulk.write(big);
+  consumer.join();
+  double t3 = realtime();
+  printf("round_trip_ns=%0.3g\nbig_bytes_per_sec=%0.3g\n",
+    (t1 - t0) / n_pings * 1e9, (double)n_big * big.size() / (t3 - t2));
+}
+
+int main()
+{
+  t_round_trip();
+  t_slice();
+  t_corrupt();
+  t_speed();
+  printf("%s\n", failures ? "FAILED" : "all ok");
+  return failures ? 1 : 0;
+}
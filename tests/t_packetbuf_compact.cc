@@ -0,0 +1,225 @@
+/*
+  Checks for packetbuf_compact: varints, zigzag, and the Stream VByte vectors (SSSE3 and scalar
+  decoding, delta and zigzag), plus rejecting truncated and corrupt input. Prints one line per
+  check and exits non-zero if any failed.
+
+  Compile and run from tests/, with the same include path (the directory containing tlbcore)
+  and libraries as the node module:
+  $ g++ -std=c++14 -O2 -I../.. -o t_packetbuf_compact t_packetbuf_compact.cc ../common/packetbuf.cc ../common/packetbuf_compact.cc ../common/hacks.cc -lpthread && ./t_packetbuf_compact
+*/
+#include "tlbcore/common/std_headers.h"
+#include "tlbcore/common/packetbuf_types.h"
+#include "tlbcore/common/packetbuf_compact.h"
+
+static int failures = 0;
+
+static void check(bool ok, string const &what)
+{
+  printf("%s: %s\n", ok ? "ok" : "FAIL", what.c_str());
+  if (!ok) failures++;
+}
+
+/*
+  Write x, then pad bytes of something else, and read it back. With no padding, the last 16
+  bytes or so of a vector are past where the SSSE3 loop can load, so they take the scalar path.
+  With 64 bytes of padding the SSSE3 loop does all the whole groups.
+*/
+template<typename T>
+static bool round_trip(T const &x, size_t pad)
+{
+  packet p;
+  p.add_compact(x);
+  for (size_t i = 0; i < pad; i++) p.add((U8)0xa5);
+  T y;
+  p.get_compact(y);
+  return y == x && p.remaining() == (ssize_t)pad;
+}
+
+template<typename T>
+static bool round_trips(T const &x)
+{
+  return round_trip(x, 0) && round_trip(x, 64);
+}
+
+// The flags byte of an encoded vector, after the 1-byte size (so n < 128)
+template<typename T>
+static u_char vector_flags(vector< T > const &x)
+{
+  packet p;
+  p.add_compact(x);
+  return p.ptr()[1];
+}
+
+template<typename T>
+static bool throws(packet p)
+{
+  T y;
+  try {
+    p.get_compact(y);
+  }
+  catch (exception const &ex) {
+    return true;
+  }
+  return false;
+}
+
+/*
+  Values spread over every byte length, so every length code and every control byte pattern
+  turns up.
+*/
+template<typename U>
+static vector< U > mixed_values(size_t n, U64 seed)
+{
+  vector< U > ret(n);
+  for (size_t i = 0; i < n; i++) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    int bits = (int)((seed >> 58) % (8 * sizeof(U))) + 1;
+    ret[i] = (U)((seed >> 3) & (bits >= 64 ? ~0ULL : ((1ULL << bits) - 1)));
+  }
+  return ret;
+}
+
+static void t_scalars()
+{
+  bool allOk = true;
+  for (U64 v : {0ULL, 1ULL, 127ULL, 128ULL, 16383ULL, 16384ULL, 0xffffffffULL, ~0ULL}) {
+    allOk = allOk && round_trips(v);
+    if (v <= 0xffffffffULL) allOk = allOk && round_trips((U32)v);
+    if (v <= 0xffffULL) allOk = allOk && round_trips((U16)v);
+  }
+  check(allOk, "U16, U32 and U64 round trip at varint length boundaries");
+
+  allOk = true;
+  for (S64 v : {0LL, -1LL, 1LL, -64LL, 64LL, (S64)INT_MIN, (S64)INT_MAX, LLONG_MIN, LLONG_MAX}) {
+    allOk = allOk && round_trips(v);
+    if (v >= INT_MIN && v <= INT_MAX) allOk = allOk && round_trips((S32)v);
+    if (v >= SHRT_MIN && v <= SHRT_MAX) allOk = allOk && round_trips((S16)v);
+  }
+  check(allOk, "S16, S32 and S64 round trip, including the extremes");
+
+  packet p;
+  p.add_compact((S32)-1);
+  p.add_compact((S32)1);
+  check(p.size() == 2 && p.ptr()[0] == 1 && p.ptr()[1] == 2, "zigzag makes small negative numbers small");
+
+  check(round_trips(string("")) && round_trips(string(300, 'q')), "strings round trip");
+  check(round_trips(vector< U16 >({0, 1, 300, 65535})), "vector< U16 > round trips");
+  check(round_trips(map< string, U32 >({{"a", 1}, {"b", 100000}})), "map round trips");
+}
+
+static void t_vectors()
+{
+  bool allOk = true;
+  for (size_t n = 0; n < 40; n++) {
+    allOk = allOk && round_trips(mixed_values< U32 >(n, n)) && round_trips(mixed_values< U64 >(n, n));
+  }
+  check(allOk, "U32 and U64 vectors of every length up to 40 round trip");
+
+  auto big32 = mixed_values< U32 >(10001, 1);
+  auto big64 = mixed_values< U64 >(10001, 2);
+  check(round_trips(big32) && round_trips(big64), "10001-element U32 and U64 vectors round trip");
+
+  vector< S32 > s32(big32.begin(), big32.end());
+  vector< S64 > s64(big64.begin(), big64.end());
+  check(round_trips(s32) && round_trips(s64), "signed vectors with values of both signs round trip");
+  check(vector_flags(vector< S32 >({5, -3, 7})) == PACKET_COMPACT_ZIGZAG, "unsorted signed vectors are zigzagged");
+  check(vector_flags(vector< U32 >({5, 3, 7})) == 0, "unsorted unsigned vectors are stored plain");
+}
+
+/*
+  Sorted vectors are stored as differences. Signed ones can start negative, and the differences
+  can be bigger than the type (INT_MIN to INT_MAX), which must wrap around correctly.
+*/
+static void t_delta()
+{
+  vector< U32 > su32;
+  for (U32 i = 0; i < 1000; i++) su32.push_back(1000000 + i * 10);
+  check(vector_flags(vector< U32 >({1, 2, 2, 9})) == PACKET_COMPACT_DELTA && round_trips(su32), "sorted U32 vector");
+
+  vector< U64 > su64;
+  for (U64 i = 0; i < 1000; i++) su64.push_back(i << 40);
+  check(round_trips(su64), "sorted U64 vector with big steps");
+
+  packet p1, p2;
+  p1.add_compact(su32);
+  p2.add_compact(vector< U32 >(su32.rbegin(), su32.rend()));
+  check(p1.size() < p2.size() / 2, "delta makes a slowly increasing vector smaller than the same values unsorted");
+
+  vector< S32 > neg32 {-1000000, -5000, -1, 0, 1, 77};
+  check(vector_flags(neg32) == PACKET_COMPACT_DELTA && round_trips(neg32), "sorted S32 vector starting negative");
+  vector< S32 > wide32 {INT_MIN, -1, 0, INT_MAX};
+  check(round_trips(wide32), "sorted S32 vector from INT_MIN to INT_MAX");
+  vector< S64 > wide64 {LLONG_MIN, -5, 0, 5, LLONG_MAX};
+  check(vector_flags(wide64) == PACKET_COMPACT_DELTA && round_trips(wide64), "sorted S64 vector from LLONG_MIN to LLONG_MAX");
+  vector< S64 > negRun;
+  for (S64 i = -3000; i < 3000; i += 7) negRun.push_back(i);
+  check(round_trips(negRun), "long sorted S64 vector crossing zero");
+}
+
+static void t_corrupt()
+{
+  vector< U32 > x = mixed_values< U32 >(100, 4);
+  packet good;
+  good.add_compact(x);
+
+  bool allTruncated = true;
+  for (size_t len = 0; len < good.size(); len++) {
+    allTruncated = allTruncated && throws< vector< U32 > >(packet(good.ptr(), len));
+  }
+  check(allTruncated, "every truncation of a U32 vector throws");
+
+  packet good64;
+  good64.add_compact(mixed_values< U64 >(100, 5));
+  allTruncated = true;
+  for (size_t len = 0; len < good64.size(); len++) {
+    allTruncated = allTruncated && throws< vector< U64 > >(packet(good64.ptr(), len));
+  }
+  check(allTruncated, "every truncation of a U64 vector throws");
+
+  packet badFlags(good.ptr(), good.size());
+  badFlags.ptr()[1] = 0x10;
+  check(throws< vector< U32 > >(badFlags), "unknown vector flags throw");
+
+  // All 4-byte lengths: the data runs past the end of the packet
+  packet longCtrl(good.ptr(), good.size());
+  memset(longCtrl.ptr() + 2, 0xff, 25);
+  check(throws< vector< U32 > >(longCtrl), "control bytes claiming more data than there is throw");
+
+  packet hugeSize;
+  packet_wr_varint(hugeSize, 1ULL << 40);
+  hugeSize.add((U8)0);
+  check(throws< vector< U32 > >(hugeSize) && throws< vector< U16 > >(hugeSize) && throws< string >(hugeSize),
+        "unreasonable sizes throw");
+
+  packet longVarint(string(11, '\x80'));
+  check(throws< U64 >(longVarint), "a varint longer than 10 bytes throws");
+
+  packet tooBig;
+  packet_wr_varint(tooBig, 1ULL << 33);
+  check(throws< U32 >(tooBig) && throws< S32 >(tooBig), "a varint too big for the type throws");
+  packet tooBig16;
+  packet_wr_varint(tooBig16, 70000);
+  check(throws< U16 >(tooBig16), "a varint too big for U16 throws");
+
+  packet checked;
+  checked.add_compact_checked((U32)5);
+  U32 plain = 0;
+  string err;
+  try {
+    checked.get_checked(plain);
+  }
+  catch (packet_rd_type_err const &ex) {
+    err = ex.what();
+  }
+  check(!err.empty(), "reading a checked compact value with plain get_checked throws");
+}
+
+int main()
+{
+  t_scalars();
+  t_vectors();
+  t_delta();
+  t_corrupt();
+  printf("%s\n", failures ? "FAILED" : "all ok");
+  return failures ? 1 : 0;
+}
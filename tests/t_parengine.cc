@@ -0,0 +1,163 @@
+/*
+  Checks for ParEngine: work-stealing with nested submits, admission against the memory budget,
+  and ParTaskGraph ordering and skipping. Prints one line per check and exits non-zero if any
+  failed.
+
+  Compile and run from tests/, with the same include path (the directory containing tlbcore)
+  and libraries as the node module:
+  $ g++ -std=c++14 -O2 -I../.. -o t_parengine t_parengine.cc ../common/parengine.cc ../common/hacks.cc -luv -lpthread && ./t_parengine
+*/
+#include "tlbcore/common/std_headers.h"
+#include "tlbcore/common/parengine.h"
+
+static int failures = 0;
+
+static void check(bool ok, string const &what)
+{
+  printf("%s: %s\n", ok ? "ok" : "FAIL", what.c_str());
+  if (!ok) failures++;
+}
+
+/*
+  Every level submits one half and computes the other itself, then helps run jobs until its
+  half is done. That exercises push/pop on the owner's deque, stealing from it, and waiting
+  without deadlocking when there are more waiters than threads.
+*/
+static void t_nested(ParEngine &pe)
+{
+  std::function< long(int) > fib = [&](int n) -> long {
+    if (n < 12) {
+      long a = 0, b = 1;
+      for (int i = 0; i < n; i++) {
+        long c = a + b;
+        a = b;
+        b = c;
+      }
+      return a;
+    }
+    auto f1 = pe.submit([&fib, n]() { return fib(n - 1); });
+    long r2 = fib(n - 2);
+    pe.wait(f1);
+    return f1.get() + r2;
+  };
+  auto ff = pe.submit([&]() { return fib(27); });
+  pe.wait(ff);
+  check(ff.get() == 196418, "nested submits compute fib(27)");
+
+  const int N = 50000;
+  std::atomic< long long > sum {0};
+  for (int i = 0; i < N; i++) pe.submit([&sum, i]() { sum += i; });
+  pe.finish();
+  check(sum == (long long)N * (N - 1) / 2, "every one of 50000 jobs ran once");
+}
+
+/*
+  With a budget of 1000 units, jobs declaring 400 can only run 2 at a time. One declaring more
+  than the whole budget still runs, alone.
+*/
+static void t_admission(ParEngine &pe)
+{
+  std::atomic< int > cur {0}, peak {0};
+  for (int i = 0; i < 20; i++) {
+    pe.submit(400, [&]() {
+      int c = ++cur;
+      int p = peak;
+      while (c > p && !peak.compare_exchange_weak(p, c)) {}
+      this_thread::sleep_for(chrono::milliseconds(2));
+      cur--;
+    });
+  }
+  std::atomic< bool > hugeRan {false};
+  pe.submit(5000, [&]() { hugeRan = true; });
+  pe.finish();
+  check(peak.load() >= 1 && peak.load() <= 2, "400-unit jobs in a 1000-unit budget run at most 2 at once (peak " + to_string(peak.load()) + ")");
+  check(hugeRan.load(), "a job bigger than the budget still runs");
+  check(pe.memUsed == 0, "all memory released after finish");
+
+  auto fe = pe.submit([]() -> int { throw runtime_error("boom"); });
+  string caught;
+  try {
+    fe.get();
+  }
+  catch (runtime_error const &ex) {
+    caught = ex.what();
+  }
+  check(caught == "boom", "submit delivers a job's exception through its future");
+
+  std::atomic< bool > afterRan {false};
+  pe.submitFn(500, []() { throw runtime_error("swallowed"); });
+  pe.submitFn(500, [&]() { afterRan = true; });
+  pe.finish();
+  check(afterRan.load() && pe.memUsed == 0, "a throwing submitFn job still releases its memory");
+}
+
+/*
+  big (900 units) and fit (100) fill the budget, so none of the 300-unit smalls can start until
+  big is done, even though they were added first: big has a longer chain hanging off it. bad
+  throws, so what depends on it gets skipped and run() rethrows.
+*/
+static void t_graph(ParEngine &pe)
+{
+  ParTaskGraph g(&pe);
+  mutex orderMtx;
+  vector< string > order;
+  auto job = [&](string const &name) {
+    return [&, name]() {
+      {
+        unique_lock< mutex > lock(orderMtx);
+        order.push_back(name);
+      }
+      this_thread::sleep_for(chrono::milliseconds(5));
+    };
+  };
+  for (int i = 0; i < 10; i++) g.add("small" + to_string(i), 300, job("small" + to_string(i)));
+  auto big = g.add("big", 900, job("big"));
+  auto fit = g.add("fit", 100, job("fit"));
+  auto ser = g.add("ser", 100, job("ser"), {fit});
+  auto comp = g.add("comp", 100, job("comp"), {ser, big});
+  auto bad = g.add("bad", 0, []() { throw runtime_error("bad job"); });
+  auto after = g.add("afterbad", 0, job("afterbad"), {bad});
+  g.add("afterafter", 0, job("afterafter"), {after, comp});
+
+  string caught;
+  try {
+    g.run();
+  }
+  catch (runtime_error const &ex) {
+    caught = ex.what();
+  }
+  check(caught == "bad job", "run() rethrows the failed job's exception");
+
+  auto pos = [&](string const &name) {
+    return (int)(find(order.begin(), order.end(), name) - order.begin());
+  };
+  bool bigFirst = pos("big") < (int)order.size();
+  for (int i = 0; i < 10; i++) {
+    if (pos("small" + to_string(i)) <= pos("big")) bigFirst = false;
+  }
+  check(bigFirst, "the 900-unit job isn't starved by smaller ones added before it");
+  check(pos("ser") > pos("fit") && pos("comp") > pos("ser") && pos("comp") > pos("big"), "jobs start after their dependencies");
+  check(order.size() == 14 && pos("afterbad") == (int)order.size() && pos("afterafter") == (int)order.size(),
+        "jobs depending on the failed one are skipped, the rest run");
+  check(g.tasks[after].skipped && !g.tasks[comp].skipped, "skipped flags");
+  check(pe.memUsed == 0, "graph memory released");
+
+  string addErr;
+  try {
+    g.add("x", 0, []() {}, {100});
+  }
+  catch (runtime_error const &ex) {
+    addErr = ex.what();
+  }
+  check(!addErr.empty(), "add rejects a dependency that doesn't exist");
+}
+
+int main()
+{
+  ParEngine pe(4, 1000);
+  t_nested(pe);
+  t_admission(pe);
+  t_graph(pe);
+  printf("%s\n", failures ? "FAILED" : "all ok");
+  return failures ? 1 : 0;
+}
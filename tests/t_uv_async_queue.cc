@@ -0,0 +1,159 @@
+/*
+  Checks for UvAsyncQueue: several producer threads pushing at once, recycling items through the
+  free list, callables that throw, and destroying a queue with items still in it. Prints one line
+  per check and exits non-zero if any failed.
+
+  Compile and run from tests/, with the same include path (the directory containing tlbcore)
+  and libraries as the node module:
+  $ g++ -std=c++14 -O2 -I../.. -o t_uv_async_queue t_uv_async_queue.cc ../common/uv_wrappers.cc ../common/parengine.cc ../common/packetbuf.cc ../common/packetbuf_compact.cc ../common/hacks.cc -luv -lpthread && ./t_uv_async_queue
+*/
+#include "tlbcore/common/std_headers.h"
+
+static int failures = 0;
+
+static void check(bool ok, string const &what)
+{
+  printf("%s: %s\n", ok ? "ok" : "FAIL", what.c_str());
+  if (!ok) failures++;
+}
+
+/*
+  4 threads each push 50000 items while the loop drains them. Every item must run exactly once,
+  and each producer's items in the order it pushed them. The items go round the free list many
+  times, between the loop and the producers.
+*/
+static void t_producers(uv_loop_t *loop)
+{
+  const int nProducers = 4, nItems = 50000;
+  UvAsyncQueue q(loop);
+  vector< vector< int > > got(nProducers);
+  size_t nGot = 0;
+
+  vector< thread > producers;
+  for (int p = 0; p < nProducers; p++) {
+    producers.emplace_back([&q, &got, &nGot, p, nItems]() {
+      for (int k = 0; k < nItems; k++) {
+        q.push([&got, &nGot, p, k]() {
+          got[p].push_back(k);
+          nGot++;
+        });
+      }
+    });
+  }
+  while (nGot < (size_t)(nProducers * nItems)) {
+    uv_run(loop, UV_RUN_ONCE);
+  }
+  for (auto &it : producers) it.join();
+  uv_run(loop, UV_RUN_NOWAIT);
+
+  bool inOrder = true;
+  for (int p = 0; p < nProducers; p++) {
+    if (got[p].size() != (size_t)nItems) inOrder = false;
+    for (int k = 0; k < (int)got[p].size(); k++) {
+      if (got[p][k] != k) inOrder = false;
+    }
+  }
+  check(nGot == (size_t)(nProducers * nItems), "every item ran (" + to_string(nGot) + ")");
+  check(inOrder, "each producer's items ran exactly once, in the order pushed");
+  check(!q.head.load(), "nothing left queued");
+}
+
+static set< UvAsyncQueueItem * > list_items(UvAsyncQueueItem *it)
+{
+  set< UvAsyncQueueItem * > ret;
+  for (; it; it = it->next) ret.insert(it);
+  return ret;
+}
+
+/*
+  After a drain the items are on the free list. A thread that runs out of cached items takes
+  the whole list, and its next pushes reuse them instead of allocating.
+*/
+static void t_recycle(uv_loop_t *loop)
+{
+  UvAsyncQueue q(loop);
+  int nRan = 0;
+  thread([&]() {
+    for (int i = 0; i < 10; i++) q.push([&nRan]() { nRan++; });
+  }).join();
+  check(q.drain(true) == 10 && nRan == 10, "drain runs everything pushed");
+  auto freed = list_items(q.freeItems.load());
+  check(freed.size() == 10, "the used items go on the free list");
+
+  bool reused = true;
+  thread([&]() {
+    for (int i = 0; i < 10; i++) {
+      q.push([&nRan]() { nRan++; });
+      if (!freed.count(q.head.load())) reused = false;
+    }
+  }).join();
+  check(reused && !q.freeItems.load(), "a new thread's pushes reuse the freed items");
+  check(q.drain(true) == 10 && nRan == 20 && list_items(q.freeItems.load()) == freed, "and they go back on the free list again");
+  uv_run(loop, UV_RUN_NOWAIT);
+}
+
+/*
+  A callable that throws mustn't stop the rest of the batch. drain rethrows the first exception,
+  and every item is destroyed and recycled. One of the throwers is too big for the inline
+  storage, so it's on the heap.
+*/
+static void t_throw(uv_loop_t *loop)
+{
+  UvAsyncQueue q(loop);
+  auto token = make_shared< int >(0);
+  int nRan = 0;
+  char big[100] {};
+  q.push([token]() { throw runtime_error("one"); });
+  q.push([token, &nRan]() { nRan++; });
+  q.push([token, big]() { throw runtime_error("big"); });
+  q.push([token, &nRan]() { nRan++; });
+  check(token.use_count() == 5, "4 items hold the token");
+
+  string err;
+  try {
+    q.drain(true);
+  }
+  catch (runtime_error const &ex) {
+    err = ex.what();
+  }
+  check(err == "one", "drain rethrows the first exception");
+  check(nRan == 2, "the items after a throwing one still run");
+  check(token.use_count() == 1, "all the callables are destroyed, throwing or not");
+  check(list_items(q.freeItems.load()).size() == 4 && !q.head.load(), "all the items are recycled");
+
+  q.push([&nRan]() { nRan++; });
+  uv_run(loop, UV_RUN_NOWAIT);
+  check(nRan == 3, "the queue still works after a throw");
+}
+
+/*
+  Destroying the queue destroys what's still in it without calling it. That includes move-only
+  callables and ones on the heap.
+*/
+static void t_destroy(uv_loop_t *loop)
+{
+  auto token = make_shared< int >(0);
+  int nRan = 0;
+  {
+    UvAsyncQueue q(loop);
+    char big[100] {};
+    q.push([token, &nRan]() { nRan++; });
+    q.push([token, big, &nRan]() { nRan++; });
+    auto owned = make_unique< int >(5);
+    q.push([token, owned = std::move(owned), &nRan]() { nRan += *owned; });
+    check(token.use_count() == 4, "3 items queued");
+  }
+  uv_run(loop, UV_RUN_NOWAIT);
+  check(nRan == 0 && token.use_count() == 1, "destroying the queue destroys its items without running them");
+}
+
+int main()
+{
+  uv_loop_t *loop = uv_default_loop();
+  t_producers(loop);
+  t_recycle(loop);
+  t_throw(loop);
+  t_destroy(loop);
+  printf("%s\n", failures ? "FAILED" : "all ok");
+  return failures ? 1 : 0;
+}
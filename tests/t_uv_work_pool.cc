@@ -0,0 +1,96 @@
+/*
+  Checks for UvWorkPool: priority order, cancel, errors from bodies, and destroying the pool from
+  inside a done callback. Prints one line per check and exits non-zero if any failed.
+
+  Compile and run from tests/, with the same include path (the directory containing tlbcore)
+  and libraries as the node module:
+  $ g++ -std=c++14 -O2 -I../.. -o t_uv_work_pool t_uv_work_pool.cc ../common/uv_wrappers.cc ../common/parengine.cc ../common/packetbuf.cc ../common/packetbuf_compact.cc ../common/hacks.cc -luv -lpthread && ./t_uv_work_pool
+*/
+#include "tlbcore/common/std_headers.h"
+
+static int failures = 0;
+
+static void check(bool ok, string const &what)
+{
+  printf("%s: %s\n", ok ? "ok" : "FAIL", what.c_str());
+  if (!ok) failures++;
+}
+
+/*
+  With one thread, held up by a first body that waits for go, the other 10 queue up and must
+  start in priority order (i % 3), then in the order they were added.
+*/
+static void t_priority(uv_loop_t *loop)
+{
+  vector< int > order;
+  int nDone = 0, nCancelled = 0;
+  string sevenError;
+  UvWorkPool pool(loop, 1);
+  std::atomic< bool > go {false};
+  // Highest priority, so it's what the thread picks up however soon it starts
+  uvWork(pool, [&](string &error, shared_ptr< void > &result) {
+    while (!go.load()) usleep(100);
+  }, [&](string const &error, shared_ptr< void > const &result) {
+    nDone++;
+  }, 100);
+
+  vector< U64 > ids;
+  for (int i = 0; i < 10; i++) {
+    ids.push_back(uvWork(pool, [i](string &error, shared_ptr< void > &result) {
+      result = make_shared< int >(i);
+      if (i == 7) throw runtime_error("seven");
+    }, [&, i](string const &error, shared_ptr< void > const &result) {
+      nDone++;
+      if (error.find("cancel") != string::npos) {
+        nCancelled++;
+      }
+      else if (i == 7) {
+        sevenError = error;
+      }
+      else {
+        order.push_back(*static_pointer_cast< int >(result));
+      }
+    }, i % 3));
+  }
+  check(pool.cancel(ids[4]), "cancel a body that hasn't started");
+  check(!pool.cancel(ids[4]), "cancelling it again does nothing");
+  go = true;
+  uv_run(loop, UV_RUN_DEFAULT);
+
+  check(nDone == 11, "every done gets called once, including the cancelled one");
+  check(nCancelled == 1, "the cancelled one's done gets an error");
+  check(sevenError == "seven", "a body's exception becomes its done's error");
+  check(order == vector< int >({2, 5, 8, 1, 0, 3, 6, 9}), "bodies start in priority order, then in order added");
+  check(pool.outstanding == 0, "nothing outstanding after the loop runs dry");
+}
+
+/*
+  Let everything finish before running the loop, so all the dones arrive in one batch, and
+  destroy the pool from the first.
+*/
+static void t_destroy_in_done(uv_loop_t *loop)
+{
+  auto pool = new UvWorkPool(loop, 2);
+  int nDone = 0;
+  for (int i = 0; i < 20; i++) {
+    pool->work([](string &error, shared_ptr< void > &result) {
+    }, [&](string const &error, shared_ptr< void > const &result) {
+      nDone++;
+      delete pool;
+      pool = nullptr;
+    });
+  }
+  usleep(100000);
+  uv_run(loop, UV_RUN_DEFAULT);
+  check(nDone == 1 && !pool, "destroying the pool in a done drops the rest of the batch");
+}
+
+int main()
+{
+  uv_loop_t *loop = uv_default_loop();
+  t_priority(loop);
+  uv_run(loop, UV_RUN_DEFAULT);
+  t_destroy_in_done(loop);
+  printf("%s\n", failures ? "FAILED" : "all ok");
+  return failures ? 1 : 0;
+}